@@ -0,0 +1,134 @@
+// Copyright 2019 (c) Christopher A. Taylor.  All rights reserved.
+
+/*
+    Block-DCT image codec tuned for the folded depth low bits.
+
+    This is a CPU-only backend for VideoCodec that needs no GPU.  Keyframes
+    are built like a simple JPEG: 8x8 integer DCT, dead-zone quantization,
+    and run-length coding of the coefficients with adaptive Golomb-Rice
+    codes.
+
+    The quantization matrix is tuned for the low bits produced by
+    DepthEncoder::Filter() rather than for natural images.  Folding makes
+    those mostly smooth ramps with sharp edges at object boundaries, and
+    every unit of error is a unit of depth error whatever its frequency, so
+    the matrix is much flatter than the JPEG one.
+
+    Other frames are P-frames predicted from the previous reconstructed
+    frame.  Each 16x16 macroblock is either skipped, coded as a motion
+    vector plus the transformed residual of its 8x8 blocks, or coded intra.
+    Motion search is an integer-pel hexagon search within +/-16 pixels
+    using SAD, which is where most of the encoder time goes.  The encoder
+    reconstructs each frame exactly like the decoder does, so there is no
+    drift between them.
+
+    Each row of macroblocks is coded independently so rows are searched,
+    transformed and coded in parallel on the shared WorkerPool, both ways.
+    The SAD and transforms use AVX2 when the CPU supports it.
+
+    Bitstream format:
+
+        uint8_t Quantizer
+        uint8_t Frame type (0 = intra, 1 = inter)
+        uint32_t Compressed bytes for each row of macroblocks (little-endian)
+        Coded bits for each row of macroblocks (MSB first)
+*/
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+namespace zdepth {
+
+
+//------------------------------------------------------------------------------
+// Constants
+
+// Bytes in the bitstream header, not including the row size table
+static const int kDctHeaderBytes = 2;
+
+// Frame types
+static const uint8_t kDctFrameIntra = 0;
+static const uint8_t kDctFrameInter = 1;
+
+// Range of the quantizer parameter
+static const int kDctMinQuantizer = 1;
+static const int kDctMaxQuantizer = 64;
+
+
+//------------------------------------------------------------------------------
+// API
+
+// Largest compressed size of an image at any quantizer
+size_t DctCompressBound(int width, int height);
+
+
+//------------------------------------------------------------------------------
+// DctEncoder
+
+class DctEncoder
+{
+public:
+    // Compress an 8-bit image.
+    // The quantizer is the quantization step for the lowest frequencies,
+    // in units of 8-bit pixel values.  Larger is smaller and lossier.
+    // A keyframe is produced if requested or if the size changed.
+    // Importance is optional, with one byte for each 16x16 macroblock from
+    // 0 (unimportant) to 255: In P-frames unimportant macroblocks are
+    // skipped when the prediction is roughly right.
+    void Compress(
+        const uint8_t* image,
+        int width,
+        int height,
+        int quantizer,
+        bool keyframe,
+        const uint8_t* importance,
+        std::vector<uint8_t>& compressed);
+
+protected:
+    // Image padded out to a multiple of 16 pixels if needed
+    std::vector<uint8_t> Padded;
+
+    // Padded reconstruction of the previous frame and the current frame
+    std::vector<uint8_t> Reference;
+    std::vector<uint8_t> Reconstructed;
+
+    // Size of the reference frame, or 0 if there is none
+    int ReferenceWidth = 0;
+    int ReferenceHeight = 0;
+
+    // Output for each row of blocks
+    std::vector<std::vector<uint8_t>> RowData;
+    std::vector<int> RowBytes;
+};
+
+
+//------------------------------------------------------------------------------
+// DctDecoder
+
+class DctDecoder
+{
+public:
+    // Returns false if the data is invalid, or if it is a P-frame and the
+    // previous frame was not decoded
+    bool Decompress(
+        const uint8_t* data,
+        int bytes,
+        int width,
+        int height,
+        std::vector<uint8_t>& image);
+
+protected:
+    // Padded reconstruction of the previous frame and the current frame
+    std::vector<uint8_t> Reference;
+    std::vector<uint8_t> Reconstructed;
+
+    // Size of the reference frame, or 0 if there is none
+    int ReferenceWidth = 0;
+    int ReferenceHeight = 0;
+};
+
+
+} // namespace zdepth
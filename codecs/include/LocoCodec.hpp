@@ -0,0 +1,94 @@
+// Copyright 2019 (c) Christopher A. Taylor.  All rights reserved.
+
+/*
+    Near-lossless LOCO-I image codec (the algorithm behind JPEG-LS).
+
+    This is a CPU-only backend for VideoCodec that needs no GPU.  Each frame
+    is coded on its own (intra-only) so it runs the same on every frame.
+
+    Unlike H.264, every decoded pixel is guaranteed to be within `near` of
+    the input, which gives depth consumers a hard per-pixel error bound.
+    near = 0 is lossless.
+
+    Images are 8-bit, or 16-bit with any maximum value up to 65535, for
+    coding depth values directly without splitting them into bytes.
+
+    The coder follows ITU-T T.87: median edge-detect prediction, 365
+    contexts built from quantized local gradients with bias correction,
+    adaptive Golomb-Rice coding of the residuals, and a run mode for flat
+    regions.  The bitstream is not JPEG-LS compatible (no markers or bit
+    stuffing), it only carries a small header and the coded bits.
+
+    Bitstream format:
+
+        uint8_t Near
+        uint16_t MaxValue (little-endian)
+        Coded bits (MSB first)
+*/
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+namespace zdepth {
+
+
+//------------------------------------------------------------------------------
+// Constants
+
+// Bytes in the bitstream header
+static const int kLocoHeaderBytes = 3;
+
+// Largest supported near-lossless error bound
+static const int kLocoMaxNear = 255;
+
+
+//------------------------------------------------------------------------------
+// API
+
+// Largest compressed size of an image with values from 0 to max_value
+size_t LocoCompressBound(int width, int height, int max_value);
+
+// Compress an 8-bit image with every pixel decoding within `near` of the input
+void LocoCompress(
+    const uint8_t* image,
+    int width,
+    int height,
+    int near,
+    std::vector<uint8_t>& compressed);
+
+// Returns false if the data is invalid
+bool LocoDecompress(
+    const uint8_t* data,
+    int bytes,
+    int width,
+    int height,
+    std::vector<uint8_t>& image);
+
+// Compress a 16-bit image with values from 0 to max_value.
+// If skip is not null it holds one bit per pixel in raster order, LSB first,
+// and pixels with a 1 bit may decode to any value.  They are coded as
+// whatever is cheapest.
+void LocoCompress16(
+    const uint16_t* image,
+    const uint8_t* skip,
+    int width,
+    int height,
+    int max_value,
+    int near,
+    std::vector<uint8_t>& compressed);
+
+// Returns false if the data is invalid or was compressed with another
+// max_value
+bool LocoDecompress16(
+    const uint8_t* data,
+    int bytes,
+    int width,
+    int height,
+    int max_value,
+    std::vector<uint16_t>& image);
+
+
+} // namespace zdepth
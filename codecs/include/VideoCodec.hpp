@@ -11,8 +11,11 @@
     On Android/iOS there are OS-specific APIs around some pretty unreliable hw.
     Other platforms mostly use V4L2.
 
-    Currently only CUDA is implemented, but it is designed to make it
-    easier to add more hardware-accelerated backends.
+    CUDA is implemented for H.264/HEVC, and there is a CPU-only software
+    backend for codecs that do not need a GPU.  Backends implement the
+    VideoBackend interface and are picked at runtime from a registry, so more
+    hardware-accelerated backends can be added without touching the rest.
+    The CUDA backend is only built if ZDEPTH_CUDA is enabled in CMake.
 
     Note that most hardware encoders are limited to one/two sessions at a time,
     so it is often not desired to make more than one encoder instance.
@@ -37,12 +40,6 @@
 
 #pragma once
 
-// Nvidia NVENC/NVDEC uses the attached GPU for efficient encoding via CUDA
-#include <cuda_runtime_api.h>
-#include <NvEncoder.h>
-#include <NvEncoderCuda.h>
-#include <NvDecoder.h>
-
 #include <stdint.h>
 #include <memory>
 #include <vector>
@@ -51,42 +48,30 @@ namespace zdepth {
 
 
 //------------------------------------------------------------------------------
-// CUDA Context
+// Video Types
 
-struct CudaContext
+// These values are stored in the file format
+enum class VideoType
 {
-    ~CudaContext()
-    {
-        Destroy();
-    }
-
-    bool Valid() const
-    {
-        return Context != nullptr;
-    }
-
-    CUcontext Context = nullptr;
+    // NVENC only supports these two
+    H264 = 0,
+    H265 = 1,
 
-    CUdevice Device = 0;
-    cudaDeviceProp Properties{};
-    int GpuIndex = 0;
+    // CPU near-lossless LOCO-I (see LocoCodec.hpp)
+    Loco = 2,
 
+    // CPU wavelet with a truncatable bitstream (see WaveletCodec.hpp)
+    Wavelet = 3,
 
-    // Create the context
-    bool Create(int gpu_index = 0);
-    void Destroy();
+    // CPU block-DCT (see DctCodec.hpp)
+    Dct = 4,
 };
 
+// Number of VideoType values
+static const int kVideoTypeCount = 5;
 
-//------------------------------------------------------------------------------
-// Video Codec
-
-enum class VideoType
-{
-    // NVENC only supports these two
-    H264,
-    H265,
-};
+// Used to encode when no backend can encode the requested type
+static const VideoType kFallbackVideoType = VideoType::Dct;
 
 struct VideoParameters
 {
@@ -99,18 +84,128 @@ struct VideoParameters
 
     // Frames per second of camera
     int Fps = 30;
+
+    // VideoType::H264/H265: Target bits per second for the video encoder
+    // (0 = 2 Mbps scaled from 320x288)
+    int Bitrate = 0;
+
+    // VideoType::Loco: Maximum error for each 8-bit pixel (0 = lossless)
+    int LocoNear = 2;
+
+    // VideoType::Wavelet: Maximum bytes for each frame (0 = lossless)
+    int WaveletFrameBytes = 0;
+
+    // VideoType::Dct: Quantizer from 1 (best quality) to 64 (smallest)
+    int DctQuantizer = 4;
+
+    // Optional importance of each 8x8 block in raster order, with
+    // (Width + 7) / 8 blocks in each row, from 0 (unimportant) to 255.
+    // Backends spend fewer bits on unimportant blocks where they can.
+    // Must stay valid until EncodeFinish() returns.  nullptr = All 255.
+    const uint8_t* Importance = nullptr;
 };
 
-enum class VideoBackend
+// Importance of each block of block_size x block_size pixels (a multiple
+// of 8), which is its most important 8x8 block.  Returns false if
+// params.Importance is nullptr.
+bool GetBlockImportance(
+    const VideoParameters& params,
+    int block_size,
+    std::vector<uint8_t>& importance);
+
+// Largest compressed size of a frame from the built-in backends, including
+// a fallback to kFallbackVideoType for the hardware types
+size_t GetVideoCompressBound(const VideoParameters& params);
+
+
+//------------------------------------------------------------------------------
+// Video Layout
+
+// Layout of the 8-bit frames a backend takes for encoding
+enum class VideoLayout
 {
-    Uninitialized,
-    Software,
-    Cuda,
+    // Width * Height bytes of luma only
+    Luma,
+
+    // Luma followed by Width * Height / 2 bytes of interleaved chroma for
+    // hardware encoders.  The chroma is all zeroes.
+    NV12,
 };
 
+// Bytes in a frame of the given layout
+inline int GetVideoLayoutBytes(VideoLayout layout, int width, int height)
+{
+    const int n = width * height;
+    return layout == VideoLayout::NV12 ? n + n / 2 : n;
+}
+
+
+//------------------------------------------------------------------------------
+// Video Backend
+
+/*
+    Interface for one way of encoding and decoding video.
+
+    VideoCodec creates a separate backend object for encoding and decoding.
+    Backends must handle changes in resolution between frames.
+*/
+class VideoBackend
+{
+public:
+    virtual ~VideoBackend() {}
+
+    // Name used in diagnostics, for example "CUDA"
+    virtual const char* GetName() const = 0;
+
+    // Returns true if this backend can encode and decode the type on this
+    // machine.  This is called before any other method and should be fast:
+    // It must not set up any encoder or decoder.
+    virtual bool Probe(VideoType type) = 0;
+
+    // Layout of the data passed to EncodeBegin()
+    virtual VideoLayout GetInputLayout() const = 0;
+
+    // Start encoding a frame in the layout from GetInputLayout().
+    // The data and compressed buffers must stay untouched until
+    // EncodeFinish() returns.
+    virtual bool EncodeBegin(
+        const VideoParameters& params,
+        bool keyframe,
+        const std::vector<uint8_t>& data,
+        std::vector<uint8_t>& compressed) = 0;
+    virtual bool EncodeFinish(
+        std::vector<uint8_t>& compressed) = 0;
+
+    virtual bool Decode(
+        const VideoParameters& params,
+        const uint8_t* data,
+        int bytes,
+        std::vector<uint8_t>& decoded) = 0;
+};
+
+typedef std::unique_ptr<VideoBackend> (*VideoBackendFactory)();
+
+// Add a backend that is tried before the built-in ones.
+// The built-in backends are CUDA (if built) and then Software.
+void RegisterVideoBackend(VideoBackendFactory factory);
+
+// Returns true if some backend can handle the type on this machine
+bool IsVideoTypeAvailable(VideoType type);
+
+
+//------------------------------------------------------------------------------
+// Video Codec
+
 class VideoCodec
 {
 public:
+    // Layout the data for EncodeBegin() should be in.  This picks the
+    // backend for params.Type if it has not been picked yet.  Data in
+    // another layout still works, but may be copied.
+    VideoLayout GetInputLayout(const VideoParameters& params);
+
+    // If no backend can encode params.Type, or the backend fails, the frame
+    // is encoded as kFallbackVideoType instead: See GetEncodedType().
     bool EncodeBegin(
         const VideoParameters& params,
         bool keyframe,
@@ -119,6 +214,20 @@ public:
     bool EncodeFinish(
         std::vector<uint8_t>& compressed);
 
+    // Type used for the last call to EncodeBegin()
+    VideoType GetEncodedType() const
+    {
+        return EncoderType;
+    }
+
+    // True if the last call to EncodeBegin() coded a keyframe.  A new
+    // backend or a fallback codes one even if it was not requested.
+    bool GetEncodedKeyframe() const
+    {
+        return EncodedKeyframe;
+    }
+
+    // Returns false if no backend can decode the type, or the data is invalid
     bool Decode(
         int width,
         int height,
@@ -128,34 +237,36 @@ public:
         std::vector<uint8_t>& decoded);
 
 protected:
-    VideoParameters Params{};
+    std::unique_ptr<VideoBackend> Encoder;
+    VideoType RequestedType = VideoType::H264;
+    VideoType EncoderType = VideoType::H264;
 
-    VideoBackend EncoderBackend = VideoBackend::Uninitialized;
-    VideoBackend DecoderBackend = VideoBackend::Uninitialized;
+    // Factory of the encoder, and of backends that failed to encode
+    VideoBackendFactory EncoderFactory = nullptr;
+    std::vector<VideoBackendFactory> FailedEncoders;
 
-    // Shared state
-    uint64_t NextTimestamp = 0;
-    std::vector<std::vector<uint8_t>> VideoTemp;
+    // The next frame must be a keyframe because the encoder is new
+    bool EncoderReset = false;
 
-    // CUDA NVENC/NVDEC
-    GUID CodecGuid;
-    bool CudaNonfunctional = false;
-    CudaContext Context;
-    std::shared_ptr<NvEncoderCuda> CudaEncoder;
-    std::shared_ptr<NvDecoder> CudaDecoder;
+    // The last call to EncodeBegin() coded a keyframe
+    bool EncodedKeyframe = false;
 
+    // Input copied to the layout of a backend after a fallback
+    std::vector<uint8_t> Converted;
 
-    bool EncodeBeginNvenc(
-        bool keyframe,
-        const std::vector<uint8_t>& data,
-        std::vector<uint8_t>& compressed);
-    bool EncodeFinishNvenc(
-        std::vector<uint8_t>& compressed);
-    bool DecodeNvdec(
-        const uint8_t* data,
-        int bytes,
-        std::vector<uint8_t>& decoded);
-    void CleanupCuda();
+    std::unique_ptr<VideoBackend> Decoder;
+    VideoType DecoderType = VideoType::H264;
+
+
+    // Create the encoder for the type if it changed
+    void SelectEncoder(VideoType type);
+
+    // Create the first backend that can handle the type, skipping failed ones.
+    // Returns nullptr if there is none.
+    std::unique_ptr<VideoBackend> CreateBackend(
+        VideoType type,
+        const std::vector<VideoBackendFactory>& skip,
+        VideoBackendFactory* factory_out);
 };
 
 
@@ -0,0 +1,70 @@
+// Copyright 2019 (c) Christopher A. Taylor.  All rights reserved.
+
+/*
+    Integer wavelet image codec with an embedded bitplane coder.
+
+    This is a CPU-only backend for VideoCodec that needs no GPU.  Each frame
+    is coded on its own (intra-only).
+
+    The image is transformed with the reversible CDF 5/3 integer lifting
+    wavelet from JPEG 2000, and the coefficients are sent most significant
+    bitplane first using quadtree set partitioning (like SPECK) with raw bits.
+
+    Since the most important bits come first, the stream can be cut at any
+    byte and the prefix still decodes to a lower quality image.  So the
+    encoder or a relay can fit a frame to an exact byte budget without
+    re-encoding it.  The complete stream is lossless.
+
+    Bitstream format:
+
+        uint8_t Levels
+        uint8_t Planes (0 = all coefficients are zero)
+        Coded bits (MSB first), may be truncated anywhere
+*/
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+namespace zdepth {
+
+
+//------------------------------------------------------------------------------
+// Constants
+
+// Bytes in the bitstream header.  Streams cannot be truncated below this
+static const int kWaveletHeaderBytes = 2;
+
+// Largest number of wavelet decomposition levels
+static const int kWaveletMaxLevels = 5;
+
+
+//------------------------------------------------------------------------------
+// API
+
+// Largest compressed size of an image, without a max_bytes limit
+size_t WaveletCompressBound(int width, int height);
+
+// Compress an 8-bit image.
+// If max_bytes > 0 then the output is cut to at most max_bytes.
+// Otherwise the whole stream is produced, which decodes losslessly.
+void WaveletCompress(
+    const uint8_t* image,
+    int width,
+    int height,
+    int max_bytes,
+    std::vector<uint8_t>& compressed);
+
+// Any truncation of a valid stream can be decoded.
+// Returns false if the data is invalid
+bool WaveletDecompress(
+    const uint8_t* data,
+    int bytes,
+    int width,
+    int height,
+    std::vector<uint8_t>& image);
+
+
+} // namespace zdepth
@@ -0,0 +1,79 @@
+// Copyright 2019 (c) Christopher A. Taylor.  All rights reserved.
+
+/*
+    Small fixed-size pool of worker threads.
+
+    The codecs library is the lowest layer shared by zdepth and the video
+    backends, so the pool lives here and both can spread work across cores
+    without each object spawning its own threads.
+
+    ParallelFor() runs on the calling thread as well as the workers, so it
+    is safe to call from inside another ParallelFor() task: the caller always
+    makes progress on its own work even if every worker is busy.
+
+    Background tasks are for optional work that must not delay anything
+    else: Workers only take them when no other task is waiting.
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace zdepth {
+
+
+//------------------------------------------------------------------------------
+// WorkerPool
+
+class WorkerPool
+{
+public:
+    // Process-wide pool sized for the number of hardware threads.
+    // Threads are started on first use.
+    static WorkerPool& Shared();
+
+    // Number of worker threads (not counting the calling thread)
+    explicit WorkerPool(int thread_count);
+    ~WorkerPool();
+
+    int ThreadCount() const
+    {
+        return static_cast<int>( Threads.size() );
+    }
+
+    // Queue a task to run on a worker thread
+    void Submit(std::function<void()> task);
+
+    // Queue a task that runs after every task from Submit() has started
+    void SubmitBackground(std::function<void()> task);
+
+    // Number of workers waiting for work, less the tasks already queued
+    int IdleThreadCount();
+
+    // Run fn(i) for i in [0, count) on the workers and the calling thread.
+    // Returns after all calls have completed.
+    void ParallelFor(int count, const std::function<void(int)>& fn);
+
+protected:
+    std::vector<std::thread> Threads;
+
+    std::mutex QueueLock;
+    std::condition_variable QueueCondition;
+    std::deque<std::function<void()>> Queue;
+    std::deque<std::function<void()>> BackgroundQueue;
+    int IdleThreads = 0;
+    bool Terminated = false;
+
+
+    void WorkerLoop();
+};
+
+
+} // namespace zdepth
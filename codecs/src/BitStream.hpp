@@ -0,0 +1,196 @@
+// Copyright 2019 (c) Christopher A. Taylor.  All rights reserved.
+
+/*
+    MSB-first bit writer and reader shared by the software video backends.
+
+    The writer is given a buffer large enough for the worst case up front so
+    that writing bits does not need to check for space.  The reader returns
+    zero bits past the end of the buffer and remembers that it ran out, so
+    decoders can check Overrun() once at the end instead of on every read.
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+
+#if defined(_MSC_VER)
+    #include <intrin.h>
+#endif
+
+namespace zdepth {
+
+
+//------------------------------------------------------------------------------
+// Tools
+
+inline int CountLeadingZeros64(uint64_t x)
+{
+#if defined(_MSC_VER) && defined(_M_X64)
+    unsigned long index;
+    _BitScanReverse64(&index, x);
+    return 63 - static_cast<int>( index );
+#elif defined(_MSC_VER)
+    unsigned long index;
+    if (_BitScanReverse(&index, static_cast<uint32_t>( x >> 32 ))) {
+        return 31 - static_cast<int>( index );
+    }
+    _BitScanReverse(&index, static_cast<uint32_t>( x ));
+    return 63 - static_cast<int>( index );
+#else
+    return __builtin_clzll(x);
+#endif
+}
+
+
+//------------------------------------------------------------------------------
+// BitWriter
+
+class BitWriter
+{
+public:
+    void Reset(uint8_t* dest)
+    {
+        Start = Next = dest;
+        Accumulator = 0;
+        Count = 0;
+    }
+
+    // Write the low `count` bits of `bits`, up to 32 bits
+    inline void Write(uint32_t bits, int count)
+    {
+        Accumulator = (Accumulator << count) | bits;
+        Count += count;
+        while (Count >= 8) {
+            Count -= 8;
+            *Next++ = static_cast<uint8_t>( Accumulator >> Count );
+        }
+    }
+
+    inline void WriteZeros(int count)
+    {
+        while (count > 32) {
+            Write(0, 32);
+            count -= 32;
+        }
+        Write(0, count);
+    }
+
+    // Pad the last byte with zeros.  Returns the number of bytes written.
+    int Flush()
+    {
+        if (Count > 0) {
+            *Next++ = static_cast<uint8_t>( Accumulator << (8 - Count) );
+            Count = 0;
+        }
+        return static_cast<int>( Next - Start );
+    }
+
+    int BytesWritten() const
+    {
+        return static_cast<int>( Next - Start ) + (Count + 7) / 8;
+    }
+
+protected:
+    uint8_t* Start = nullptr;
+    uint8_t* Next = nullptr;
+    uint64_t Accumulator = 0;
+    int Count = 0;
+};
+
+
+//------------------------------------------------------------------------------
+// BitReader
+
+class BitReader
+{
+public:
+    void Reset(const uint8_t* data, int bytes)
+    {
+        Next = data;
+        End = data + bytes;
+        Accumulator = 0;
+        Count = 0;
+        BitsLeft = static_cast<int64_t>( bytes ) * 8;
+    }
+
+    // Read up to 32 bits
+    inline uint32_t Read(int count)
+    {
+        if (count <= 0) {
+            return 0;
+        }
+        if (Count < count) {
+            Refill();
+        }
+        const uint32_t bits = static_cast<uint32_t>( Accumulator >> (64 - count) );
+        Accumulator <<= count;
+        Count -= count;
+        BitsLeft -= count;
+        return bits;
+    }
+
+    // Count zero bits up to the next one bit and skip past both.
+    // Stops early and returns limit + 1 if there are more than `limit` zeros.
+    inline int ReadUnary(int limit)
+    {
+        int zeros = 0;
+        for (;;) {
+            if (Count < 32) {
+                Refill();
+            }
+            if (Accumulator != 0) {
+                const int z = CountLeadingZeros64(Accumulator);
+                if (z < Count) {
+                    zeros += z;
+                    Accumulator <<= z + 1;
+                    Count -= z + 1;
+                    BitsLeft -= z + 1;
+                    return zeros;
+                }
+            }
+            zeros += Count;
+            BitsLeft -= Count;
+            Accumulator = 0;
+            Count = 0;
+            if (zeros > limit || BitsLeft < 0) {
+                return limit + 1;
+            }
+        }
+    }
+
+    // Returns true if more bits were read than were available
+    bool Overrun() const
+    {
+        return BitsLeft < 0;
+    }
+
+    // Number of bits that have not been read yet
+    int64_t BitsRemaining() const
+    {
+        return BitsLeft;
+    }
+
+protected:
+    const uint8_t* Next = nullptr;
+    const uint8_t* End = nullptr;
+    uint64_t Accumulator = 0;
+    int Count = 0;
+    int64_t BitsLeft = 0;
+
+
+    inline void Refill()
+    {
+        while (Count <= 56) {
+            uint64_t byte = 0;
+            if (Next < End) {
+                byte = *Next++;
+            }
+            Accumulator |= byte << (56 - Count);
+            Count += 8;
+        }
+    }
+};
+
+
+} // namespace zdepth
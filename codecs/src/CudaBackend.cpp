@@ -0,0 +1,423 @@
+// Copyright 2019 (c) Christopher A. Taylor.  All rights reserved.
+
+#include "CudaBackend.hpp"
+
+#include <string.h> // memcpy
+#include <cmath>
+#include <mutex>
+
+namespace zdepth {
+
+
+//------------------------------------------------------------------------------
+// CUDA Context
+
+bool CudaContext::Create(int gpu_index)
+{
+    if (Context) {
+        return true; // Already created
+    }
+
+    CUresult result;
+
+    GpuIndex = gpu_index;
+
+    result = cuInit(0);
+    if (result != CUDA_SUCCESS) {
+        return false;
+    }
+
+    result = cuDeviceGet(&Device, gpu_index);
+    if (result != CUDA_SUCCESS) {
+        return false;
+    }
+
+    cudaError_t err = cudaGetDeviceProperties(&Properties, Device);
+    if (err != cudaSuccess) {
+        return false;
+    }
+
+    // Reuse the primary context to play nicer with application code
+    result = cuDevicePrimaryCtxRetain(&Context, Device);
+    if (result != CUDA_SUCCESS) {
+        return false;
+    }
+
+    return true;
+}
+
+void CudaContext::Destroy()
+{
+    if (Context) {
+        cuDevicePrimaryCtxRelease(Device);
+        Context = nullptr;
+    }
+}
+
+
+//------------------------------------------------------------------------------
+// CudaBackend
+
+// Check once whether there is a driver and a GPU, without creating a context
+static bool IsCudaAvailable()
+{
+    static std::once_flag once;
+    static bool available = false;
+
+    std::call_once(once, []() {
+        int count = 0;
+        available = cuInit(0) == CUDA_SUCCESS &&
+            cuDeviceGetCount(&count) == CUDA_SUCCESS &&
+            count > 0;
+    });
+
+    return available;
+}
+
+// Reconfigure NVENC if the bitrate changes by more than this fraction
+static const float kBitrateChangeThreshold = 0.05f;
+
+// QP added to macroblocks of importance 0.  Every 6 doubles the step size.
+static const int kUnimportantQpDelta = 12;
+
+static unsigned ChooseBitrate(const VideoParameters& params)
+{
+    if (params.Bitrate > 0) {
+        return static_cast<unsigned>( params.Bitrate );
+    }
+
+    // Recommend 2 Mbps at 320 x 288.
+    // Otherwise it is better to just use the lossless encoder.
+    const float bitrate_scale = params.Width * params.Height / static_cast<float>(320 * 288);
+    return static_cast<unsigned>( 2000000 * bitrate_scale );
+}
+
+static void SetBitrate(NV_ENC_RC_PARAMS& rc_params, unsigned bitrate, int fps)
+{
+    rc_params.averageBitRate = bitrate;
+    rc_params.maxBitRate = bitrate;
+
+    // Tune VBV size 
+    rc_params.vbvBufferSize = bitrate / fps;
+    rc_params.vbvInitialDelay = rc_params.vbvBufferSize;
+}
+
+// Append the NAL units from the encoder with a single resize
+static void AppendUnits(
+    const std::vector<std::vector<uint8_t>>& units,
+    std::vector<uint8_t>& compressed)
+{
+    size_t size = compressed.size();
+    size_t total = size;
+    for (const auto& unit : units) {
+        total += unit.size();
+    }
+    compressed.resize(total);
+
+    for (const auto& unit : units) {
+        memcpy(compressed.data() + size, unit.data(), unit.size());
+        size += unit.size();
+    }
+}
+
+CudaBackend::~CudaBackend()
+{
+    Cleanup();
+}
+
+bool CudaBackend::Probe(VideoType type)
+{
+    if (type != VideoType::H264 && type != VideoType::H265) {
+        return false;
+    }
+    return IsCudaAvailable();
+}
+
+void CudaBackend::UpdateParams(const VideoParameters& params)
+{
+    // If resolution or codec changed:
+    if (params.Width != Params.Width ||
+        params.Height != Params.Height ||
+        params.Type != Params.Type)
+    {
+        Cleanup();
+    }
+    Params = params;
+}
+
+bool CudaBackend::EncodeBegin(
+    const VideoParameters& params,
+    bool keyframe,
+    const std::vector<uint8_t>& data,
+    std::vector<uint8_t>& compressed)
+{
+    UpdateParams(params);
+
+    try {
+        if (!CudaEncoder) {
+            if (!Context.Create()) {
+                return false;
+            }
+
+            CodecGuid = (Params.Type == VideoType::H264) ? NV_ENC_CODEC_H264_GUID : NV_ENC_CODEC_HEVC_GUID;
+
+            CudaEncoder = std::make_shared<NvEncoderCuda>(
+                Context.Context,
+                Params.Width,
+                Params.Height,
+                NV_ENC_BUFFER_FORMAT_NV12);
+
+            NV_ENC_INITIALIZE_PARAMS encodeParams = { NV_ENC_INITIALIZE_PARAMS_VER };
+            NV_ENC_CONFIG encodeConfig = { NV_ENC_CONFIG_VER };
+            encodeParams.encodeConfig = &encodeConfig;
+
+            CudaEncoder->CreateDefaultEncoderParams(
+                &encodeParams,
+                CodecGuid,
+                NV_ENC_PRESET_LOW_LATENCY_HQ_GUID);
+
+            encodeParams.frameRateNum = Params.Fps;
+            encodeParams.frameRateDen = 1;
+            encodeParams.enablePTD = 1; // Allow NVENC to choose picture types
+
+            const bool supports_intra_refresh = CudaEncoder->GetCapabilityValue(
+                CodecGuid,
+                NV_ENC_CAPS_SUPPORT_INTRA_REFRESH);
+
+            // Enable intra-refresh for a more consistent frame size:
+            if (Params.Type == VideoType::H264) {
+                auto& h264Config = encodeConfig.encodeCodecConfig.h264Config;
+                h264Config.repeatSPSPPS = 0;
+                if (supports_intra_refresh) {
+                    h264Config.enableIntraRefresh = 1;
+                    h264Config.intraRefreshPeriod = Params.Fps * 10;
+                    h264Config.intraRefreshCnt = Params.Fps;
+                    h264Config.idrPeriod = NVENC_INFINITE_GOPLENGTH;
+                }
+            } else { // HEVC:
+                auto& hevcConfig = encodeConfig.encodeCodecConfig.hevcConfig;
+                hevcConfig.repeatSPSPPS = 0;
+                if (supports_intra_refresh) {
+                    hevcConfig.enableIntraRefresh = 1;
+                    hevcConfig.intraRefreshPeriod = Params.Fps * 10;
+                    hevcConfig.intraRefreshCnt = Params.Fps;
+                    hevcConfig.idrPeriod = NVENC_INFINITE_GOPLENGTH;
+                }
+            }
+
+            // Manual IDRs when application requests a keyframe
+            encodeConfig.gopLength = NVENC_INFINITE_GOPLENGTH;
+            encodeConfig.frameIntervalP = 1;
+
+            // Choose VBR mode allowing for spikes for tricky frames
+            // NV_ENC_PARAMS_RC_CBR_LOWDELAY_HQ: Error bound is smaller
+            // NV_ENC_PARAMS_RC_CBR_HQ: Seems to have a longer tail of errors
+            // NV_ENC_PARAMS_RC_VBR_HQ: Also long error tail
+            encodeConfig.rcParams.rateControlMode = NV_ENC_PARAMS_RC_CBR_LOWDELAY_HQ;
+            Bitrate = ChooseBitrate(Params);
+            SetBitrate(encodeConfig.rcParams, Bitrate, Params.Fps);
+
+            // Disable adaptive quantization for this type of data.
+            // It leads to much higher long tail errors.
+            encodeConfig.rcParams.enableTemporalAQ = 0;
+            encodeConfig.rcParams.enableAQ = 0; // Spatial
+            encodeConfig.rcParams.aqStrength = 1; // Lower is better
+
+            // Coarser quantization for unimportant macroblocks
+            encodeConfig.rcParams.qpMapMode = NV_ENC_QP_MAP_DELTA;
+
+            // Disable B-frames
+            encodeConfig.rcParams.zeroReorderDelay = 1;
+
+            // Enable non-reference P-frame optimization
+            encodeConfig.rcParams.enableNonRefP = 1; // requires enablePTD=1
+
+            CudaEncoder->CreateEncoder(&encodeParams);
+        } else {
+            // Follow bitrate changes from the rate controller without
+            // restarting the encoder
+            const unsigned bitrate = ChooseBitrate(Params);
+            const float change = std::abs(static_cast<float>( bitrate ) - Bitrate);
+            if (change > Bitrate * kBitrateChangeThreshold) {
+                NV_ENC_CONFIG encodeConfig = { NV_ENC_CONFIG_VER };
+                NV_ENC_RECONFIGURE_PARAMS reconfigureParams = { NV_ENC_RECONFIGURE_PARAMS_VER };
+                reconfigureParams.reInitEncodeParams.encodeConfig = &encodeConfig;
+                CudaEncoder->GetInitializeParams(&reconfigureParams.reInitEncodeParams);
+
+                SetBitrate(encodeConfig.rcParams, bitrate, Params.Fps);
+                try {
+                    CudaEncoder->Reconfigure(&reconfigureParams);
+                    Bitrate = bitrate;
+                }
+                catch (NVENCException& /*ex*/) {
+                    // Keep encoding at the old bitrate
+                }
+            }
+        }
+
+        const NvEncInputFrame* frame = CudaEncoder->GetNextInputFrame();
+
+        // If no frames available:
+        if (!frame) {
+            return false;
+        }
+
+        NvEncoderCuda::CopyToDeviceFrame(
+            Context.Context,
+            const_cast<uint8_t*>( data.data() ),
+            0,
+            (CUdeviceptr)frame->inputPtr,
+            (int)frame->pitch,
+            Params.Width,
+            Params.Height, 
+            CU_MEMORYTYPE_HOST, 
+            frame->bufferFormat,
+            frame->chromaOffsets,
+            frame->numChromaPlanes);
+
+        // The other parameters are filled in by NvEncoder::DoEncode
+        NV_ENC_PIC_PARAMS pic_params = { NV_ENC_PIC_PARAMS_VER };
+        pic_params.inputPitch = frame->pitch;
+
+        if (keyframe) {
+            // Force an IDR and prepend SPS, PPS units
+            pic_params.encodePicFlags |= NV_ENC_PIC_FLAG_OUTPUT_SPSPPS | NV_ENC_PIC_FLAG_FORCEIDR;
+            pic_params.pictureType = NV_ENC_PIC_TYPE_IDR;
+        } else {
+            pic_params.pictureType = NV_ENC_PIC_TYPE_P;
+        }
+
+        // pic_params.frameIdx = 0; // Optional
+        pic_params.inputTimeStamp = NextTimestamp++;
+        // pic_params.inputDuration = 0; // TBD
+        // pic_params.codecPicParams.h264PicParams; // No tweaks seem useful
+        if (GetBlockImportance(Params, 16, Importance)) {
+            QpDeltas.resize(Importance.size());
+            for (size_t i = 0; i < Importance.size(); ++i) {
+                QpDeltas[i] = static_cast<int8_t>( (255 - Importance[i]) * kUnimportantQpDelta / 255 );
+            }
+            pic_params.qpDeltaMap = QpDeltas.data();
+            pic_params.qpDeltaMapSize = static_cast<uint32_t>( QpDeltas.size() );
+        }
+
+        // Encode frame and wait for the result.
+        // This takes under a millisecond on modern gaming laptops.
+        CudaEncoder->EncodeFrame(VideoTemp, &pic_params);
+
+        compressed.clear();
+        AppendUnits(VideoTemp, compressed);
+    }
+    catch (NVENCException& /*ex*/) {
+        return false;
+    }
+
+    return true;
+}
+
+bool CudaBackend::EncodeFinish(
+    std::vector<uint8_t>& compressed)
+{
+    if (!CudaEncoder) {
+        return false;
+    }
+
+    try {
+        CudaEncoder->EndEncode(VideoTemp);
+
+        // If encode failed:
+        if (VideoTemp.empty()) {
+            return false;
+        }
+
+        AppendUnits(VideoTemp, compressed);
+    }
+    catch (NVENCException& /*ex*/) {
+        return false;
+    }
+
+    return true;
+}
+
+bool CudaBackend::Decode(
+    const VideoParameters& params,
+    const uint8_t* data,
+    int bytes,
+    std::vector<uint8_t>& decoded)
+{
+    UpdateParams(params);
+
+    try {
+        if (!CudaDecoder) {
+            if (!Context.Create()) {
+                return false;
+            }
+
+            CudaDecoder = std::make_shared<NvDecoder>(
+                Context.Context,
+                Params.Width,
+                Params.Height,
+                false, // Do not use device frame
+                Params.Type == VideoType::H264 ? cudaVideoCodec_H264 : cudaVideoCodec_HEVC,
+                nullptr, // No mutex
+                true, // Low latency
+                false, // Non-pitched frame
+                nullptr, // No crop
+                nullptr); // No resize
+        }
+
+        uint8_t** frames = nullptr;
+        int64_t* timestamps = nullptr;
+        int frame_count = 0;
+
+        // Retries are needed according to Nvidia engineers:
+        // https://github.com/NVIDIA/NvPipe/blob/b3d0a7511052824ff0481fa6eecb3e95eac1a722/src/NvPipe.cu#L969
+
+        for (int i = 0; i < 3; ++i) {
+            bool success = CudaDecoder->Decode(
+                data,
+                bytes,
+                &frames,
+                &frame_count,
+                CUVID_PKT_ENDOFPICTURE, // Immediate result requested
+                &timestamps,
+                0, // Timestamp
+                cudaStreamPerThread); // Use the default per-thread stream
+            if (!success) {
+                return false;
+            }
+
+            // If we got a frame back:
+            if (frame_count >= 1) {
+                break;
+            }
+        }
+
+        if (frame_count < 1) {
+            return false;
+        }
+
+        const int y_bytes = Params.Width * Params.Height;
+        decoded.resize(y_bytes);
+        memcpy(decoded.data(), frames[0], y_bytes);
+    }
+    catch (NVENCException& /*ex*/) {
+        return false;
+    }
+
+    return true;
+}
+
+void CudaBackend::Cleanup()
+{
+    CudaEncoder.reset();
+    CudaDecoder.reset();
+    Context.Destroy();
+}
+
+std::unique_ptr<VideoBackend> CreateCudaBackend()
+{
+    return std::unique_ptr<VideoBackend>( new CudaBackend );
+}
+
+
+} // namespace zdepth
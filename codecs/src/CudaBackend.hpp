@@ -0,0 +1,114 @@
+// Copyright 2019 (c) Christopher A. Taylor.  All rights reserved.
+
+/*
+    Nvidia NVENC/NVDEC video backend for VideoType::H264 and VideoType::H265.
+
+    Uses the attached GPU for efficient encoding via CUDA.  This file is only
+    compiled if ZDEPTH_CUDA is enabled in CMake, and CUDA is only initialized
+    when one of these types is first used.
+*/
+
+#pragma once
+
+#include "VideoCodec.hpp"
+
+#include <cuda_runtime_api.h>
+#include <NvEncoder.h>
+#include <NvEncoderCuda.h>
+#include <NvDecoder.h>
+
+namespace zdepth {
+
+
+//------------------------------------------------------------------------------
+// CUDA Context
+
+struct CudaContext
+{
+    ~CudaContext()
+    {
+        Destroy();
+    }
+
+    bool Valid() const
+    {
+        return Context != nullptr;
+    }
+
+    CUcontext Context = nullptr;
+
+    CUdevice Device = 0;
+    cudaDeviceProp Properties{};
+    int GpuIndex = 0;
+
+
+    // Create the context
+    bool Create(int gpu_index = 0);
+    void Destroy();
+};
+
+
+//------------------------------------------------------------------------------
+// CudaBackend
+
+class CudaBackend : public VideoBackend
+{
+public:
+    ~CudaBackend();
+
+    const char* GetName() const override
+    {
+        return "CUDA";
+    }
+
+    bool Probe(VideoType type) override;
+
+    // NVENC copies the luma and chroma planes from one host buffer
+    VideoLayout GetInputLayout() const override
+    {
+        return VideoLayout::NV12;
+    }
+
+    bool EncodeBegin(
+        const VideoParameters& params,
+        bool keyframe,
+        const std::vector<uint8_t>& data,
+        std::vector<uint8_t>& compressed) override;
+    bool EncodeFinish(
+        std::vector<uint8_t>& compressed) override;
+
+    bool Decode(
+        const VideoParameters& params,
+        const uint8_t* data,
+        int bytes,
+        std::vector<uint8_t>& decoded) override;
+
+protected:
+    VideoParameters Params{};
+
+    uint64_t NextTimestamp = 0;
+
+    // Bitrate the encoder is configured for
+    unsigned Bitrate = 0;
+
+    // Importance and QP offset of each macroblock
+    std::vector<uint8_t> Importance;
+    std::vector<int8_t> QpDeltas;
+    std::vector<std::vector<uint8_t>> VideoTemp;
+
+    GUID CodecGuid;
+    CudaContext Context;
+    std::shared_ptr<NvEncoderCuda> CudaEncoder;
+    std::shared_ptr<NvDecoder> CudaDecoder;
+
+
+    // Tear down the encoder and decoder if the parameters changed
+    void UpdateParams(const VideoParameters& params);
+
+    void Cleanup();
+};
+
+std::unique_ptr<VideoBackend> CreateCudaBackend();
+
+
+} // namespace zdepth
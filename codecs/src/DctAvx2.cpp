@@ -0,0 +1,265 @@
+// Copyright 2019 (c) Christopher A. Taylor.  All rights reserved.
+
+/*
+    AVX2 versions of the 8x8 integer DCT kernels.
+
+    This file is compiled with AVX2 enabled (see CMakeLists.txt), so nothing
+    in here may be called unless the CPU supports AVX2.  Each 8-lane int32
+    register holds one row of a block, so the butterflies run on all eight
+    columns at once, and a transpose turns rows into columns in between.
+    The results match the scalar kernels exactly.
+
+    The motion search SAD uses _mm256_sad_epu8 on two 16-pixel rows at a time.
+*/
+
+#include "DctKernels.hpp"
+
+#if defined(__AVX2__)
+    #include <immintrin.h>
+#endif
+
+namespace zdepth {
+
+
+#if defined(__AVX2__)
+
+bool DctAvx2Compiled()
+{
+    return true;
+}
+
+static inline void Transpose8x8(__m256i* r)
+{
+    const __m256i t0 = _mm256_unpacklo_epi32(r[0], r[1]);
+    const __m256i t1 = _mm256_unpackhi_epi32(r[0], r[1]);
+    const __m256i t2 = _mm256_unpacklo_epi32(r[2], r[3]);
+    const __m256i t3 = _mm256_unpackhi_epi32(r[2], r[3]);
+    const __m256i t4 = _mm256_unpacklo_epi32(r[4], r[5]);
+    const __m256i t5 = _mm256_unpackhi_epi32(r[4], r[5]);
+    const __m256i t6 = _mm256_unpacklo_epi32(r[6], r[7]);
+    const __m256i t7 = _mm256_unpackhi_epi32(r[6], r[7]);
+
+    const __m256i u0 = _mm256_unpacklo_epi64(t0, t2);
+    const __m256i u1 = _mm256_unpackhi_epi64(t0, t2);
+    const __m256i u2 = _mm256_unpacklo_epi64(t1, t3);
+    const __m256i u3 = _mm256_unpackhi_epi64(t1, t3);
+    const __m256i u4 = _mm256_unpacklo_epi64(t4, t6);
+    const __m256i u5 = _mm256_unpackhi_epi64(t4, t6);
+    const __m256i u6 = _mm256_unpacklo_epi64(t5, t7);
+    const __m256i u7 = _mm256_unpackhi_epi64(t5, t7);
+
+    r[0] = _mm256_permute2x128_si256(u0, u4, 0x20);
+    r[1] = _mm256_permute2x128_si256(u1, u5, 0x20);
+    r[2] = _mm256_permute2x128_si256(u2, u6, 0x20);
+    r[3] = _mm256_permute2x128_si256(u3, u7, 0x20);
+    r[4] = _mm256_permute2x128_si256(u0, u4, 0x31);
+    r[5] = _mm256_permute2x128_si256(u1, u5, 0x31);
+    r[6] = _mm256_permute2x128_si256(u2, u6, 0x31);
+    r[7] = _mm256_permute2x128_si256(u3, u7, 0x31);
+}
+
+#define DCT_ADD(a, b) _mm256_add_epi32(a, b)
+#define DCT_SUB(a, b) _mm256_sub_epi32(a, b)
+#define DCT_SHR(a, n) _mm256_srai_epi32(a, n)
+
+// Same as Forward8() in DctCodec.cpp, across registers
+static inline void Forward8(__m256i* p)
+{
+    const __m256i a0 = DCT_ADD(p[0], p[7]), a1 = DCT_ADD(p[1], p[6]);
+    const __m256i a2 = DCT_ADD(p[2], p[5]), a3 = DCT_ADD(p[3], p[4]);
+    const __m256i a4 = DCT_SUB(p[0], p[7]), a5 = DCT_SUB(p[1], p[6]);
+    const __m256i a6 = DCT_SUB(p[2], p[5]), a7 = DCT_SUB(p[3], p[4]);
+
+    const __m256i b0 = DCT_ADD(a0, a3), b1 = DCT_ADD(a1, a2);
+    const __m256i b2 = DCT_SUB(a0, a3), b3 = DCT_SUB(a1, a2);
+    const __m256i b4 = DCT_ADD(DCT_ADD(a5, a6), DCT_ADD(DCT_SHR(a4, 1), a4));
+    const __m256i b5 = DCT_SUB(DCT_SUB(a4, a7), DCT_ADD(DCT_SHR(a6, 1), a6));
+    const __m256i b6 = DCT_SUB(DCT_ADD(a4, a7), DCT_ADD(DCT_SHR(a5, 1), a5));
+    const __m256i b7 = DCT_ADD(DCT_SUB(a5, a6), DCT_ADD(DCT_SHR(a7, 1), a7));
+
+    p[0] = DCT_ADD(b0, b1);
+    p[1] = DCT_ADD(b4, DCT_SHR(b7, 2));
+    p[2] = DCT_ADD(b2, DCT_SHR(b3, 1));
+    p[3] = DCT_ADD(b5, DCT_SHR(b6, 2));
+    p[4] = DCT_SUB(b0, b1);
+    p[5] = DCT_SUB(b6, DCT_SHR(b5, 2));
+    p[6] = DCT_SUB(DCT_SHR(b2, 1), b3);
+    p[7] = DCT_SUB(DCT_SHR(b4, 2), b7);
+}
+
+// Same as Inverse8() in DctCodec.cpp, across registers
+static inline void Inverse8(__m256i* p)
+{
+    const __m256i a0 = DCT_ADD(p[0], p[4]), a4 = DCT_SUB(p[0], p[4]);
+    const __m256i a2 = DCT_SUB(DCT_SHR(p[2], 1), p[6]), a6 = DCT_ADD(p[2], DCT_SHR(p[6], 1));
+    const __m256i b0 = DCT_ADD(a0, a6), b2 = DCT_ADD(a4, a2);
+    const __m256i b4 = DCT_SUB(a4, a2), b6 = DCT_SUB(a0, a6);
+
+    const __m256i a1 = DCT_SUB(DCT_SUB(DCT_SUB(p[5], p[3]), p[7]), DCT_SHR(p[7], 1));
+    const __m256i a3 = DCT_SUB(DCT_SUB(DCT_ADD(p[1], p[7]), p[3]), DCT_SHR(p[3], 1));
+    const __m256i a5 = DCT_ADD(DCT_ADD(DCT_SUB(p[7], p[1]), p[5]), DCT_SHR(p[5], 1));
+    const __m256i a7 = DCT_ADD(DCT_ADD(DCT_ADD(p[3], p[5]), p[1]), DCT_SHR(p[1], 1));
+    const __m256i b1 = DCT_ADD(a1, DCT_SHR(a7, 2)), b7 = DCT_SUB(a7, DCT_SHR(a1, 2));
+    const __m256i b3 = DCT_ADD(a3, DCT_SHR(a5, 2)), b5 = DCT_SUB(DCT_SHR(a3, 2), a5);
+
+    p[0] = DCT_ADD(b0, b7);
+    p[1] = DCT_ADD(b2, b5);
+    p[2] = DCT_ADD(b4, b3);
+    p[3] = DCT_ADD(b6, b1);
+    p[4] = DCT_SUB(b6, b1);
+    p[5] = DCT_SUB(b4, b3);
+    p[6] = DCT_SUB(b2, b5);
+    p[7] = DCT_SUB(b0, b7);
+}
+
+#undef DCT_ADD
+#undef DCT_SUB
+#undef DCT_SHR
+
+void DctForwardAvx2(
+    const uint8_t* pixels,
+    int stride,
+    const uint8_t* prediction,
+    int prediction_stride,
+    const DctTables& tables,
+    int16_t* coeffs)
+{
+    __m256i r[8];
+    for (int y = 0; y < 8; ++y) {
+        const __m128i row = _mm_loadl_epi64(reinterpret_cast<const __m128i*>( pixels + y * stride ));
+        const __m128i pred = _mm_loadl_epi64(reinterpret_cast<const __m128i*>( prediction + y * prediction_stride ));
+        r[y] = _mm256_sub_epi32(_mm256_cvtepu8_epi32(row), _mm256_cvtepu8_epi32(pred));
+    }
+
+    // Columns, then rows.  The result is left transposed: r[u] lane v
+    Forward8(r);
+    Transpose8x8(r);
+    Forward8(r);
+
+    for (int u = 0; u < 8; u += 2) {
+        __m256i q[2];
+        for (int j = 0; j < 2; ++j) {
+            const __m256i c = r[u + j];
+            const __m256i quant = _mm256_loadu_si256(reinterpret_cast<const __m256i*>( tables.Quant + (u + j) * 8 ));
+            const __m256i bias = _mm256_loadu_si256(reinterpret_cast<const __m256i*>( tables.Bias + (u + j) * 8 ));
+            __m256i x = _mm256_mullo_epi32(_mm256_abs_epi32(c), quant);
+            x = _mm256_srai_epi32(_mm256_add_epi32(x, bias), kDctQuantShift);
+            q[j] = _mm256_sign_epi32(x, c);
+        }
+
+        // Pack to int16 and fix the lane order from packs
+        const __m256i packed = _mm256_permute4x64_epi64(_mm256_packs_epi32(q[0], q[1]), 0xD8);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>( coeffs + u * 8 ), packed);
+    }
+}
+
+void DctInverseAvx2(
+    const int16_t* coeffs,
+    const DctTables& tables,
+    const uint8_t* prediction,
+    int prediction_stride,
+    uint8_t* pixels,
+    int stride)
+{
+    const __m256i max_value = _mm256_set1_epi32(kDctMaxDequantized);
+    const __m256i min_value = _mm256_set1_epi32(-kDctMaxDequantized);
+
+    __m256i r[8];
+    for (int u = 0; u < 8; ++u) {
+        const __m128i c = _mm_loadu_si128(reinterpret_cast<const __m128i*>( coeffs + u * 8 ));
+        const __m256i dequant = _mm256_loadu_si256(reinterpret_cast<const __m256i*>( tables.Dequant + u * 8 ));
+        const __m256i x = _mm256_mullo_epi32(_mm256_cvtepi16_epi32(c), dequant);
+        r[u] = _mm256_max_epi32(_mm256_min_epi32(x, max_value), min_value);
+    }
+
+    // Horizontal frequencies, then vertical.  The result is r[y] lane x
+    Inverse8(r);
+    Transpose8x8(r);
+    Inverse8(r);
+
+    const __m256i round = _mm256_set1_epi32(1 << (kDctInverseShift - 1));
+    for (int y = 0; y < 8; y += 2) {
+        __m256i o[2];
+        for (int j = 0; j < 2; ++j) {
+            const __m128i pred = _mm_loadl_epi64(reinterpret_cast<const __m128i*>( prediction + (y + j) * prediction_stride ));
+            o[j] = _mm256_srai_epi32(_mm256_add_epi32(r[y + j], round), kDctInverseShift);
+            o[j] = _mm256_add_epi32(o[j], _mm256_cvtepu8_epi32(pred));
+        }
+
+        // Saturate to int16 then uint8, like the clamp in the scalar version
+        const __m256i words = _mm256_permute4x64_epi64(_mm256_packs_epi32(o[0], o[1]), 0xD8);
+        const __m256i bytes = _mm256_packus_epi16(words, words);
+        _mm_storel_epi64(reinterpret_cast<__m128i*>( pixels + y * stride ), _mm256_castsi256_si128(bytes));
+        _mm_storel_epi64(reinterpret_cast<__m128i*>( pixels + (y + 1) * stride ), _mm256_extracti128_si256(bytes, 1));
+    }
+}
+
+unsigned DctSad16x16Avx2(
+    const uint8_t* a,
+    int a_stride,
+    const uint8_t* b,
+    int b_stride)
+{
+    __m256i sum = _mm256_setzero_si256();
+    for (int y = 0; y < 16; y += 2) {
+        const __m256i ra = _mm256_inserti128_si256(
+            _mm256_castsi128_si256(_mm_loadu_si128(reinterpret_cast<const __m128i*>( a ))),
+            _mm_loadu_si128(reinterpret_cast<const __m128i*>( a + a_stride )), 1);
+        const __m256i rb = _mm256_inserti128_si256(
+            _mm256_castsi128_si256(_mm_loadu_si128(reinterpret_cast<const __m128i*>( b ))),
+            _mm_loadu_si128(reinterpret_cast<const __m128i*>( b + b_stride )), 1);
+        sum = _mm256_add_epi64(sum, _mm256_sad_epu8(ra, rb));
+        a += a_stride * 2;
+        b += b_stride * 2;
+    }
+
+    // Add the four 64-bit partial sums
+    __m128i s = _mm_add_epi64(_mm256_castsi256_si128(sum), _mm256_extracti128_si256(sum, 1));
+    s = _mm_add_epi64(s, _mm_unpackhi_epi64(s, s));
+    return static_cast<unsigned>( _mm_cvtsi128_si32(s) );
+}
+
+#else // __AVX2__
+
+bool DctAvx2Compiled()
+{
+    return false;
+}
+
+// Never called since DctAvx2Compiled() returns false
+
+void DctForwardAvx2(
+    const uint8_t* pixels,
+    int stride,
+    const uint8_t* prediction,
+    int prediction_stride,
+    const DctTables& tables,
+    int16_t* coeffs)
+{
+    DctForwardScalar(pixels, stride, prediction, prediction_stride, tables, coeffs);
+}
+
+void DctInverseAvx2(
+    const int16_t* coeffs,
+    const DctTables& tables,
+    const uint8_t* prediction,
+    int prediction_stride,
+    uint8_t* pixels,
+    int stride)
+{
+    DctInverseScalar(coeffs, tables, prediction, prediction_stride, pixels, stride);
+}
+
+unsigned DctSad16x16Avx2(
+    const uint8_t* a,
+    int a_stride,
+    const uint8_t* b,
+    int b_stride)
+{
+    return DctSad16x16Scalar(a, a_stride, b, b_stride);
+}
+
+#endif // __AVX2__
+
+
+} // namespace zdepth
@@ -0,0 +1,1162 @@
+// Copyright 2019 (c) Christopher A. Taylor.  All rights reserved.
+
+#include "DctCodec.hpp"
+#include "DctKernels.hpp"
+#include "BitStream.hpp"
+#include "WorkerPool.hpp"
+
+#include <math.h>
+#include <stdlib.h> // abs
+#include <string.h> // memcpy, memset
+#include <atomic>
+
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+    #include <intrin.h>
+#endif
+
+namespace zdepth {
+
+
+//------------------------------------------------------------------------------
+// Constants
+
+/*
+    Quantization matrix for the folded depth low bits, in 1/16ths of the
+    quantizer.  Indexed by [u * 8 + v] but symmetric.
+
+    JPEG quantizes the highest frequencies about 10x coarser than DC because
+    the eye does not see them.  Depth has no such masking: an error at any
+    frequency moves the surface by the same amount.  Folded low bits are
+    mostly planar ramps (DC and the first AC terms), plus object edges that
+    spread energy across all frequencies, so the matrix only rises gently
+    to keep some detail at the edges.
+*/
+static const uint8_t kDepthQuantMatrix[64] = {
+    16, 16, 17, 18, 20, 22, 24, 26,
+    16, 17, 18, 20, 22, 24, 26, 28,
+    17, 18, 20, 22, 24, 26, 28, 30,
+    18, 20, 22, 24, 26, 28, 30, 32,
+    20, 22, 24, 26, 28, 30, 32, 34,
+    22, 24, 26, 28, 30, 32, 34, 36,
+    24, 26, 28, 30, 32, 34, 36, 38,
+    26, 28, 30, 32, 34, 36, 38, 40,
+};
+
+// Squared norms of the integer DCT basis vectors
+static const double kBasisNorm2[8] = {
+    8.0, 578.0 / 64.0, 5.0, 578.0 / 64.0, 8.0, 578.0 / 64.0, 5.0, 578.0 / 64.0
+};
+
+// Dead zone rounding offsets as a fraction of the step.  Inter residuals
+// use a wider dead zone since most of their small coefficients are noise
+static const double kIntraRounding = 1.0 / 3.0;
+static const double kInterRounding = 1.0 / 6.0;
+
+// Coefficient scan order from low to high frequency
+static const uint8_t kZigZag[64] = {
+     0,  1,  8, 16,  9,  2,  3, 10,
+    17, 24, 32, 25, 18, 11,  4,  5,
+    12, 19, 26, 33, 40, 48, 41, 34,
+    27, 20, 13,  6,  7, 14, 21, 28,
+    35, 42, 49, 56, 57, 50, 43, 36,
+    29, 22, 15, 23, 30, 37, 44, 51,
+    58, 59, 52, 45, 38, 31, 39, 46,
+    53, 60, 61, 54, 47, 55, 62, 63,
+};
+
+// Rice codes with this many leading zeros are followed by a raw value
+static const int kRiceEscape = 24;
+static const int kRiceEscapeBits = 16;
+
+// Rice context counters are halved when they reach this value
+static const int kRiceReset = 64;
+
+// Rice codes at most 62 in the run contexts, so their average stays below
+// 66 and their k is at most 7.  A run then takes at most 8 bits plus the run,
+// unless it escapes, which needs a run of 24 or more.  The runs of a block
+// add up to at most 62, so there are at most two escapes.
+static const int kMaxRunBits = 63 * 8 + 62 + 2 * (kRiceEscape + 1 + kRiceEscapeBits);
+
+// Largest number of bytes for one block: DC, the count and each of the 63
+// levels are escapes at worst, and each level has a run and a sign
+static const int kMaxBlockBytes = (65 * (kRiceEscape + 1 + kRiceEscapeBits) + 63 + kMaxRunBits + 7) / 8;
+
+// Largest number of bytes for one macroblock: Four blocks plus a mode,
+// a motion vector and a coded block pattern that are escapes at worst
+static const int kMaxMacroblockBytes = 4 * kMaxBlockBytes + (4 * (kRiceEscape + 1 + kRiceEscapeBits) + 7) / 8;
+
+// Macroblock coding modes in P-frames
+static const unsigned kModeSkip = 0;  // Copy the prediction at the predicted vector
+static const unsigned kModeInter = 1; // Motion vector and residual blocks
+static const unsigned kModeIntra = 2; // Four intra blocks
+
+// Largest motion vector component in pixels
+static const int kMotionRange = 16;
+
+// Largest number of hexagon search steps per macroblock
+static const int kMaxSearchSteps = 8;
+
+// Added to the intra activity of a macroblock before comparing it with the
+// motion compensated SAD, because intra blocks cost more bits to code
+static const unsigned kIntraBias = 512;
+
+// Macroblocks of importance 0 in P-frames are skipped if every pixel of the
+// prediction is within this error plus the quantizer.  The quantizer is
+// added because coding the macroblock would leave errors of about that
+// size anyway, so a fixed limit would never be met at normal quantizers.
+// More important macroblocks get a proportionally smaller limit.  The depth
+// error of a pixel is its Low byte error, so this bounds the depth error
+// rather than the average.
+static const int kUnimportantSkipError = 3;
+
+
+//------------------------------------------------------------------------------
+// Integer DCT
+
+// H.264 8x8 forward core transform
+static inline void Forward8(int32_t* p, int stride)
+{
+    const int32_t a0 = p[0] + p[7 * stride], a1 = p[stride] + p[6 * stride];
+    const int32_t a2 = p[2 * stride] + p[5 * stride], a3 = p[3 * stride] + p[4 * stride];
+    const int32_t a4 = p[0] - p[7 * stride], a5 = p[stride] - p[6 * stride];
+    const int32_t a6 = p[2 * stride] - p[5 * stride], a7 = p[3 * stride] - p[4 * stride];
+
+    const int32_t b0 = a0 + a3, b1 = a1 + a2, b2 = a0 - a3, b3 = a1 - a2;
+    const int32_t b4 = a5 + a6 + ((a4 >> 1) + a4);
+    const int32_t b5 = a4 - a7 - ((a6 >> 1) + a6);
+    const int32_t b6 = a4 + a7 - ((a5 >> 1) + a5);
+    const int32_t b7 = a5 - a6 + ((a7 >> 1) + a7);
+
+    p[0] = b0 + b1;
+    p[stride] = b4 + (b7 >> 2);
+    p[2 * stride] = b2 + (b3 >> 1);
+    p[3 * stride] = b5 + (b6 >> 2);
+    p[4 * stride] = b0 - b1;
+    p[5 * stride] = b6 - (b5 >> 2);
+    p[6 * stride] = (b2 >> 1) - b3;
+    p[7 * stride] = (b4 >> 2) - b7;
+}
+
+// H.264 8x8 inverse core transform
+static inline void Inverse8(int32_t* p, int stride)
+{
+    const int32_t i0 = p[0], i1 = p[stride], i2 = p[2 * stride], i3 = p[3 * stride];
+    const int32_t i4 = p[4 * stride], i5 = p[5 * stride], i6 = p[6 * stride], i7 = p[7 * stride];
+
+    const int32_t a0 = i0 + i4, a4 = i0 - i4;
+    const int32_t a2 = (i2 >> 1) - i6, a6 = i2 + (i6 >> 1);
+    const int32_t b0 = a0 + a6, b2 = a4 + a2, b4 = a4 - a2, b6 = a0 - a6;
+
+    const int32_t a1 = -i3 + i5 - i7 - (i7 >> 1);
+    const int32_t a3 = i1 + i7 - i3 - (i3 >> 1);
+    const int32_t a5 = -i1 + i7 + i5 + (i5 >> 1);
+    const int32_t a7 = i3 + i5 + i1 + (i1 >> 1);
+    const int32_t b1 = a1 + (a7 >> 2), b7 = a7 - (a1 >> 2);
+    const int32_t b3 = a3 + (a5 >> 2), b5 = (a3 >> 2) - a5;
+
+    p[0] = b0 + b7;
+    p[stride] = b2 + b5;
+    p[2 * stride] = b4 + b3;
+    p[3 * stride] = b6 + b1;
+    p[4 * stride] = b6 - b1;
+    p[5 * stride] = b4 - b3;
+    p[6 * stride] = b2 - b5;
+    p[7 * stride] = b0 - b7;
+}
+
+const uint8_t kDctFlatPrediction[16] = {
+    128, 128, 128, 128, 128, 128, 128, 128,
+    128, 128, 128, 128, 128, 128, 128, 128,
+};
+
+void DctForwardScalar(
+    const uint8_t* pixels,
+    int stride,
+    const uint8_t* prediction,
+    int prediction_stride,
+    const DctTables& tables,
+    int16_t* coeffs)
+{
+    // block[y * 8 + x]
+    int32_t block[64];
+    for (int y = 0; y < 8; ++y) {
+        for (int x = 0; x < 8; ++x) {
+            block[y * 8 + x] = static_cast<int32_t>( pixels[y * stride + x] ) -
+                prediction[y * prediction_stride + x];
+        }
+    }
+
+    // Columns: block[v * 8 + x]
+    for (int x = 0; x < 8; ++x) {
+        Forward8(block + x, 8);
+    }
+
+    // Rows, writing the result transposed: block[u * 8 + v]
+    int32_t row[8];
+    int32_t transposed[64];
+    for (int v = 0; v < 8; ++v) {
+        memcpy(row, block + v * 8, sizeof(row));
+        Forward8(row, 1);
+        for (int u = 0; u < 8; ++u) {
+            transposed[u * 8 + v] = row[u];
+        }
+    }
+
+    for (int i = 0; i < 64; ++i) {
+        const int32_t c = transposed[i];
+        int32_t q = ((c < 0 ? -c : c) * tables.Quant[i] + tables.Bias[i]) >> kDctQuantShift;
+        if (q > 32767) {
+            q = 32767;
+        }
+        coeffs[i] = static_cast<int16_t>( c < 0 ? -q : q );
+    }
+}
+
+void DctInverseScalar(
+    const int16_t* coeffs,
+    const DctTables& tables,
+    const uint8_t* prediction,
+    int prediction_stride,
+    uint8_t* pixels,
+    int stride)
+{
+    // block[u * 8 + v]
+    int32_t block[64];
+    for (int i = 0; i < 64; ++i) {
+        int32_t c = coeffs[i] * tables.Dequant[i];
+        if (c > kDctMaxDequantized) {
+            c = kDctMaxDequantized;
+        } else if (c < -kDctMaxDequantized) {
+            c = -kDctMaxDequantized;
+        }
+        block[i] = c;
+    }
+
+    // Horizontal frequencies to pixels: block[x * 8 + v]
+    for (int v = 0; v < 8; ++v) {
+        Inverse8(block + v, 8);
+    }
+
+    // Vertical frequencies to pixels
+    const int32_t kInverseRound = 1 << (kDctInverseShift - 1);
+    int32_t column[8];
+    for (int x = 0; x < 8; ++x) {
+        memcpy(column, block + x * 8, sizeof(column));
+        Inverse8(column, 1);
+        for (int y = 0; y < 8; ++y) {
+            int32_t value = ((column[y] + kInverseRound) >> kDctInverseShift) +
+                prediction[y * prediction_stride + x];
+            if (value < 0) {
+                value = 0;
+            } else if (value > 255) {
+                value = 255;
+            }
+            pixels[y * stride + x] = static_cast<uint8_t>( value );
+        }
+    }
+}
+
+
+unsigned DctSad16x16Scalar(
+    const uint8_t* a,
+    int a_stride,
+    const uint8_t* b,
+    int b_stride)
+{
+    unsigned sum = 0;
+    for (int y = 0; y < 16; ++y) {
+        for (int x = 0; x < 16; ++x) {
+            sum += static_cast<unsigned>( abs(a[x] - b[x]) );
+        }
+        a += a_stride;
+        b += b_stride;
+    }
+    return sum;
+}
+
+
+//------------------------------------------------------------------------------
+// Kernel Selection
+
+static bool CpuHasAvx2()
+{
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+    int info[4];
+    __cpuid(info, 0);
+    if (info[0] < 7) {
+        return false;
+    }
+    // OS must save the YMM registers
+    __cpuid(info, 1);
+    const bool osxsave = (info[2] & (1 << 27)) != 0;
+    const bool avx = (info[2] & (1 << 28)) != 0;
+    if (!osxsave || !avx || (_xgetbv(0) & 6) != 6) {
+        return false;
+    }
+    __cpuidex(info, 7, 0);
+    return (info[1] & (1 << 5)) != 0;
+#elif (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+    return __builtin_cpu_supports("avx2") != 0;
+#else
+    return false;
+#endif
+}
+
+namespace {
+
+struct DctKernels
+{
+    DctForwardFunction Forward = DctForwardScalar;
+    DctInverseFunction Inverse = DctInverseScalar;
+    DctSadFunction Sad16x16 = DctSad16x16Scalar;
+
+    DctKernels()
+    {
+        if (DctAvx2Compiled() && CpuHasAvx2()) {
+            Forward = DctForwardAvx2;
+            Inverse = DctInverseAvx2;
+            Sad16x16 = DctSad16x16Avx2;
+        }
+    }
+};
+
+} // namespace
+
+static const DctKernels& GetKernels()
+{
+    static const DctKernels kernels;
+    return kernels;
+}
+
+
+//------------------------------------------------------------------------------
+// Tables
+
+static void BuildTables(int quantizer, double rounding, DctTables& tables)
+{
+    for (int u = 0; u < 8; ++u) {
+        for (int v = 0; v < 8; ++v) {
+            const int i = u * 8 + v;
+            const double step = quantizer * kDepthQuantMatrix[i] / 16.0;
+            const double norm = sqrt(kBasisNorm2[u] * kBasisNorm2[v]);
+            const double one = static_cast<double>( 1 << kDctQuantShift );
+
+            tables.Quant[i] = static_cast<int32_t>( one / (step * norm) + 0.5 );
+            tables.Bias[i] = static_cast<int32_t>( one * rounding );
+            tables.Dequant[i] = static_cast<int32_t>( step * (1 << kDctInverseShift) / norm + 0.5 );
+        }
+    }
+}
+
+
+//------------------------------------------------------------------------------
+// Rice Coding
+
+namespace {
+
+struct RiceContext
+{
+    unsigned A = 4;
+    unsigned N = 1;
+
+
+    int GetK() const
+    {
+        int k = 0;
+        while ((N << k) < A && k < kRiceEscapeBits) {
+            ++k;
+        }
+        return k;
+    }
+
+    void Update(unsigned value)
+    {
+        A += value;
+        if (++N >= kRiceReset) {
+            A >>= 1;
+            N >>= 1;
+        }
+    }
+};
+
+// Adaptive contexts for one row of blocks
+struct RowContexts
+{
+    RiceContext Dc;
+    RiceContext Count[4];
+    RiceContext Run[3];
+    RiceContext Level[3];
+};
+
+} // namespace
+
+static inline void WriteRice(BitWriter& bits, RiceContext& context, unsigned value)
+{
+    const int k = context.GetK();
+    const unsigned q = value >> k;
+    if (q < static_cast<unsigned>( kRiceEscape )) {
+        bits.Write(1, q + 1);
+        if (k > 0) {
+            bits.Write(value & ((1u << k) - 1), k);
+        }
+    } else {
+        bits.Write(1, kRiceEscape + 1);
+        bits.Write(value, kRiceEscapeBits);
+    }
+    context.Update(value);
+}
+
+static inline unsigned ReadRice(BitReader& bits, RiceContext& context)
+{
+    const int k = context.GetK();
+    const int q = bits.ReadUnary(kRiceEscape);
+    unsigned value;
+    if (q < kRiceEscape) {
+        value = (static_cast<unsigned>( q ) << k) | bits.Read(k);
+    } else {
+        // Also reached on corrupted data, which is caught by Overrun()
+        value = bits.Read(kRiceEscapeBits);
+    }
+    context.Update(value);
+    return value;
+}
+
+static inline unsigned SignedToUnsigned(int32_t x)
+{
+    return (static_cast<uint32_t>( x ) << 1) ^ static_cast<uint32_t>( x >> 31 );
+}
+
+static inline int32_t UnsignedToSigned(unsigned x)
+{
+    return static_cast<int32_t>( x >> 1 ) ^ -static_cast<int32_t>( x & 1 );
+}
+
+static inline int CountContext(int count)
+{
+    return count == 0 ? 0 : (count <= 2 ? 1 : (count <= 6 ? 2 : 3));
+}
+
+static inline int PositionContext(int scan_index)
+{
+    return scan_index < 3 ? 0 : (scan_index < 10 ? 1 : 2);
+}
+
+static void EncodeBlock(
+    BitWriter& bits,
+    RowContexts& contexts,
+    const int16_t* coeffs,
+    int& prev_dc,
+    int& prev_count)
+{
+    const int dc = coeffs[0];
+    WriteRice(bits, contexts.Dc, SignedToUnsigned(dc - prev_dc));
+    prev_dc = dc;
+
+    int count = 0;
+    for (int i = 1; i < 64; ++i) {
+        if (coeffs[kZigZag[i]] != 0) {
+            ++count;
+        }
+    }
+    WriteRice(bits, contexts.Count[CountContext(prev_count)], count);
+    prev_count = count;
+
+    int next = 1;
+    for (int i = 1; i < 64 && count > 0; ++i)
+    {
+        const int level = coeffs[kZigZag[i]];
+        if (level == 0) {
+            continue;
+        }
+        const int context = PositionContext(i);
+        const unsigned magnitude = level < 0 ? -level : level;
+        WriteRice(bits, contexts.Run[PositionContext(next)], i - next);
+        WriteRice(bits, contexts.Level[context], magnitude - 1);
+        bits.Write(level < 0 ? 1 : 0, 1);
+        next = i + 1;
+        --count;
+    }
+}
+
+// Returns false if the block is invalid
+static bool DecodeBlock(
+    BitReader& bits,
+    RowContexts& contexts,
+    int16_t* coeffs,
+    int& prev_dc,
+    int& prev_count)
+{
+    memset(coeffs, 0, 64 * sizeof(int16_t));
+
+    const int dc = prev_dc + UnsignedToSigned(ReadRice(bits, contexts.Dc));
+    if (dc < -32768 || dc > 32767) {
+        return false;
+    }
+    coeffs[0] = static_cast<int16_t>( dc );
+    prev_dc = dc;
+
+    const unsigned count = ReadRice(bits, contexts.Count[CountContext(prev_count)]);
+    if (count > 63) {
+        return false;
+    }
+    prev_count = static_cast<int>( count );
+
+    int next = 1;
+    for (unsigned j = 0; j < count; ++j)
+    {
+        const unsigned run = ReadRice(bits, contexts.Run[PositionContext(next)]);
+        const int i = next + static_cast<int>( run );
+        if (run > 63 || i > 63) {
+            return false;
+        }
+        const unsigned magnitude = ReadRice(bits, contexts.Level[PositionContext(i)]) + 1;
+        if (magnitude > 32767) {
+            return false;
+        }
+        const int level = static_cast<int>( magnitude );
+        coeffs[kZigZag[i]] = static_cast<int16_t>( bits.Read(1) ? -level : level );
+        next = i + 1;
+    }
+
+    return true;
+}
+
+
+//------------------------------------------------------------------------------
+// Macroblocks
+
+// Sixteen zero pixels, used with a stride of 0 to sum a macroblock
+static const uint8_t kZeroPixels[16] = {};
+
+// Offset of 8x8 block 0..3 within a 16x16 macroblock, in raster order
+static inline int BlockOffset(int block, int stride)
+{
+    return (block >> 1) * 8 * stride + (block & 1) * 8;
+}
+
+static inline bool IsZeroBlock(const int16_t* coeffs)
+{
+    for (int i = 0; i < 64; ++i) {
+        if (coeffs[i] != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static inline void CopyBlock(const uint8_t* src, uint8_t* dest, int stride, int size)
+{
+    for (int y = 0; y < size; ++y) {
+        memcpy(dest + y * stride, src + y * stride, size);
+    }
+}
+
+// Returns true if no pixel of the two 16x16 blocks differs by more than limit
+static bool IsWithinError16x16(const uint8_t* a, const uint8_t* b, int stride, int limit)
+{
+    for (int y = 0; y < 16; ++y, a += stride, b += stride) {
+        for (int x = 0; x < 16; ++x) {
+            const int delta = a[x] - b[x];
+            if (delta > limit || delta < -limit) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+static void EncodeIntraMacroblock(
+    BitWriter& bits,
+    RowContexts& contexts,
+    const DctKernels& kernels,
+    const DctTables& tables,
+    const uint8_t* pixels,
+    uint8_t* recon,
+    int stride,
+    int& prev_dc,
+    int& prev_count)
+{
+    int16_t coeffs[64];
+    for (int block = 0; block < 4; ++block) {
+        const int offset = BlockOffset(block, stride);
+        kernels.Forward(pixels + offset, stride, kDctFlatPrediction, 0, tables, coeffs);
+        EncodeBlock(bits, contexts, coeffs, prev_dc, prev_count);
+        kernels.Inverse(coeffs, tables, kDctFlatPrediction, 0, recon + offset, stride);
+    }
+}
+
+// Returns false if the macroblock is invalid
+static bool DecodeIntraMacroblock(
+    BitReader& bits,
+    RowContexts& contexts,
+    const DctKernels& kernels,
+    const DctTables& tables,
+    uint8_t* recon,
+    int stride,
+    int& prev_dc,
+    int& prev_count)
+{
+    int16_t coeffs[64];
+    for (int block = 0; block < 4; ++block) {
+        if (!DecodeBlock(bits, contexts, coeffs, prev_dc, prev_count)) {
+            return false;
+        }
+        kernels.Inverse(coeffs, tables, kDctFlatPrediction, 0, recon + BlockOffset(block, stride), stride);
+    }
+    return true;
+}
+
+namespace {
+
+// Adaptive contexts for one row of macroblocks in a P-frame
+struct MacroblockContexts
+{
+    RiceContext Mode;
+    RiceContext MvX, MvY;
+    RiceContext Cbp;
+    RowContexts Intra;
+    RowContexts Inter;
+};
+
+} // namespace
+
+
+//------------------------------------------------------------------------------
+// Motion Search
+
+// Approximate bits to code a motion vector difference
+static inline unsigned MvBits(int d)
+{
+    unsigned a = static_cast<unsigned>( d < 0 ? -d : d ) + 1;
+    unsigned bits = 1;
+    while (a > 1) {
+        a >>= 1;
+        bits += 2;
+    }
+    return bits;
+}
+
+static inline bool MvInBounds(int x, int y, int mv_x, int mv_y, int max_x, int max_y)
+{
+    return mv_x >= -kMotionRange && mv_x <= kMotionRange &&
+        mv_y >= -kMotionRange && mv_y <= kMotionRange &&
+        x + mv_x >= 0 && x + mv_x <= max_x &&
+        y + mv_y >= 0 && y + mv_y <= max_y;
+}
+
+namespace {
+
+/*
+    Integer-pel hexagon search for one 16x16 macroblock.
+
+    The search starts from the better of the zero vector and the predicted
+    vector, walks a large hexagon until no neighbour is better, then checks
+    the four closest points around the result.  The cost includes the bits
+    to code the vector difference weighted by the quantizer, which keeps
+    vectors in flat areas on the predictor so those macroblocks can skip.
+*/
+struct MotionSearch
+{
+    const DctKernels& Kernels;
+    const uint8_t* Pixels;
+    const uint8_t* Reference;
+    int Stride;
+    int X, Y, MaxX, MaxY;
+    int PredX, PredY;
+    unsigned Lambda;
+
+    int BestX = 0, BestY = 0;
+    unsigned BestSad = 0, BestCost = 0;
+
+
+    MotionSearch(
+        const DctKernels& kernels,
+        const uint8_t* pixels,
+        const uint8_t* reference,
+        int stride,
+        int x, int y, int max_x, int max_y,
+        int pred_x, int pred_y,
+        unsigned lambda)
+        : Kernels(kernels)
+        , Pixels(pixels)
+        , Reference(reference)
+        , Stride(stride)
+        , X(x), Y(y), MaxX(max_x), MaxY(max_y)
+        , PredX(pred_x), PredY(pred_y)
+        , Lambda(lambda)
+    {
+        BestSad = Sad(0, 0);
+        BestCost = BestSad + Lambda * (MvBits(PredX) + MvBits(PredY));
+        Check(PredX, PredY);
+    }
+
+    unsigned Sad(int mv_x, int mv_y) const
+    {
+        return Kernels.Sad16x16(
+            Pixels, Stride,
+            Reference + (Y + mv_y) * Stride + X + mv_x, Stride);
+    }
+
+    // Returns true if the vector is the new best
+    bool Check(int mv_x, int mv_y)
+    {
+        if ((mv_x == BestX && mv_y == BestY) ||
+            !MvInBounds(X, Y, mv_x, mv_y, MaxX, MaxY))
+        {
+            return false;
+        }
+        const unsigned sad = Sad(mv_x, mv_y);
+        const unsigned cost = sad + Lambda * (MvBits(mv_x - PredX) + MvBits(mv_y - PredY));
+        if (cost >= BestCost) {
+            return false;
+        }
+        BestX = mv_x;
+        BestY = mv_y;
+        BestSad = sad;
+        BestCost = cost;
+        return true;
+    }
+
+    void Run()
+    {
+        static const int kHexagon[6][2] = {
+            { -2, 0 }, { -1, -2 }, { 1, -2 }, { 2, 0 }, { 1, 2 }, { -1, 2 }
+        };
+        static const int kDiamond[4][2] = {
+            { -1, 0 }, { 1, 0 }, { 0, -1 }, { 0, 1 }
+        };
+
+        for (int step = 0; step < kMaxSearchSteps; ++step)
+        {
+            const int center_x = BestX, center_y = BestY;
+            bool moved = false;
+            for (int i = 0; i < 6; ++i) {
+                moved |= Check(center_x + kHexagon[i][0], center_y + kHexagon[i][1]);
+            }
+            if (!moved) {
+                break;
+            }
+        }
+
+        const int center_x = BestX, center_y = BestY;
+        for (int i = 0; i < 4; ++i) {
+            Check(center_x + kDiamond[i][0], center_y + kDiamond[i][1]);
+        }
+    }
+};
+
+} // namespace
+
+
+//------------------------------------------------------------------------------
+// DctEncoder
+
+// Largest number of bytes for a row of macroblocks
+static size_t GetMaxRowBytes(int mb_count)
+{
+    return static_cast<size_t>( mb_count ) * kMaxMacroblockBytes + 8;
+}
+
+size_t DctCompressBound(int width, int height)
+{
+    const int mb_count = (width + 15) / 16;
+    const int row_count = (height + 15) / 16;
+    return kDctHeaderBytes + row_count * (4 + GetMaxRowBytes(mb_count));
+}
+
+// Copy the image to a buffer padded to a multiple of 16 by repeating the edges
+static void PadImage(
+    const uint8_t* image,
+    int width,
+    int height,
+    int padded_width,
+    int padded_height,
+    std::vector<uint8_t>& padded)
+{
+    padded.resize(static_cast<size_t>( padded_width ) * padded_height);
+    for (int y = 0; y < padded_height; ++y) {
+        const uint8_t* src = image + (y < height ? y : height - 1) * width;
+        uint8_t* dest = padded.data() + y * padded_width;
+        memcpy(dest, src, width);
+        for (int x = width; x < padded_width; ++x) {
+            dest[x] = src[width - 1];
+        }
+    }
+}
+
+void DctEncoder::Compress(
+    const uint8_t* image,
+    int width,
+    int height,
+    int quantizer,
+    bool keyframe,
+    const uint8_t* importance,
+    std::vector<uint8_t>& compressed)
+{
+    if (quantizer < kDctMinQuantizer) {
+        quantizer = kDctMinQuantizer;
+    } else if (quantizer > kDctMaxQuantizer) {
+        quantizer = kDctMaxQuantizer;
+    }
+
+    // P-frames need a reference of the same size
+    if (ReferenceWidth != width || ReferenceHeight != height) {
+        keyframe = true;
+    }
+
+    const int padded_width = (width + 15) & ~15;
+    const int padded_height = (height + 15) & ~15;
+    const int mb_count = padded_width / 16;
+    const int row_count = padded_height / 16;
+
+    const uint8_t* pixels = image;
+    if (padded_width != width || padded_height != height) {
+        PadImage(image, width, height, padded_width, padded_height, Padded);
+        pixels = Padded.data();
+    }
+
+    DctTables intra_tables, inter_tables;
+    BuildTables(quantizer, kIntraRounding, intra_tables);
+    BuildTables(quantizer, kInterRounding, inter_tables);
+    const DctKernels& kernels = GetKernels();
+
+    Reconstructed.resize(static_cast<size_t>( padded_width ) * padded_height);
+    uint8_t* recon = Reconstructed.data();
+    const uint8_t* reference = Reference.data();
+
+    RowData.resize(row_count);
+    RowBytes.resize(row_count);
+
+    WorkerPool::Shared().ParallelFor(row_count, [&](int row) {
+        std::vector<uint8_t>& data = RowData[row];
+        data.resize(GetMaxRowBytes(mb_count));
+
+        BitWriter bits;
+        bits.Reset(data.data());
+
+        const int y = row * 16;
+        const int offset = y * padded_width;
+
+        if (keyframe)
+        {
+            RowContexts contexts;
+            int prev_dc = 0, prev_count = 0;
+            for (int mb = 0; mb < mb_count; ++mb) {
+                EncodeIntraMacroblock(
+                    bits, contexts, kernels, intra_tables,
+                    pixels + offset + mb * 16, recon + offset + mb * 16, padded_width,
+                    prev_dc, prev_count);
+            }
+            RowBytes[row] = bits.Flush();
+            return;
+        }
+
+        MacroblockContexts contexts;
+        int intra_dc = 0, intra_count = 0, inter_count = 0;
+        int pred_x = 0, pred_y = 0;
+        int16_t coeffs[4][64];
+
+        for (int mb = 0; mb < mb_count; ++mb)
+        {
+            const int x = mb * 16;
+            const uint8_t* src = pixels + offset + x;
+            uint8_t* dest = recon + offset + x;
+
+            // Skip unimportant macroblocks that are close enough to the
+            // prediction, without searching
+            if (importance &&
+                MvInBounds(x, y, pred_x, pred_y, padded_width - 16, padded_height - 16))
+            {
+                const int limit = (255 - importance[row * mb_count + mb]) * (kUnimportantSkipError + quantizer) / 255;
+                const uint8_t* prediction = reference + (y + pred_y) * padded_width + x + pred_x;
+                if (limit > 0 && IsWithinError16x16(src, prediction, padded_width, limit)) {
+                    WriteRice(bits, contexts.Mode, kModeSkip);
+                    CopyBlock(prediction, dest, padded_width, 16);
+                    continue;
+                }
+            }
+
+            MotionSearch search(
+                kernels, src, reference, padded_width,
+                x, y, padded_width - 16, padded_height - 16,
+                pred_x, pred_y, quantizer);
+            search.Run();
+
+            // Compare against the spread of the macroblock around its mean
+            const unsigned sum = kernels.Sad16x16(src, padded_width, kZeroPixels, 0);
+            uint8_t mean[16];
+            memset(mean, static_cast<int>( (sum + 128) >> 8 ), sizeof(mean));
+            const unsigned activity = kernels.Sad16x16(src, padded_width, mean, 0);
+
+            if (activity + kIntraBias < search.BestSad) {
+                WriteRice(bits, contexts.Mode, kModeIntra);
+                EncodeIntraMacroblock(
+                    bits, contexts.Intra, kernels, intra_tables,
+                    src, dest, padded_width, intra_dc, intra_count);
+                pred_x = pred_y = 0;
+                continue;
+            }
+
+            const int mv_x = search.BestX, mv_y = search.BestY;
+            const uint8_t* prediction = reference + (y + mv_y) * padded_width + x + mv_x;
+
+            unsigned cbp = 0;
+            for (int block = 0; block < 4; ++block) {
+                const int block_offset = BlockOffset(block, padded_width);
+                kernels.Forward(
+                    src + block_offset, padded_width,
+                    prediction + block_offset, padded_width,
+                    inter_tables, coeffs[block]);
+                if (!IsZeroBlock(coeffs[block])) {
+                    cbp |= 1u << block;
+                }
+            }
+
+            if (cbp == 0 && mv_x == pred_x && mv_y == pred_y) {
+                WriteRice(bits, contexts.Mode, kModeSkip);
+                CopyBlock(prediction, dest, padded_width, 16);
+                continue;
+            }
+
+            WriteRice(bits, contexts.Mode, kModeInter);
+            WriteRice(bits, contexts.MvX, SignedToUnsigned(mv_x - pred_x));
+            WriteRice(bits, contexts.MvY, SignedToUnsigned(mv_y - pred_y));
+            WriteRice(bits, contexts.Cbp, cbp);
+
+            for (int block = 0; block < 4; ++block) {
+                const int block_offset = BlockOffset(block, padded_width);
+                if (cbp & (1u << block)) {
+                    // Residual DC is not predicted from the previous block
+                    int prev_dc = 0;
+                    EncodeBlock(bits, contexts.Inter, coeffs[block], prev_dc, inter_count);
+                    kernels.Inverse(
+                        coeffs[block], inter_tables,
+                        prediction + block_offset, padded_width,
+                        dest + block_offset, padded_width);
+                } else {
+                    CopyBlock(prediction + block_offset, dest + block_offset, padded_width, 8);
+                }
+            }
+
+            pred_x = mv_x;
+            pred_y = mv_y;
+        }
+
+        RowBytes[row] = bits.Flush();
+    });
+
+    // The reconstruction is what the decoder will see, so it is the reference
+    // for the next frame rather than the input image
+    Reference.swap(Reconstructed);
+    ReferenceWidth = width;
+    ReferenceHeight = height;
+
+    size_t total = kDctHeaderBytes + row_count * 4;
+    for (int row = 0; row < row_count; ++row) {
+        total += RowBytes[row];
+    }
+    compressed.resize(total);
+
+    uint8_t* dest = compressed.data();
+    dest[0] = static_cast<uint8_t>( quantizer );
+    dest[1] = keyframe ? kDctFrameIntra : kDctFrameInter;
+    dest += kDctHeaderBytes;
+    for (int row = 0; row < row_count; ++row) {
+        const uint32_t bytes = RowBytes[row];
+        dest[0] = static_cast<uint8_t>( bytes );
+        dest[1] = static_cast<uint8_t>( bytes >> 8 );
+        dest[2] = static_cast<uint8_t>( bytes >> 16 );
+        dest[3] = static_cast<uint8_t>( bytes >> 24 );
+        dest += 4;
+    }
+    for (int row = 0; row < row_count; ++row) {
+        memcpy(dest, RowData[row].data(), RowBytes[row]);
+        dest += RowBytes[row];
+    }
+}
+
+
+//------------------------------------------------------------------------------
+// DctDecoder
+
+bool DctDecoder::Decompress(
+    const uint8_t* data,
+    int bytes,
+    int width,
+    int height,
+    std::vector<uint8_t>& image)
+{
+    if (bytes < kDctHeaderBytes || width < 1 || height < 1) {
+        return false;
+    }
+    const int quantizer = data[0];
+    const int frame_type = data[1];
+    if (quantizer < kDctMinQuantizer || quantizer > kDctMaxQuantizer ||
+        (frame_type != kDctFrameIntra && frame_type != kDctFrameInter))
+    {
+        return false;
+    }
+    const bool keyframe = (frame_type == kDctFrameIntra);
+
+    // P-frames need the previous frame at the same size
+    if (!keyframe && (ReferenceWidth != width || ReferenceHeight != height)) {
+        return false;
+    }
+
+    const int padded_width = (width + 15) & ~15;
+    const int padded_height = (height + 15) & ~15;
+    const int mb_count = padded_width / 16;
+    const int row_count = padded_height / 16;
+
+    const int table_bytes = row_count * 4;
+    if (bytes < kDctHeaderBytes + table_bytes) {
+        return false;
+    }
+
+    // Find where each row starts
+    std::vector<int> offsets(row_count + 1);
+    const uint8_t* table = data + kDctHeaderBytes;
+    int64_t offset = kDctHeaderBytes + table_bytes;
+    for (int row = 0; row < row_count; ++row) {
+        offsets[row] = static_cast<int>( offset );
+        offset += table[0] | (table[1] << 8) | (table[2] << 16) | (static_cast<uint32_t>( table[3] ) << 24);
+        table += 4;
+        if (offset > bytes) {
+            return false;
+        }
+    }
+    offsets[row_count] = static_cast<int>( offset );
+    if (offset != bytes) {
+        return false;
+    }
+
+    DctTables intra_tables, inter_tables;
+    BuildTables(quantizer, kIntraRounding, intra_tables);
+    BuildTables(quantizer, kInterRounding, inter_tables);
+    const DctKernels& kernels = GetKernels();
+
+    Reconstructed.resize(static_cast<size_t>( padded_width ) * padded_height);
+    uint8_t* recon = Reconstructed.data();
+    const uint8_t* reference = Reference.data();
+
+    std::atomic<bool> corrupted(false);
+
+    WorkerPool::Shared().ParallelFor(row_count, [&](int row) {
+        BitReader bits;
+        bits.Reset(data + offsets[row], offsets[row + 1] - offsets[row]);
+
+        const int y = row * 16;
+        const int row_offset = y * padded_width;
+
+        if (keyframe)
+        {
+            RowContexts contexts;
+            int prev_dc = 0, prev_count = 0;
+            for (int mb = 0; mb < mb_count; ++mb) {
+                if (!DecodeIntraMacroblock(
+                    bits, contexts, kernels, intra_tables,
+                    recon + row_offset + mb * 16, padded_width,
+                    prev_dc, prev_count))
+                {
+                    corrupted = true;
+                    return;
+                }
+            }
+            if (bits.Overrun()) {
+                corrupted = true;
+            }
+            return;
+        }
+
+        MacroblockContexts contexts;
+        int intra_dc = 0, intra_count = 0, inter_count = 0;
+        int pred_x = 0, pred_y = 0;
+        int16_t coeffs[64];
+
+        for (int mb = 0; mb < mb_count; ++mb)
+        {
+            const int x = mb * 16;
+            uint8_t* dest = recon + row_offset + x;
+
+            const unsigned mode = ReadRice(bits, contexts.Mode);
+            if (mode == kModeIntra) {
+                if (!DecodeIntraMacroblock(
+                    bits, contexts.Intra, kernels, intra_tables,
+                    dest, padded_width, intra_dc, intra_count))
+                {
+                    corrupted = true;
+                    return;
+                }
+                pred_x = pred_y = 0;
+                continue;
+            }
+
+            // The predicted vector was checked when it was decoded
+            if (mode == kModeSkip) {
+                CopyBlock(
+                    reference + (y + pred_y) * padded_width + x + pred_x,
+                    dest, padded_width, 16);
+                continue;
+            }
+
+            if (mode != kModeInter) {
+                corrupted = true;
+                return;
+            }
+
+            const int mv_x = pred_x + UnsignedToSigned(ReadRice(bits, contexts.MvX));
+            const int mv_y = pred_y + UnsignedToSigned(ReadRice(bits, contexts.MvY));
+            const unsigned cbp = ReadRice(bits, contexts.Cbp);
+            if (cbp > 15 ||
+                !MvInBounds(x, y, mv_x, mv_y, padded_width - 16, padded_height - 16))
+            {
+                corrupted = true;
+                return;
+            }
+            const uint8_t* prediction = reference + (y + mv_y) * padded_width + x + mv_x;
+
+            for (int block = 0; block < 4; ++block) {
+                const int block_offset = BlockOffset(block, padded_width);
+                if (cbp & (1u << block)) {
+                    int prev_dc = 0;
+                    if (!DecodeBlock(bits, contexts.Inter, coeffs, prev_dc, inter_count)) {
+                        corrupted = true;
+                        return;
+                    }
+                    kernels.Inverse(
+                        coeffs, inter_tables,
+                        prediction + block_offset, padded_width,
+                        dest + block_offset, padded_width);
+                } else {
+                    CopyBlock(prediction + block_offset, dest + block_offset, padded_width, 8);
+                }
+            }
+
+            pred_x = mv_x;
+            pred_y = mv_y;
+        }
+
+        if (bits.Overrun()) {
+            corrupted = true;
+        }
+    });
+
+    if (corrupted) {
+        // Following P-frames would predict from a broken reference
+        ReferenceWidth = ReferenceHeight = 0;
+        return false;
+    }
+
+    image.resize(static_cast<size_t>( width ) * height);
+    for (int y = 0; y < height; ++y) {
+        memcpy(image.data() + y * width, recon + y * padded_width, width);
+    }
+
+    Reference.swap(Reconstructed);
+    ReferenceWidth = width;
+    ReferenceHeight = height;
+    return true;
+}
+
+
+} // namespace zdepth
@@ -0,0 +1,136 @@
+// Copyright 2019 (c) Christopher A. Taylor.  All rights reserved.
+
+/*
+    8x8 integer transform kernels for the block-DCT backend.
+
+    The transform is the 8x8 integer DCT approximation from H.264 High
+    profile, which only needs adds and shifts.  Its basis vectors are
+    orthogonal but not normalized, so the normalization is folded into the
+    quantization tables.
+
+    Coefficients are stored transposed: coeffs[u * 8 + v] holds horizontal
+    frequency u and vertical frequency v.  This saves a transpose in the
+    SIMD kernels, and the scalar kernels produce exactly the same output.
+
+    There is a portable scalar version of each kernel and an AVX2 version
+    in DctAvx2.cpp, which is compiled with AVX2 enabled and only called
+    after checking the CPU supports it.
+*/
+
+#pragma once
+
+#include <stdint.h>
+
+namespace zdepth {
+
+
+//------------------------------------------------------------------------------
+// Quantization Tables
+
+struct DctTables
+{
+    // Forward: q = (|coeff| * Quant + Bias) >> kDctQuantShift with sign restored
+    int32_t Quant[64];
+    int32_t Bias[64];
+
+    // Inverse: coeff = q * Dequant, scaled up by 2^kDctInverseShift so that
+    // the inverse transform keeps some fractional bits
+    int32_t Dequant[64];
+};
+
+static const int kDctQuantShift = 16;
+static const int kDctInverseShift = 10;
+
+// Dequantized coefficients are clamped to this magnitude, which valid
+// streams never reach, so corrupted data cannot overflow the transform
+static const int32_t kDctMaxDequantized = 1 << 20;
+
+
+//------------------------------------------------------------------------------
+// Kernels
+
+/*
+    Blocks are coded as the difference from a prediction.  Intra blocks use
+    a flat prediction of 128 by passing kDctFlatPrediction with stride 0,
+    and inter blocks use the motion compensated reference frame.
+*/
+
+// Eight pixels of 128 for intra prediction with a stride of 0
+extern const uint8_t kDctFlatPrediction[16];
+
+// Transform and quantize the difference between the 8x8 block at `pixels`
+// and the prediction
+typedef void (*DctForwardFunction)(
+    const uint8_t* pixels,
+    int stride,
+    const uint8_t* prediction,
+    int prediction_stride,
+    const DctTables& tables,
+    int16_t* coeffs);
+
+// Dequantize and inverse transform a block, add the prediction and write
+// the 8x8 pixels to `pixels`
+typedef void (*DctInverseFunction)(
+    const int16_t* coeffs,
+    const DctTables& tables,
+    const uint8_t* prediction,
+    int prediction_stride,
+    uint8_t* pixels,
+    int stride);
+
+// Sum of absolute differences between two 16x16 blocks
+typedef unsigned (*DctSadFunction)(
+    const uint8_t* a,
+    int a_stride,
+    const uint8_t* b,
+    int b_stride);
+
+void DctForwardScalar(
+    const uint8_t* pixels,
+    int stride,
+    const uint8_t* prediction,
+    int prediction_stride,
+    const DctTables& tables,
+    int16_t* coeffs);
+
+void DctInverseScalar(
+    const int16_t* coeffs,
+    const DctTables& tables,
+    const uint8_t* prediction,
+    int prediction_stride,
+    uint8_t* pixels,
+    int stride);
+
+unsigned DctSad16x16Scalar(
+    const uint8_t* a,
+    int a_stride,
+    const uint8_t* b,
+    int b_stride);
+
+// Returns false if DctAvx2.cpp was built without AVX2 support
+bool DctAvx2Compiled();
+
+void DctForwardAvx2(
+    const uint8_t* pixels,
+    int stride,
+    const uint8_t* prediction,
+    int prediction_stride,
+    const DctTables& tables,
+    int16_t* coeffs);
+
+void DctInverseAvx2(
+    const int16_t* coeffs,
+    const DctTables& tables,
+    const uint8_t* prediction,
+    int prediction_stride,
+    uint8_t* pixels,
+    int stride);
+
+unsigned DctSad16x16Avx2(
+    const uint8_t* a,
+    int a_stride,
+    const uint8_t* b,
+    int b_stride);
+
+
+} // namespace zdepth
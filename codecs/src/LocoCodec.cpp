@@ -0,0 +1,785 @@
+// Copyright 2019 (c) Christopher A. Taylor.  All rights reserved.
+
+#include "LocoCodec.hpp"
+#include "BitStream.hpp"
+
+#include <stdlib.h> // abs
+
+namespace zdepth {
+
+
+//------------------------------------------------------------------------------
+// Constants
+
+// Run length order table from T.87
+static const int kJ[32] = {
+    0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3,
+    4, 4, 5, 5, 6, 6, 7, 7, 8, 9, 10, 11, 12, 13, 14, 15
+};
+
+// Context counters are halved when they reach this value
+static const int kReset = 64;
+
+// Bias correction limits
+static const int kMinC = -128;
+static const int kMaxC = 127;
+
+// Regular contexts, then the two run interruption contexts
+static const int kRegularContexts = 365;
+static const int kRunContext = kRegularContexts;
+
+
+//------------------------------------------------------------------------------
+// LocoState
+
+namespace {
+
+struct LocoState
+{
+    int MaxValue = 0;
+    int Near = 0;
+    int Step = 1; // 2 * Near + 1
+    int Range = 0;
+    int Qbpp = 0;
+    int Limit = 0;
+
+    // Context statistics
+    int A[kRegularContexts + 2];
+    int B[kRegularContexts];
+    int C[kRegularContexts];
+    int N[kRegularContexts + 2];
+    int Nn[2];
+    int RunIndex = 0;
+
+    // Quantized gradient for each difference in [-MaxValue, MaxValue]
+    std::vector<int8_t> GradientTable;
+    const int8_t* Gradient = nullptr;
+
+    // Quantized and modulo reduced error for each error in [-MaxValue, MaxValue]
+    std::vector<int> ErrorTable;
+    const int* Error = nullptr;
+
+
+    void Initialize(int max_value, int near);
+
+    inline int QuantizeError(int e) const
+    {
+        if (Near == 0) {
+            return e;
+        }
+        if (e > 0) {
+            return (e + Near) / Step;
+        }
+        return -((Near - e) / Step);
+    }
+
+    inline int ModuloRange(int e) const
+    {
+        if (e < 0) {
+            e += Range;
+        }
+        if (e >= (Range + 1) / 2) {
+            e -= Range;
+        }
+        return e;
+    }
+
+    inline int Reconstruct(int prediction, int e) const
+    {
+        int x = prediction + e * Step;
+        if (x < -Near) {
+            x += Range * Step;
+        } else if (x > MaxValue + Near) {
+            x -= Range * Step;
+        }
+        if (x < 0) {
+            return 0;
+        }
+        if (x > MaxValue) {
+            return MaxValue;
+        }
+        return x;
+    }
+
+    inline int RegularGolombK(int q) const
+    {
+        int k = 0;
+        while ((N[q] << k) < A[q]) {
+            ++k;
+        }
+        return k;
+    }
+
+    inline int RunGolombK(int q) const
+    {
+        const int temp = A[q] + (N[q] >> 1) * (q - kRunContext);
+        int k = 0;
+        while ((N[q] << k) < temp) {
+            ++k;
+        }
+        return k;
+    }
+
+    // Returns -1 when the mapping of the error sign should be flipped
+    inline int ErrorCorrection(int q, int k) const
+    {
+        if (k != 0 || Near != 0) {
+            return 0;
+        }
+        return (2 * B[q] + N[q] - 1) >> 31;
+    }
+
+    inline void UpdateRegular(int q, int e)
+    {
+        A[q] += abs(e);
+        B[q] += e * Step;
+        if (N[q] == kReset) {
+            A[q] >>= 1;
+            B[q] >>= 1;
+            N[q] >>= 1;
+        }
+        N[q]++;
+
+        if (B[q] + N[q] <= 0) {
+            B[q] += N[q];
+            if (B[q] <= -N[q]) {
+                B[q] = -N[q] + 1;
+            }
+            if (C[q] > kMinC) {
+                C[q]--;
+            }
+        } else if (B[q] > 0) {
+            B[q] -= N[q];
+            if (B[q] > 0) {
+                B[q] = 0;
+            }
+            if (C[q] < kMaxC) {
+                C[q]++;
+            }
+        }
+    }
+
+    inline int RunMap(int q, int e, int k) const
+    {
+        const int nn = Nn[q - kRunContext];
+        if (k == 0 && e > 0 && 2 * nn < N[q]) {
+            return 1;
+        }
+        if (e < 0 && 2 * nn >= N[q]) {
+            return 1;
+        }
+        if (e < 0 && k != 0) {
+            return 1;
+        }
+        return 0;
+    }
+
+    inline void UpdateRun(int q, int e, int mapped)
+    {
+        const int ri_type = q - kRunContext;
+        if (e < 0) {
+            Nn[ri_type]++;
+        }
+        A[q] += (mapped + 1 - ri_type) >> 1;
+        if (N[q] == kReset) {
+            A[q] >>= 1;
+            N[q] >>= 1;
+            Nn[ri_type] >>= 1;
+        }
+        N[q]++;
+    }
+
+    inline int ContextIndex(int ra, int rb, int rc, int rd) const
+    {
+        return (Gradient[rd - rb] * 9 + Gradient[rb - rc]) * 9 + Gradient[rc - ra];
+    }
+};
+
+static int Clamp(int x, int low, int high)
+{
+    if (x < low) {
+        return low;
+    }
+    if (x > high) {
+        return high;
+    }
+    return x;
+}
+
+// Longest code for one pixel in bits, from T.87
+static int GetCodeLimit(int max_value)
+{
+    int bpp = 0;
+    while ((1 << bpp) < max_value + 1) {
+        ++bpp;
+    }
+    if (bpp < 2) {
+        bpp = 2;
+    }
+    return 2 * (bpp + (bpp > 8 ? bpp : 8));
+}
+
+void LocoState::Initialize(int max_value, int near)
+{
+    MaxValue = max_value;
+    Near = near;
+    Step = 2 * near + 1;
+    Range = (max_value + 2 * near) / Step + 1;
+
+    Qbpp = 0;
+    while ((1 << Qbpp) < Range) {
+        ++Qbpp;
+    }
+    Limit = GetCodeLimit(max_value);
+
+    // Default thresholds from T.87
+    int t1, t2, t3;
+    if (max_value >= 128) {
+        const int factor = ((max_value < 4095 ? max_value : 4095) + 128) / 256;
+        t1 = Clamp(factor * (3 - 2) + 2 + 3 * near, near + 1, max_value);
+        t2 = Clamp(factor * (7 - 3) + 3 + 5 * near, t1, max_value);
+        t3 = Clamp(factor * (21 - 4) + 4 + 7 * near, t2, max_value);
+    } else {
+        const int factor = 256 / (max_value + 1);
+        t1 = Clamp(3 / factor + 3 * near, near + 1, max_value);
+        if (t1 < 2) {
+            t1 = 2;
+        }
+        t2 = Clamp(7 / factor + 5 * near, t1, max_value);
+        if (t2 < 3) {
+            t2 = 3;
+        }
+        t3 = Clamp(21 / factor + 7 * near, t2, max_value);
+        if (t3 < 4) {
+            t3 = 4;
+        }
+    }
+
+    GradientTable.resize(2 * max_value + 1);
+    Gradient = GradientTable.data() + max_value;
+    for (int d = -max_value; d <= max_value; ++d) {
+        int q;
+        if (d <= -t3) {
+            q = -4;
+        } else if (d <= -t2) {
+            q = -3;
+        } else if (d <= -t1) {
+            q = -2;
+        } else if (d < -near) {
+            q = -1;
+        } else if (d <= near) {
+            q = 0;
+        } else if (d < t1) {
+            q = 1;
+        } else if (d < t2) {
+            q = 2;
+        } else if (d < t3) {
+            q = 3;
+        } else {
+            q = 4;
+        }
+        GradientTable[d + max_value] = static_cast<int8_t>( q );
+    }
+
+    ErrorTable.resize(2 * max_value + 1);
+    Error = ErrorTable.data() + max_value;
+    for (int e = -max_value; e <= max_value; ++e) {
+        ErrorTable[e + max_value] = ModuloRange(QuantizeError(e));
+    }
+
+    int a_init = (Range + 32) / 64;
+    if (a_init < 2) {
+        a_init = 2;
+    }
+    for (int i = 0; i < kRegularContexts + 2; ++i) {
+        A[i] = a_init;
+        N[i] = 1;
+    }
+    for (int i = 0; i < kRegularContexts; ++i) {
+        B[i] = 0;
+        C[i] = 0;
+    }
+    Nn[0] = Nn[1] = 0;
+    RunIndex = 0;
+}
+
+// Median edge-detect predictor
+static inline int PredictMED(int ra, int rb, int rc)
+{
+    const int min_ab = ra < rb ? ra : rb;
+    const int max_ab = ra < rb ? rb : ra;
+    if (rc >= max_ab) {
+        return min_ab;
+    }
+    if (rc <= min_ab) {
+        return max_ab;
+    }
+    return ra + rb - rc;
+}
+
+} // namespace
+
+
+//------------------------------------------------------------------------------
+// LocoEncoder
+
+namespace {
+
+class LocoEncoder
+{
+public:
+    LocoState State;
+    BitWriter Bits;
+
+
+    // Golomb code with a length limit from T.87
+    inline void WriteMapped(int k, int mapped, int limit)
+    {
+        const int qbpp = State.Qbpp;
+        int high_bits = mapped >> k;
+        if (high_bits < limit - qbpp - 1) {
+            Bits.WriteZeros(high_bits);
+            Bits.Write(1, 1);
+            Bits.Write(mapped & ((1 << k) - 1), k);
+            return;
+        }
+        Bits.WriteZeros(limit - qbpp - 1);
+        Bits.Write(1, 1);
+        Bits.Write((mapped - 1) & ((1 << qbpp) - 1), qbpp);
+    }
+
+    // Returns the reconstructed value.
+    // Pixels that are skipped are coded as the prediction.
+    inline int EncodeRegular(int q, int x, bool skipped, int ra, int rb, int rc)
+    {
+        const int sign = q >> 31;
+        q = (q ^ sign) - sign;
+
+        LocoState& s = State;
+        const int k = s.RegularGolombK(q);
+        int px = PredictMED(ra, rb, rc) + ((s.C[q] ^ sign) - sign);
+        px = Clamp(px, 0, s.MaxValue);
+        if (skipped) {
+            x = px;
+        }
+
+        const int e = s.Error[((x - px) ^ sign) - sign];
+
+        const int corrected = s.ErrorCorrection(q, k) ^ e;
+        const int mapped = corrected >= 0 ? 2 * corrected : -2 * corrected - 1;
+        WriteMapped(k, mapped, s.Limit);
+
+        s.UpdateRegular(q, e);
+
+        return s.Reconstruct(px, (e ^ sign) - sign);
+    }
+
+    // Returns the reconstructed value
+    inline int EncodeInterruption(int x, int ra, int rb)
+    {
+        LocoState& s = State;
+        int q, px, sign = 1;
+        if (abs(ra - rb) <= s.Near) {
+            q = kRunContext + 1;
+            px = ra;
+        } else {
+            q = kRunContext;
+            px = rb;
+            if (rb < ra) {
+                sign = -1;
+            }
+        }
+
+        const int e = s.Error[(x - px) * sign];
+        const int k = s.RunGolombK(q);
+        const int map = s.RunMap(q, e, k);
+        const int mapped = 2 * abs(e) - (q - kRunContext) - map;
+        WriteMapped(k, mapped, s.Limit - kJ[s.RunIndex] - 1);
+
+        s.UpdateRun(q, e, mapped);
+
+        return s.Reconstruct(px, e * sign);
+    }
+
+    inline void EncodeRunLength(int count, bool end_of_line)
+    {
+        LocoState& s = State;
+        while (count >= (1 << kJ[s.RunIndex])) {
+            Bits.Write(1, 1);
+            count -= 1 << kJ[s.RunIndex];
+            if (s.RunIndex < 31) {
+                s.RunIndex++;
+            }
+        }
+        if (end_of_line) {
+            if (count > 0) {
+                Bits.Write(1, 1);
+            }
+        } else {
+            Bits.Write(0, 1);
+            Bits.Write(count, kJ[s.RunIndex]);
+        }
+    }
+
+    template<typename T>
+    void EncodeImage(const T* image, const uint8_t* skip, int width, int height);
+};
+
+static inline bool IsSkipped(const uint8_t* skip, int i)
+{
+    return skip != nullptr && ((skip[i >> 3] >> (i & 7)) & 1) != 0;
+}
+
+template<typename T>
+void LocoEncoder::EncodeImage(const T* image, const uint8_t* skip, int width, int height)
+{
+    LocoState& s = State;
+    int row_start = 0;
+
+    // Reconstructed lines with one extra pixel on each side
+    std::vector<int> lines(2 * (width + 2), 0);
+    int* prev = lines.data();
+    int* cur = prev + width + 2;
+
+    for (int y = 0; y < height; ++y, image += width, row_start += width)
+    {
+        // Edge pixels from T.87: Ra = Rb and Rd = Rb at the line ends
+        prev[width + 1] = prev[width];
+        cur[0] = prev[1];
+
+        int x = 0;
+        while (x < width)
+        {
+            const int i = x + 1;
+            const int ra = cur[i - 1];
+            const int rb = prev[i];
+            const int rc = prev[i - 1];
+            const int rd = prev[i + 1];
+
+            const int q = s.ContextIndex(ra, rb, rc, rd);
+            if (q != 0) {
+                cur[i] = EncodeRegular(q, image[x], IsSkipped(skip, row_start + x), ra, rb, rc);
+                ++x;
+                continue;
+            }
+
+            // Run mode: Count pixels that are within Near of Ra
+            int count = 0;
+            while (x < width && (abs(static_cast<int>( image[x] ) - ra) <= s.Near ||
+                IsSkipped(skip, row_start + x)))
+            {
+                cur[x + 1] = ra;
+                ++count;
+                ++x;
+            }
+            if (x >= width) {
+                EncodeRunLength(count, true);
+                break;
+            }
+            EncodeRunLength(count, false);
+
+            // Skipped pixels always continue the run, so this one is needed
+            cur[x + 1] = EncodeInterruption(image[x], cur[x], prev[x + 1]);
+            if (s.RunIndex > 0) {
+                s.RunIndex--;
+            }
+            ++x;
+        }
+
+        int* temp = prev;
+        prev = cur;
+        cur = temp;
+    }
+}
+
+
+//------------------------------------------------------------------------------
+// LocoDecoder
+
+class LocoDecoder
+{
+public:
+    LocoState State;
+    BitReader Bits;
+    bool Failed = false;
+
+
+    inline int ReadMapped(int k, int limit)
+    {
+        const int qbpp = State.Qbpp;
+        const int high_bits = Bits.ReadUnary(limit);
+        if (high_bits > limit - qbpp - 1) {
+            Failed = true;
+            return 0;
+        }
+        if (high_bits == limit - qbpp - 1) {
+            return static_cast<int>( Bits.Read(qbpp) ) + 1;
+        }
+        return (high_bits << k) + static_cast<int>( Bits.Read(k) );
+    }
+
+    inline int DecodeRegular(int q, int ra, int rb, int rc)
+    {
+        const int sign = q >> 31;
+        q = (q ^ sign) - sign;
+
+        LocoState& s = State;
+        const int k = s.RegularGolombK(q);
+        int px = PredictMED(ra, rb, rc) + ((s.C[q] ^ sign) - sign);
+        px = Clamp(px, 0, s.MaxValue);
+
+        const int mapped = ReadMapped(k, s.Limit);
+        int e = (mapped >> 1) ^ -(mapped & 1);
+        e ^= s.ErrorCorrection(q, k);
+
+        s.UpdateRegular(q, e);
+
+        return s.Reconstruct(px, (e ^ sign) - sign);
+    }
+
+    inline int DecodeInterruption(int ra, int rb)
+    {
+        LocoState& s = State;
+        int q, px, sign = 1;
+        if (abs(ra - rb) <= s.Near) {
+            q = kRunContext + 1;
+            px = ra;
+        } else {
+            q = kRunContext;
+            px = rb;
+            if (rb < ra) {
+                sign = -1;
+            }
+        }
+
+        const int ri_type = q - kRunContext;
+        const int k = s.RunGolombK(q);
+        const int mapped = ReadMapped(k, s.Limit - kJ[s.RunIndex] - 1);
+
+        // Undo the mapping of the error value
+        const int temp = mapped + ri_type;
+        const int map = temp & 1;
+        const int abs_e = (temp + map) / 2;
+        const bool negative = (k != 0 || 2 * s.Nn[ri_type] >= s.N[q]) == (map != 0);
+        const int e = negative ? -abs_e : abs_e;
+
+        s.UpdateRun(q, e, mapped);
+
+        return s.Reconstruct(px, e * sign);
+    }
+
+    // Returns the number of pixels in the run, up to `remaining`.
+    // Sets `interrupted` if the run ended before the end of the line.
+    inline int DecodeRunLength(int remaining, bool& interrupted)
+    {
+        LocoState& s = State;
+        int count = 0;
+        while (Bits.Read(1) != 0) {
+            const int segment = 1 << kJ[s.RunIndex];
+            if (segment <= remaining - count) {
+                count += segment;
+                if (s.RunIndex < 31) {
+                    s.RunIndex++;
+                }
+            } else {
+                count = remaining;
+            }
+            if (count >= remaining) {
+                interrupted = false;
+                return count;
+            }
+            if (Bits.Overrun()) {
+                Failed = true;
+                return 0;
+            }
+        }
+        count += static_cast<int>( Bits.Read(kJ[s.RunIndex]) );
+        if (count >= remaining) {
+            Failed = true;
+            return 0;
+        }
+        interrupted = true;
+        return count;
+    }
+
+    template<typename T>
+    bool DecodeImage(T* image, int width, int height);
+};
+
+template<typename T>
+bool LocoDecoder::DecodeImage(T* image, int width, int height)
+{
+    LocoState& s = State;
+
+    std::vector<int> lines(2 * (width + 2), 0);
+    int* prev = lines.data();
+    int* cur = prev + width + 2;
+
+    for (int y = 0; y < height; ++y, image += width)
+    {
+        prev[width + 1] = prev[width];
+        cur[0] = prev[1];
+
+        int x = 0;
+        while (x < width)
+        {
+            const int i = x + 1;
+            const int ra = cur[i - 1];
+            const int rb = prev[i];
+            const int rc = prev[i - 1];
+            const int rd = prev[i + 1];
+
+            const int q = s.ContextIndex(ra, rb, rc, rd);
+            if (q != 0) {
+                const int value = DecodeRegular(q, ra, rb, rc);
+                cur[i] = value;
+                image[x] = static_cast<T>( value );
+                ++x;
+                continue;
+            }
+
+            bool interrupted = false;
+            const int count = DecodeRunLength(width - x, interrupted);
+            if (Failed) {
+                return false;
+            }
+            for (int j = 0; j < count; ++j, ++x) {
+                cur[x + 1] = ra;
+                image[x] = static_cast<T>( ra );
+            }
+            if (!interrupted) {
+                break;
+            }
+
+            const int value = DecodeInterruption(cur[x], prev[x + 1]);
+            cur[x + 1] = value;
+            image[x] = static_cast<T>( value );
+            if (s.RunIndex > 0) {
+                s.RunIndex--;
+            }
+            ++x;
+        }
+
+        if (Failed || Bits.Overrun()) {
+            return false;
+        }
+
+        int* temp = prev;
+        prev = cur;
+        cur = temp;
+    }
+
+    return true;
+}
+
+} // namespace
+
+
+//------------------------------------------------------------------------------
+// API
+
+template<typename T>
+static void LocoCompressImage(
+    const T* image,
+    const uint8_t* skip,
+    int width,
+    int height,
+    int max_value,
+    int near,
+    std::vector<uint8_t>& compressed)
+{
+    near = Clamp(near, 0, kLocoMaxNear);
+
+    LocoEncoder encoder;
+    encoder.State.Initialize(max_value, near);
+
+    compressed.resize(LocoCompressBound(width, height, max_value));
+
+    uint8_t* header = compressed.data();
+    header[0] = static_cast<uint8_t>( near );
+    header[1] = static_cast<uint8_t>( max_value );
+    header[2] = static_cast<uint8_t>( max_value >> 8 );
+
+    encoder.Bits.Reset(header + kLocoHeaderBytes);
+    encoder.EncodeImage(image, skip, width, height);
+    compressed.resize(kLocoHeaderBytes + encoder.Bits.Flush());
+}
+
+template<typename T>
+static bool LocoDecompressImage(
+    const uint8_t* data,
+    int bytes,
+    int width,
+    int height,
+    int max_value,
+    std::vector<T>& image)
+{
+    if (bytes < kLocoHeaderBytes || width < 1 || height < 1) {
+        return false;
+    }
+    const int near = data[0];
+    const int stream_max_value = data[1] | (static_cast<int>( data[2] ) << 8);
+    if (stream_max_value != max_value) {
+        return false;
+    }
+
+    LocoDecoder decoder;
+    decoder.State.Initialize(max_value, near);
+    decoder.Bits.Reset(data + kLocoHeaderBytes, bytes - kLocoHeaderBytes);
+
+    image.resize(static_cast<size_t>( width ) * height);
+    return decoder.DecodeImage(image.data(), width, height);
+}
+
+size_t LocoCompressBound(int width, int height, int max_value)
+{
+    // Each pixel takes at most Limit bits, plus a run bit for each pixel
+    return kLocoHeaderBytes +
+        static_cast<size_t>( width ) * height * (GetCodeLimit(max_value) + 1) / 8 + 16;
+}
+
+void LocoCompress(
+    const uint8_t* image,
+    int width,
+    int height,
+    int near,
+    std::vector<uint8_t>& compressed)
+{
+    LocoCompressImage(image, nullptr, width, height, 255, near, compressed);
+}
+
+bool LocoDecompress(
+    const uint8_t* data,
+    int bytes,
+    int width,
+    int height,
+    std::vector<uint8_t>& image)
+{
+    return LocoDecompressImage(data, bytes, width, height, 255, image);
+}
+
+void LocoCompress16(
+    const uint16_t* image,
+    const uint8_t* skip,
+    int width,
+    int height,
+    int max_value,
+    int near,
+    std::vector<uint8_t>& compressed)
+{
+    LocoCompressImage(image, skip, width, height, max_value, near, compressed);
+}
+
+bool LocoDecompress16(
+    const uint8_t* data,
+    int bytes,
+    int width,
+    int height,
+    int max_value,
+    std::vector<uint16_t>& image)
+{
+    return LocoDecompressImage(data, bytes, width, height, max_value, image);
+}
+
+
+} // namespace zdepth
@@ -0,0 +1,128 @@
+// Copyright 2019 (c) Christopher A. Taylor.  All rights reserved.
+
+#include "SoftwareBackend.hpp"
+#include "LocoCodec.hpp"
+#include "WaveletCodec.hpp"
+#include "WorkerPool.hpp"
+
+namespace zdepth {
+
+
+//------------------------------------------------------------------------------
+// SoftwareBackend
+
+SoftwareBackend::~SoftwareBackend()
+{
+    // Do not let an encode outlive the buffers it is writing to
+    if (Result.valid()) {
+        Result.wait();
+    }
+}
+
+bool SoftwareBackend::Probe(VideoType type)
+{
+    return type == VideoType::Loco ||
+        type == VideoType::Wavelet ||
+        type == VideoType::Dct;
+}
+
+bool SoftwareBackend::EncodeBegin(
+    const VideoParameters& params,
+    bool keyframe,
+    const std::vector<uint8_t>& data,
+    std::vector<uint8_t>& compressed)
+{
+    // Run the encoder on a worker thread so that the caller can do other
+    // work (like Zstd compression) until EncodeFinish() like with NVENC.
+    // The input and output buffers must stay untouched until then.
+    const uint8_t* image = data.data();
+    std::vector<uint8_t>* output = &compressed;
+    DctEncoder* dct = &DctEncode;
+
+    // Only the DCT codec can spend fewer bits on unimportant blocks
+    const uint8_t* importance = nullptr;
+    if (params.Type == VideoType::Dct && GetBlockImportance(params, 16, Importance)) {
+        importance = Importance.data();
+    }
+
+    auto task = std::make_shared<std::packaged_task<bool()>>([params, keyframe, image, importance, output, dct]() {
+        if (params.Type == VideoType::Dct) {
+            dct->Compress(
+                image,
+                params.Width,
+                params.Height,
+                params.DctQuantizer,
+                keyframe,
+                importance,
+                *output);
+        } else if (params.Type == VideoType::Wavelet) {
+            WaveletCompress(
+                image,
+                params.Width,
+                params.Height,
+                params.WaveletFrameBytes,
+                *output);
+        } else {
+            LocoCompress(
+                image,
+                params.Width,
+                params.Height,
+                params.LocoNear,
+                *output);
+        }
+        return true;
+    });
+    Result = task->get_future();
+
+    WorkerPool::Shared().Submit([task]() {
+        (*task)();
+    });
+    return true;
+}
+
+bool SoftwareBackend::EncodeFinish(
+    std::vector<uint8_t>& /*compressed*/)
+{
+    if (!Result.valid()) {
+        return false;
+    }
+    return Result.get();
+}
+
+bool SoftwareBackend::Decode(
+    const VideoParameters& params,
+    const uint8_t* data,
+    int bytes,
+    std::vector<uint8_t>& decoded)
+{
+    if (params.Type == VideoType::Dct) {
+        return DctDecode.Decompress(
+            data,
+            bytes,
+            params.Width,
+            params.Height,
+            decoded);
+    }
+    if (params.Type == VideoType::Wavelet) {
+        return WaveletDecompress(
+            data,
+            bytes,
+            params.Width,
+            params.Height,
+            decoded);
+    }
+    return LocoDecompress(
+        data,
+        bytes,
+        params.Width,
+        params.Height,
+        decoded);
+}
+
+std::unique_ptr<VideoBackend> CreateSoftwareBackend()
+{
+    return std::unique_ptr<VideoBackend>( new SoftwareBackend );
+}
+
+
+} // namespace zdepth
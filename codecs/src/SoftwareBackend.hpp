@@ -0,0 +1,71 @@
+// Copyright 2019 (c) Christopher A. Taylor.  All rights reserved.
+
+/*
+    CPU-only video backend for the codecs that do not need a GPU:
+    VideoType::Loco, VideoType::Wavelet and VideoType::Dct.
+
+    Encoding runs on the shared WorkerPool between EncodeBegin() and
+    EncodeFinish(), so the caller can compress the High bits meanwhile,
+    like it does while NVENC is busy.
+*/
+
+#pragma once
+
+#include "VideoCodec.hpp"
+#include "DctCodec.hpp"
+
+#include <future>
+
+namespace zdepth {
+
+
+//------------------------------------------------------------------------------
+// SoftwareBackend
+
+class SoftwareBackend : public VideoBackend
+{
+public:
+    ~SoftwareBackend();
+
+    const char* GetName() const override
+    {
+        return "Software";
+    }
+
+    bool Probe(VideoType type) override;
+
+    VideoLayout GetInputLayout() const override
+    {
+        return VideoLayout::Luma;
+    }
+
+    bool EncodeBegin(
+        const VideoParameters& params,
+        bool keyframe,
+        const std::vector<uint8_t>& data,
+        std::vector<uint8_t>& compressed) override;
+    bool EncodeFinish(
+        std::vector<uint8_t>& compressed) override;
+
+    bool Decode(
+        const VideoParameters& params,
+        const uint8_t* data,
+        int bytes,
+        std::vector<uint8_t>& decoded) override;
+
+protected:
+    // Encoder runs on a worker thread between EncodeBegin/Finish
+    std::future<bool> Result;
+
+    // Codecs that keep buffers between frames
+    DctEncoder DctEncode;
+    DctDecoder DctDecode;
+
+    // Importance of each macroblock for the DCT encoder
+    std::vector<uint8_t> Importance;
+};
+
+std::unique_ptr<VideoBackend> CreateSoftwareBackend();
+
+
+} // namespace zdepth
@@ -1,360 +1,291 @@
 // Copyright 2019 (c) Christopher A. Taylor.  All rights reserved.
 
 #include "VideoCodec.hpp"
+#include "SoftwareBackend.hpp"
+#include "DctCodec.hpp"
+#include "LocoCodec.hpp"
+#include "WaveletCodec.hpp"
+
+#if defined(ZDEPTH_CUDA)
+    #include "CudaBackend.hpp"
+#endif // ZDEPTH_CUDA
+
+#include <algorithm>
+#include <mutex>
 
 namespace zdepth {
 
 
 //------------------------------------------------------------------------------
-// CUDA Context
+// Importance
 
-bool CudaContext::Create(int gpu_index)
+bool GetBlockImportance(
+    const VideoParameters& params,
+    int block_size,
+    std::vector<uint8_t>& importance)
 {
-    if (Context) {
-        return true; // Already created
+    if (!params.Importance) {
+        return false;
     }
 
-    CUresult result;
+    const int map_width = (params.Width + 7) / 8;
+    const int map_height = (params.Height + 7) / 8;
+    const int scale = block_size / 8;
+    const int blocks_x = (params.Width + block_size - 1) / block_size;
+    const int blocks_y = (params.Height + block_size - 1) / block_size;
+
+    importance.assign(blocks_x * blocks_y, 0);
+    for (int y = 0; y < map_height; ++y) {
+        const uint8_t* src = params.Importance + y * map_width;
+        uint8_t* dest = importance.data() + (y / scale) * blocks_x;
+        for (int x = 0; x < map_width; ++x) {
+            uint8_t& block = dest[x / scale];
+            if (block < src[x]) {
+                block = src[x];
+            }
+        }
+    }
+    return true;
+}
 
-    GpuIndex = gpu_index;
 
-    result = cuInit(0);
-    if (result != CUDA_SUCCESS) {
-        return false;
-    }
+//------------------------------------------------------------------------------
+// Compress Bound
 
-    result = cuDeviceGet(&Device, gpu_index);
-    if (result != CUDA_SUCCESS) {
-        return false;
-    }
+// H.264 and H.265 can always fall back to PCM macroblocks, which bounds a
+// frame to a little over the raw NV12 size.  This allows twice that for the
+// slice headers and parameter sets.
+static size_t GetHardwareCompressBound(int width, int height)
+{
+    return 2 * static_cast<size_t>( GetVideoLayoutBytes(VideoLayout::NV12, width, height) ) + 4096;
+}
 
-    cudaError_t err = cudaGetDeviceProperties(&Properties, Device);
-    if (err != cudaSuccess) {
-        return false;
+static size_t GetTypeCompressBound(VideoType type, const VideoParameters& params)
+{
+    switch (type)
+    {
+    case VideoType::Loco:
+        return LocoCompressBound(params.Width, params.Height, 255);
+    case VideoType::Wavelet: {
+        const size_t bound = WaveletCompressBound(params.Width, params.Height);
+        if (params.WaveletFrameBytes > 0) {
+            const int max_bytes = std::max(params.WaveletFrameBytes, kWaveletHeaderBytes);
+            return std::min(bound, static_cast<size_t>( max_bytes ));
+        }
+        return bound;
     }
-
-    // Reuse the primary context to play nicer with application code
-    result = cuDevicePrimaryCtxRetain(&Context, Device);
-    if (result != CUDA_SUCCESS) {
-        return false;
+    case VideoType::Dct:
+        return DctCompressBound(params.Width, params.Height);
+    default:
+        break;
     }
-
-    return true;
+    return GetHardwareCompressBound(params.Width, params.Height);
 }
 
-void CudaContext::Destroy()
+size_t GetVideoCompressBound(const VideoParameters& params)
 {
-    if (Context) {
-        cuDevicePrimaryCtxRelease(Device);
-        Context = nullptr;
+    // The software backend codes the software types and never fails, so
+    // only the hardware types can fall back.  Each frame takes one path.
+    const size_t bound = GetTypeCompressBound(params.Type, params);
+    if (params.Type == VideoType::H264 || params.Type == VideoType::H265) {
+        return std::max(bound, GetTypeCompressBound(kFallbackVideoType, params));
     }
+    return bound;
 }
 
 
 //------------------------------------------------------------------------------
-// Video Codec : API
+// Video Backend Registry
 
-bool VideoCodec::EncodeBegin(
-    const VideoParameters& params,
-    bool keyframe,
-    const std::vector<uint8_t>& data,
-    std::vector<uint8_t>& compressed)
+namespace {
+
+struct BackendRegistry
 {
-    // If resolution changed:
-    if (params.Width != Params.Width || params.Height != Params.Height) {
-        CleanupCuda();
-        EncoderBackend = VideoBackend::Uninitialized;
-        DecoderBackend = VideoBackend::Uninitialized;
+    std::mutex Lock;
+
+    // In the order they are tried
+    std::vector<VideoBackendFactory> Factories;
+
+
+    BackendRegistry()
+    {
+#if defined(ZDEPTH_CUDA)
+        Factories.push_back(CreateCudaBackend);
+#endif // ZDEPTH_CUDA
+        Factories.push_back(CreateSoftwareBackend);
     }
-    Params = params;
+};
+
+} // namespace
 
-    return EncodeBeginNvenc(keyframe, data, compressed);
+static BackendRegistry& GetRegistry()
+{
+    static BackendRegistry registry;
+    return registry;
 }
 
-bool VideoCodec::EncodeFinish(
-    std::vector<uint8_t>& compressed)
+static std::vector<VideoBackendFactory> GetFactories()
 {
-    return EncodeFinishNvenc(compressed);
+    BackendRegistry& registry = GetRegistry();
+    std::lock_guard<std::mutex> locker(registry.Lock);
+    return registry.Factories;
 }
 
-bool VideoCodec::Decode(
-    int width,
-    int height,
-    VideoType type,
-    const uint8_t* data,
-    int bytes,
-    std::vector<uint8_t>& decoded)
+void RegisterVideoBackend(VideoBackendFactory factory)
 {
-    // If resolution changed:
-    if (width != Params.Width || height != Params.Height) {
-        CleanupCuda();
-        EncoderBackend = VideoBackend::Uninitialized;
-        DecoderBackend = VideoBackend::Uninitialized;
-    }
-    Params.Width = width;
-    Params.Height = height;
-    Params.Type = type;
+    BackendRegistry& registry = GetRegistry();
+    std::lock_guard<std::mutex> locker(registry.Lock);
+    registry.Factories.insert(registry.Factories.begin(), factory);
+}
 
-    return DecodeNvdec(data, bytes, decoded);
+bool IsVideoTypeAvailable(VideoType type)
+{
+    for (VideoBackendFactory factory : GetFactories()) {
+        std::unique_ptr<VideoBackend> backend = factory();
+        if (backend && backend->Probe(type)) {
+            return true;
+        }
+    }
+    return false;
 }
 
 
 //------------------------------------------------------------------------------
-// Video Codec : CUDA Backend
+// Video Codec
 
-bool VideoCodec::EncodeBeginNvenc(
-    bool keyframe,
-    const std::vector<uint8_t>& data,
-    std::vector<uint8_t>& compressed)
+std::unique_ptr<VideoBackend> VideoCodec::CreateBackend(
+    VideoType type,
+    const std::vector<VideoBackendFactory>& skip,
+    VideoBackendFactory* factory_out)
 {
-    try {
-        if (!CudaEncoder) {
-            if (!Context.Create()) {
-                return false;
-            }
-
-            CodecGuid = (Params.Type == VideoType::H264) ? NV_ENC_CODEC_H264_GUID : NV_ENC_CODEC_HEVC_GUID;
-
-            CudaEncoder = std::make_shared<NvEncoderCuda>(
-                Context.Context,
-                Params.Width,
-                Params.Height,
-                NV_ENC_BUFFER_FORMAT_NV12);
-
-            NV_ENC_INITIALIZE_PARAMS encodeParams = { NV_ENC_INITIALIZE_PARAMS_VER };
-            NV_ENC_CONFIG encodeConfig = { NV_ENC_CONFIG_VER };
-            encodeParams.encodeConfig = &encodeConfig;
-
-            CudaEncoder->CreateDefaultEncoderParams(
-                &encodeParams,
-                CodecGuid,
-                NV_ENC_PRESET_LOW_LATENCY_HQ_GUID);
-
-            encodeParams.frameRateNum = Params.Fps;
-            encodeParams.frameRateDen = 1;
-            encodeParams.enablePTD = 1; // Allow NVENC to choose picture types
-
-            const bool supports_intra_refresh = CudaEncoder->GetCapabilityValue(
-                CodecGuid,
-                NV_ENC_CAPS_SUPPORT_INTRA_REFRESH);
-
-            // Enable intra-refresh for a more consistent frame size:
-            if (Params.Type == VideoType::H264) {
-                auto& h264Config = encodeConfig.encodeCodecConfig.h264Config;
-                h264Config.repeatSPSPPS = 0;
-                if (supports_intra_refresh) {
-                    h264Config.enableIntraRefresh = 1;
-                    h264Config.intraRefreshPeriod = Params.Fps * 10;
-                    h264Config.intraRefreshCnt = Params.Fps;
-                    h264Config.idrPeriod = NVENC_INFINITE_GOPLENGTH;
-                }
-            } else { // HEVC:
-                auto& hevcConfig = encodeConfig.encodeCodecConfig.hevcConfig;
-                hevcConfig.repeatSPSPPS = 0;
-                if (supports_intra_refresh) {
-                    hevcConfig.enableIntraRefresh = 1;
-                    hevcConfig.intraRefreshPeriod = Params.Fps * 10;
-                    hevcConfig.intraRefreshCnt = Params.Fps;
-                    hevcConfig.idrPeriod = NVENC_INFINITE_GOPLENGTH;
-                }
+    for (VideoBackendFactory factory : GetFactories())
+    {
+        if (std::find(skip.begin(), skip.end(), factory) != skip.end()) {
+            continue;
+        }
+        std::unique_ptr<VideoBackend> backend = factory();
+        if (backend && backend->Probe(type)) {
+            if (factory_out) {
+                *factory_out = factory;
             }
+            return backend;
+        }
+    }
+    return nullptr;
+}
 
-            // Manual IDRs when application requests a keyframe
-            encodeConfig.gopLength = NVENC_INFINITE_GOPLENGTH;
-            encodeConfig.frameIntervalP = 1;
-
-            // Target bitrate: Recommend 2 Mbps at 320 x 288.
-            // Otherwise it is better to just use the lossless encoder.
-            const float bitrate_scale = Params.Width * Params.Height / static_cast<float>(320 * 288);
-            const unsigned bitrate = static_cast<unsigned>( 2000000 * bitrate_scale );
-
-            // Choose VBR mode allowing for spikes for tricky frames
-            // NV_ENC_PARAMS_RC_CBR_LOWDELAY_HQ: Error bound is smaller
-            // NV_ENC_PARAMS_RC_CBR_HQ: Seems to have a longer tail of errors
-            // NV_ENC_PARAMS_RC_VBR_HQ: Also long error tail
-            encodeConfig.rcParams.rateControlMode = NV_ENC_PARAMS_RC_CBR_LOWDELAY_HQ;
-            encodeConfig.rcParams.averageBitRate = bitrate;
-            encodeConfig.rcParams.maxBitRate = bitrate;
-
-            // Tune VBV size 
-            encodeConfig.rcParams.vbvBufferSize = bitrate / Params.Fps;
-            encodeConfig.rcParams.vbvInitialDelay = encodeConfig.rcParams.vbvBufferSize;
+void VideoCodec::SelectEncoder(VideoType type)
+{
+    // Keep using the same backend while the requested type stays the same,
+    // including after falling back to another type
+    if (!Encoder || type != RequestedType)
+    {
+        Encoder = CreateBackend(type, FailedEncoders, &EncoderFactory);
+        RequestedType = type;
+        EncoderType = type;
+        EncoderReset = true;
+    }
+}
 
-            // Disable adaptive quantization for this type of data.
-            // It leads to much higher long tail errors.
-            encodeConfig.rcParams.enableTemporalAQ = 0;
-            encodeConfig.rcParams.enableAQ = 0; // Spatial
-            encodeConfig.rcParams.aqStrength = 1; // Lower is better
+VideoLayout VideoCodec::GetInputLayout(const VideoParameters& params)
+{
+    SelectEncoder(params.Type);
+    if (!Encoder) {
+        return VideoLayout::Luma; // The fallback is a software type
+    }
+    return Encoder->GetInputLayout();
+}
 
-            // Disable B-frames
-            encodeConfig.rcParams.zeroReorderDelay = 1;
+bool VideoCodec::EncodeBegin(
+    const VideoParameters& params,
+    bool keyframe,
+    const std::vector<uint8_t>& data,
+    std::vector<uint8_t>& compressed)
+{
+    VideoParameters encode_params = params;
+    EncodedKeyframe = false;
 
-            // Enable non-reference P-frame optimization
-            encodeConfig.rcParams.enableNonRefP = 1; // requires enablePTD=1
+    SelectEncoder(params.Type);
+    if (EncoderReset) {
+        keyframe = true;
+        EncoderReset = false;
+    }
 
-            CudaEncoder->CreateEncoder(&encodeParams);
+    for (;;)
+    {
+        if (!Encoder) {
+            // No backend left for the requested type
+            if (EncoderType == kFallbackVideoType) {
+                return false;
+            }
+            Encoder = CreateBackend(kFallbackVideoType, FailedEncoders, &EncoderFactory);
+            EncoderType = kFallbackVideoType;
+            keyframe = true;
+            continue;
         }
 
-        const NvEncInputFrame* frame = CudaEncoder->GetNextInputFrame();
-
-        // If no frames available:
-        if (!frame) {
-            return false;
+        // After a fallback the backend may need a larger layout.  Every
+        // layout starts with the luma, so smaller ones can use the data.
+        const std::vector<uint8_t>* input = &data;
+        const int layout_bytes = GetVideoLayoutBytes(
+            Encoder->GetInputLayout(),
+            params.Width,
+            params.Height);
+        if (static_cast<int>( data.size() ) < layout_bytes) {
+            Converted.assign(layout_bytes, 0);
+            std::copy(data.begin(), data.end(), Converted.begin());
+            input = &Converted;
         }
 
-        NvEncoderCuda::CopyToDeviceFrame(
-            Context.Context,
-            const_cast<uint8_t*>( data.data() ),
-            0,
-            (CUdeviceptr)frame->inputPtr,
-            (int)frame->pitch,
-            Params.Width,
-            Params.Height, 
-            CU_MEMORYTYPE_HOST, 
-            frame->bufferFormat,
-            frame->chromaOffsets,
-            frame->numChromaPlanes);
-
-        // The other parameters are filled in by NvEncoder::DoEncode
-        NV_ENC_PIC_PARAMS pic_params = { NV_ENC_PIC_PARAMS_VER };
-        pic_params.inputPitch = frame->pitch;
-
-        if (keyframe) {
-            // Force an IDR and prepend SPS, PPS units
-            pic_params.encodePicFlags |= NV_ENC_PIC_FLAG_OUTPUT_SPSPPS | NV_ENC_PIC_FLAG_FORCEIDR;
-            pic_params.pictureType = NV_ENC_PIC_TYPE_IDR;
-        } else {
-            pic_params.pictureType = NV_ENC_PIC_TYPE_P;
+        encode_params.Type = EncoderType;
+        if (Encoder->EncodeBegin(encode_params, keyframe, *input, compressed)) {
+            EncodedKeyframe = keyframe;
+            return true;
         }
 
-        // pic_params.frameIdx = 0; // Optional
-        pic_params.inputTimeStamp = NextTimestamp++;
-        // pic_params.inputDuration = 0; // TBD
-        // pic_params.codecPicParams.h264PicParams; // No tweaks seem useful
-        // pic_params.qpDeltaMap = nullptr; // TBD
-        // pic_params.qpDeltaMapSize = 0; // TBD
-
-        // Encode frame and wait for the result.
-        // This takes under a millisecond on modern gaming laptops.
-        CudaEncoder->EncodeFrame(VideoTemp, &pic_params);
-
-        compressed.clear();
-        size_t size = 0;
-        for (auto& unit : VideoTemp)
-        {
-            const size_t unit_size = unit.size();
-            compressed.resize(size + unit_size);
-            memcpy(compressed.data() + size, unit.data(), unit_size);
-            size += unit_size;
-        }
+        // Do not try this backend again for the rest of the stream
+        FailedEncoders.push_back(EncoderFactory);
+        Encoder = CreateBackend(EncoderType, FailedEncoders, &EncoderFactory);
+        keyframe = true;
     }
-    catch (NVENCException& /*ex*/) {
-        return false;
-    }
-
-    return true;
 }
 
-bool VideoCodec::EncodeFinishNvenc(
+bool VideoCodec::EncodeFinish(
     std::vector<uint8_t>& compressed)
 {
-    try {
-        CudaEncoder->EndEncode(VideoTemp);
-
-        // If encode failed:
-        if (VideoTemp.empty()) {
-            return false;
-        }
-
-        size_t size = compressed.size();
-        for (auto& unit : VideoTemp)
-        {
-            const size_t unit_size = unit.size();
-            compressed.resize(size + unit_size);
-            memcpy(compressed.data() + size, unit.data(), unit_size);
-            size += unit_size;
-        }
+    if (!Encoder) {
+        return false;
     }
-    catch (NVENCException& /*ex*/) {
+    if (!Encoder->EncodeFinish(compressed)) {
+        // The next frame will try another backend
+        FailedEncoders.push_back(EncoderFactory);
+        Encoder.reset();
         return false;
     }
-
     return true;
 }
 
-bool VideoCodec::DecodeNvdec(
+bool VideoCodec::Decode(
+    int width,
+    int height,
+    VideoType type,
     const uint8_t* data,
     int bytes,
     std::vector<uint8_t>& decoded)
 {
-    CUresult result;
-
-    try {
-        if (!CudaDecoder) {
-            if (!Context.Create()) {
-                return false;
-            }
-
-            CudaDecoder = std::make_shared<NvDecoder>(
-                Context.Context,
-                Params.Width,
-                Params.Height,
-                false, // Do not use device frame
-                Params.Type == VideoType::H264 ? cudaVideoCodec_H264 : cudaVideoCodec_HEVC,
-                nullptr, // No mutex
-                true, // Low latency
-                false, // Non-pitched frame
-                nullptr, // No crop
-                nullptr); // No resize
-        }
-
-        uint8_t** frames = nullptr;
-        int64_t* timestamps = nullptr;
-        int frame_count = 0;
-
-        // Retries are needed according to Nvidia engineers:
-        // https://github.com/NVIDIA/NvPipe/blob/b3d0a7511052824ff0481fa6eecb3e95eac1a722/src/NvPipe.cu#L969
-
-        for (int i = 0; i < 3; ++i) {
-            bool success = CudaDecoder->Decode(
-                data,
-                bytes,
-                &frames,
-                &frame_count,
-                CUVID_PKT_ENDOFPICTURE, // Immediate result requested
-                &timestamps,
-                0, // Timestamp
-                cudaStreamPerThread); // Use the default per-thread stream
-            if (!success) {
-                return false;
-            }
-
-            // If we got a frame back:
-            if (frame_count >= 1) {
-                break;
-            }
-        }
-
-        if (frame_count < 1) {
+    if (!Decoder || type != DecoderType) {
+        Decoder = CreateBackend(type, std::vector<VideoBackendFactory>(), nullptr);
+        DecoderType = type;
+        if (!Decoder) {
             return false;
         }
-
-        const int y_bytes = Params.Width * Params.Height;
-        decoded.resize(y_bytes);
-        memcpy(decoded.data(), frames[0], y_bytes);
-    }
-    catch (NVENCException& /*ex*/) {
-        return false;
     }
 
-    return true;
-}
-
-void VideoCodec::CleanupCuda()
-{
-    CudaEncoder.reset();
-    CudaDecoder.reset();
-    Context.Destroy();
+    VideoParameters params;
+    params.Type = type;
+    params.Width = width;
+    params.Height = height;
+    return Decoder->Decode(params, data, bytes, decoded);
 }
 
 
@@ -0,0 +1,969 @@
+// Copyright 2019 (c) Christopher A. Taylor.  All rights reserved.
+
+#include "WaveletCodec.hpp"
+#include "BitStream.hpp"
+
+#include <stdlib.h> // abs
+
+#if defined(__SSE2__) || defined(_M_X64) || defined(_M_AMD64)
+    #define DEPTH_ENABLE_SSE2
+    #include <emmintrin.h>
+#endif
+
+namespace zdepth {
+
+
+//------------------------------------------------------------------------------
+// Constants
+
+// Number of subbands for the largest number of levels
+static const int kMaxBands = 1 + 3 * kWaveletMaxLevels;
+
+// Quadtree levels needed to cover a subband up to 4096 wide
+static const int kMaxQuadtreeLevels = 13;
+
+// Coefficient magnitudes are below 2^14 for 8-bit input and 5 levels,
+// so this is enough for the coefficients to fit in int16_t
+static const int kMaxPlanes = 15;
+
+// Do not decompose the low band below this size
+static const int kMinLowBandSize = 8;
+
+
+//------------------------------------------------------------------------------
+// Lifting
+
+/*
+    Each lifting step adds or subtracts a rounded average of two neighbor
+    lines to a line:
+
+        Predict: d[i] -= (s[i] + s[i + 1]) >> 1
+        Update:  s[i] += (d[i - 1] + d[i] + 2) >> 2
+
+    Horizontal steps pass the even/odd halves of a row offset by one sample.
+    Vertical steps pass whole rows, so both directions use the same kernel.
+*/
+template<bool kAdd, int kShift, int kRound>
+static void Lift(
+    int16_t* dest,
+    const int16_t* a,
+    const int16_t* b,
+    int count)
+{
+    int i = 0;
+
+#ifdef DEPTH_ENABLE_SSE2
+    const __m128i round = _mm_set1_epi16(kRound);
+    for (; i + 8 <= count; i += 8) {
+        __m128i sum = _mm_add_epi16(
+            _mm_loadu_si128(reinterpret_cast<const __m128i*>( a + i )),
+            _mm_loadu_si128(reinterpret_cast<const __m128i*>( b + i )));
+        sum = _mm_srai_epi16(_mm_add_epi16(sum, round), kShift);
+
+        __m128i* out = reinterpret_cast<__m128i*>( dest + i );
+        const __m128i x = _mm_loadu_si128(out);
+        _mm_storeu_si128(out, kAdd ? _mm_add_epi16(x, sum) : _mm_sub_epi16(x, sum));
+    }
+#endif // DEPTH_ENABLE_SSE2
+
+    for (; i < count; ++i) {
+        const int sum = (a[i] + b[i] + kRound) >> kShift;
+        dest[i] = static_cast<int16_t>( kAdd ? dest[i] + sum : dest[i] - sum );
+    }
+}
+
+static inline void ForwardPredict(int16_t* d, const int16_t* a, const int16_t* b, int count)
+{
+    Lift<false, 1, 0>(d, a, b, count);
+}
+
+static inline void ForwardUpdate(int16_t* s, const int16_t* a, const int16_t* b, int count)
+{
+    Lift<true, 2, 2>(s, a, b, count);
+}
+
+static inline void InversePredict(int16_t* d, const int16_t* a, const int16_t* b, int count)
+{
+    Lift<true, 1, 0>(d, a, b, count);
+}
+
+static inline void InverseUpdate(int16_t* s, const int16_t* a, const int16_t* b, int count)
+{
+    Lift<false, 2, 2>(s, a, b, count);
+}
+
+
+//------------------------------------------------------------------------------
+// Transform
+
+/*
+    Lines of n samples are split into ns = (n + 1) / 2 low-pass samples
+    followed by nd = n / 2 high-pass samples.  The edges use symmetric
+    extension like JPEG 2000, which is done by padding the temporary
+    halves (or by aliasing row pointers for the vertical direction).
+*/
+
+// Temporary samples needed for a line of n samples
+static int LineTempCount(int n)
+{
+    return n + 4;
+}
+
+static void ForwardLine(int16_t* line, int n, int16_t* temp)
+{
+    if (n < 2) {
+        return;
+    }
+    const int ns = (n + 1) / 2, nd = n / 2;
+    int16_t* s = temp;
+    int16_t* d = temp + ns + 2; // d[-1] and d[nd] are padding
+
+    for (int i = 0; i < nd; ++i) {
+        s[i] = line[i * 2];
+        d[i] = line[i * 2 + 1];
+    }
+    if (ns > nd) {
+        s[nd] = line[n - 1];
+    }
+
+    s[ns] = s[ns - 1];
+    ForwardPredict(d, s, s + 1, nd);
+    d[-1] = d[0];
+    d[nd] = d[nd - 1];
+    ForwardUpdate(s, d - 1, d, ns);
+
+    for (int i = 0; i < ns; ++i) {
+        line[i] = s[i];
+    }
+    for (int i = 0; i < nd; ++i) {
+        line[ns + i] = d[i];
+    }
+}
+
+static void InverseLine(int16_t* line, int n, int16_t* temp)
+{
+    if (n < 2) {
+        return;
+    }
+    const int ns = (n + 1) / 2, nd = n / 2;
+    int16_t* s = temp;
+    int16_t* d = temp + ns + 2;
+
+    for (int i = 0; i < ns; ++i) {
+        s[i] = line[i];
+    }
+    for (int i = 0; i < nd; ++i) {
+        d[i] = line[ns + i];
+    }
+
+    d[-1] = d[0];
+    d[nd] = d[nd - 1];
+    InverseUpdate(s, d - 1, d, ns);
+    s[ns] = s[ns - 1];
+    InversePredict(d, s, s + 1, nd);
+
+    for (int i = 0; i < nd; ++i) {
+        line[i * 2] = s[i];
+        line[i * 2 + 1] = d[i];
+    }
+    if (ns > nd) {
+        line[n - 1] = s[nd];
+    }
+}
+
+// Move even rows to the top and odd rows to the bottom, or back again
+static void ShuffleRows(
+    int16_t* plane,
+    int stride,
+    int width,
+    int n,
+    bool deinterleave,
+    int16_t* temp)
+{
+    const int ns = (n + 1) / 2;
+    for (int y = 0; y < n; ++y) {
+        const int to = (y % 2 == 0) ? y / 2 : ns + y / 2;
+        const int16_t* src = plane + (deinterleave ? y : to) * stride;
+        int16_t* dest = temp + (deinterleave ? to : y) * width;
+        for (int x = 0; x < width; ++x) {
+            dest[x] = src[x];
+        }
+    }
+    for (int y = 0; y < n; ++y) {
+        const int16_t* src = temp + y * width;
+        int16_t* dest = plane + y * stride;
+        for (int x = 0; x < width; ++x) {
+            dest[x] = src[x];
+        }
+    }
+}
+
+static void ForwardColumns(
+    int16_t* plane,
+    int stride,
+    int width,
+    int n,
+    int16_t* temp)
+{
+    if (n < 2) {
+        return;
+    }
+    const int ns = (n + 1) / 2, nd = n / 2;
+    auto row = [plane, stride](int y) {
+        return plane + y * stride;
+    };
+
+    for (int i = 0; i < nd; ++i) {
+        const int next = (i * 2 + 2 < n) ? i * 2 + 2 : i * 2;
+        ForwardPredict(row(i * 2 + 1), row(i * 2), row(next), width);
+    }
+    for (int i = 0; i < ns; ++i) {
+        const int prev = (i > 0) ? i * 2 - 1 : 1;
+        const int next = (i * 2 + 1 < n) ? i * 2 + 1 : i * 2 - 1;
+        ForwardUpdate(row(i * 2), row(prev), row(next), width);
+    }
+
+    ShuffleRows(plane, stride, width, n, true, temp);
+}
+
+static void InverseColumns(
+    int16_t* plane,
+    int stride,
+    int width,
+    int n,
+    int16_t* temp)
+{
+    if (n < 2) {
+        return;
+    }
+    const int ns = (n + 1) / 2, nd = n / 2;
+    auto row = [plane, stride](int y) {
+        return plane + y * stride;
+    };
+
+    ShuffleRows(plane, stride, width, n, false, temp);
+
+    for (int i = 0; i < ns; ++i) {
+        const int prev = (i > 0) ? i * 2 - 1 : 1;
+        const int next = (i * 2 + 1 < n) ? i * 2 + 1 : i * 2 - 1;
+        InverseUpdate(row(i * 2), row(prev), row(next), width);
+    }
+    for (int i = 0; i < nd; ++i) {
+        const int next = (i * 2 + 2 < n) ? i * 2 + 2 : i * 2;
+        InversePredict(row(i * 2 + 1), row(i * 2), row(next), width);
+    }
+}
+
+static void ForwardTransform(
+    int16_t* plane,
+    int width,
+    int height,
+    int levels,
+    std::vector<int16_t>& temp)
+{
+    temp.resize(static_cast<size_t>( width ) * height + LineTempCount(width));
+
+    int w = width, h = height;
+    for (int level = 0; level < levels; ++level) {
+        for (int y = 0; y < h; ++y) {
+            ForwardLine(plane + y * width, w, temp.data());
+        }
+        ForwardColumns(plane, width, w, h, temp.data());
+        w = (w + 1) / 2;
+        h = (h + 1) / 2;
+    }
+}
+
+static void InverseTransform(
+    int16_t* plane,
+    int width,
+    int height,
+    int levels,
+    std::vector<int16_t>& temp)
+{
+    temp.resize(static_cast<size_t>( width ) * height + LineTempCount(width));
+
+    int w[kWaveletMaxLevels + 1], h[kWaveletMaxLevels + 1];
+    w[0] = width;
+    h[0] = height;
+    for (int level = 0; level < levels; ++level) {
+        w[level + 1] = (w[level] + 1) / 2;
+        h[level + 1] = (h[level] + 1) / 2;
+    }
+
+    for (int level = levels - 1; level >= 0; --level) {
+        InverseColumns(plane, width, w[level], h[level], temp.data());
+        for (int y = 0; y < h[level]; ++y) {
+            InverseLine(plane + y * width, w[level], temp.data());
+        }
+    }
+}
+
+static int ChooseLevels(int width, int height)
+{
+    int levels = 0;
+    while (levels < kWaveletMaxLevels &&
+           width >= kMinLowBandSize * 2 &&
+           height >= kMinLowBandSize * 2)
+    {
+        width = (width + 1) / 2;
+        height = (height + 1) / 2;
+        ++levels;
+    }
+    return levels;
+}
+
+
+//------------------------------------------------------------------------------
+// Subbands
+
+namespace {
+
+struct WaveletBand
+{
+    // Position in the transformed image
+    int X = 0, Y = 0;
+    int Width = 0, Height = 0;
+
+    // Quadtree level that covers the whole band with one set
+    int TopLevel = 0;
+
+    // Encoder: Maximum magnitude pyramid for quadtree levels >= 1
+    int PyramidOffset[kMaxQuadtreeLevels];
+    int PyramidWidth[kMaxQuadtreeLevels];
+
+
+    // Returns true if the set at the given quadtree level covers any samples
+    bool Contains(int level, int x, int y) const
+    {
+        return (x << level) < Width && (y << level) < Height;
+    }
+};
+
+// Quadtree set (or single coefficient at level 0) within a band
+struct WaveletSet
+{
+    uint8_t Band;
+    uint16_t X, Y;
+};
+
+} // namespace
+
+// Lay out the subbands in coding order: Low band, then high bands from the
+// coarsest to the finest level.  Empty bands are skipped.
+static int ComputeBands(
+    int width,
+    int height,
+    int levels,
+    WaveletBand* bands)
+{
+    int w[kWaveletMaxLevels + 1], h[kWaveletMaxLevels + 1];
+    w[0] = width;
+    h[0] = height;
+    for (int level = 0; level < levels; ++level) {
+        w[level + 1] = (w[level] + 1) / 2;
+        h[level + 1] = (h[level] + 1) / 2;
+    }
+
+    int count = 0;
+    auto add = [&](int x, int y, int bw, int bh) {
+        if (bw <= 0 || bh <= 0) {
+            return;
+        }
+        WaveletBand& band = bands[count++];
+        band.X = x;
+        band.Y = y;
+        band.Width = bw;
+        band.Height = bh;
+        band.TopLevel = 0;
+        while ((1 << band.TopLevel) < bw || (1 << band.TopLevel) < bh) {
+            ++band.TopLevel;
+        }
+    };
+
+    add(0, 0, w[levels], h[levels]);
+    for (int level = levels - 1; level >= 0; --level) {
+        const int sw = w[level + 1], sh = h[level + 1];
+        const int dw = w[level] - sw, dh = h[level] - sh;
+        add(sw, 0, dw, sh);
+        add(0, sh, sw, dh);
+        add(sw, sh, dw, dh);
+    }
+    return count;
+}
+
+
+//------------------------------------------------------------------------------
+// WaveletEncoder
+
+namespace {
+
+class WaveletEncoder
+{
+public:
+    BitWriter Bits;
+
+    // Stop coding once more than this many bytes are written, so that the
+    // bytes up to the limit are all real bits rather than padding
+    int ByteLimit = 0;
+
+
+    // Returns the number of bitplanes
+    int Initialize(const int16_t* coeffs, int width, int height, int levels);
+
+    void EncodePlanes(int planes);
+
+protected:
+    int Width = 0;
+    int BandCount = 0;
+    WaveletBand Bands[kMaxBands];
+
+    // Coefficient magnitudes and signs
+    std::vector<uint16_t> Magnitude;
+    std::vector<uint8_t> Negative;
+
+    // Maximum magnitude of each quadtree set
+    std::vector<uint16_t> Pyramid;
+
+    // Sets that were insignificant, for each quadtree level.
+    // Level 0 holds single coefficients.
+    std::vector<WaveletSet> Sets[kMaxQuadtreeLevels];
+
+    // Indices of significant coefficients
+    std::vector<int> Significant;
+
+
+    int Index(const WaveletSet& set) const
+    {
+        const WaveletBand& band = Bands[set.Band];
+        return (band.Y + set.Y) * Width + band.X + set.X;
+    }
+
+    unsigned SetMaximum(const WaveletSet& set, int level) const
+    {
+        if (level == 0) {
+            return Magnitude[Index(set)];
+        }
+        const WaveletBand& band = Bands[set.Band];
+        return Pyramid[band.PyramidOffset[level] + set.Y * band.PyramidWidth[level] + set.X];
+    }
+
+    bool Full() const
+    {
+        return Bits.BytesWritten() > ByteLimit;
+    }
+
+    // Code a set or coefficient that is known to be significant
+    void CodeSignificant(const WaveletSet& set, int level);
+
+    // Split a significant set into its four quadrants
+    void SplitSet(const WaveletSet& set, int level, unsigned threshold);
+};
+
+int WaveletEncoder::Initialize(const int16_t* coeffs, int width, int height, int levels)
+{
+    Width = width;
+    BandCount = ComputeBands(width, height, levels, Bands);
+
+    const int n = width * height;
+    Magnitude.resize(n);
+    Negative.resize(n);
+    unsigned max_magnitude = 0;
+    for (int i = 0; i < n; ++i) {
+        const int x = coeffs[i];
+        const unsigned magnitude = static_cast<unsigned>( abs(x) );
+        Magnitude[i] = static_cast<uint16_t>( magnitude );
+        Negative[i] = x < 0 ? 1 : 0;
+        if (max_magnitude < magnitude) {
+            max_magnitude = magnitude;
+        }
+    }
+
+    // Lay out the pyramid for each band
+    int pyramid_size = 0;
+    for (int b = 0; b < BandCount; ++b) {
+        WaveletBand& band = Bands[b];
+        for (int level = 1; level <= band.TopLevel; ++level) {
+            const int pw = (band.Width + (1 << level) - 1) >> level;
+            const int ph = (band.Height + (1 << level) - 1) >> level;
+            band.PyramidOffset[level] = pyramid_size;
+            band.PyramidWidth[level] = pw;
+            pyramid_size += pw * ph;
+        }
+    }
+    Pyramid.resize(pyramid_size);
+
+    // Each quadtree level is the maximum of 2x2 sets from the level below
+    for (int b = 0; b < BandCount; ++b) {
+        const WaveletBand& band = Bands[b];
+        for (int level = 1; level <= band.TopLevel; ++level) {
+            const int pw = band.PyramidWidth[level];
+            const int ph = (band.Height + (1 << level) - 1) >> level;
+            uint16_t* dest = Pyramid.data() + band.PyramidOffset[level];
+
+            for (int y = 0; y < ph; ++y) {
+                for (int x = 0; x < pw; ++x) {
+                    unsigned m = 0;
+                    for (int j = 0; j < 4; ++j) {
+                        const int cx = x * 2 + (j & 1), cy = y * 2 + (j >> 1);
+                        if (!band.Contains(level - 1, cx, cy)) {
+                            continue;
+                        }
+                        WaveletSet child;
+                        child.Band = static_cast<uint8_t>( b );
+                        child.X = static_cast<uint16_t>( cx );
+                        child.Y = static_cast<uint16_t>( cy );
+                        const unsigned cm = SetMaximum(child, level - 1);
+                        if (m < cm) {
+                            m = cm;
+                        }
+                    }
+                    dest[y * pw + x] = static_cast<uint16_t>( m );
+                }
+            }
+        }
+    }
+
+    for (int level = 0; level < kMaxQuadtreeLevels; ++level) {
+        Sets[level].clear();
+    }
+    for (int b = 0; b < BandCount; ++b) {
+        WaveletSet root;
+        root.Band = static_cast<uint8_t>( b );
+        root.X = 0;
+        root.Y = 0;
+        Sets[Bands[b].TopLevel].push_back(root);
+    }
+    Significant.clear();
+
+    int planes = 0;
+    while (max_magnitude >= (1u << planes)) {
+        ++planes;
+    }
+    return planes;
+}
+
+void WaveletEncoder::CodeSignificant(const WaveletSet& set, int level)
+{
+    if (level == 0) {
+        const int i = Index(set);
+        Bits.Write(Negative[i], 1);
+        Significant.push_back(i);
+    }
+}
+
+void WaveletEncoder::SplitSet(const WaveletSet& set, int level, unsigned threshold)
+{
+    const WaveletBand& band = Bands[set.Band];
+    const int child_level = level - 1;
+
+    WaveletSet children[4];
+    int count = 0;
+    for (int j = 0; j < 4; ++j) {
+        const int cx = set.X * 2 + (j & 1), cy = set.Y * 2 + (j >> 1);
+        if (band.Contains(child_level, cx, cy)) {
+            children[count].Band = set.Band;
+            children[count].X = static_cast<uint16_t>( cx );
+            children[count].Y = static_cast<uint16_t>( cy );
+            ++count;
+        }
+    }
+
+    bool any_significant = false;
+    for (int j = 0; j < count; ++j) {
+        const WaveletSet& child = children[j];
+        const bool significant = SetMaximum(child, child_level) >= threshold;
+
+        // The last child must be significant if none of the others were
+        if (j < count - 1 || any_significant) {
+            Bits.Write(significant ? 1 : 0, 1);
+        }
+
+        if (!significant) {
+            Sets[child_level].push_back(child);
+            continue;
+        }
+        any_significant = true;
+
+        if (child_level == 0) {
+            CodeSignificant(child, 0);
+        } else {
+            SplitSet(child, child_level, threshold);
+        }
+    }
+}
+
+void WaveletEncoder::EncodePlanes(int planes)
+{
+    for (int plane = planes - 1; plane >= 0; --plane)
+    {
+        const unsigned threshold = 1u << plane;
+        const size_t refine_count = Significant.size();
+
+        // Sorting pass: Smallest sets first
+        for (int level = 0; level < kMaxQuadtreeLevels; ++level)
+        {
+            std::vector<WaveletSet>& sets = Sets[level];
+            const size_t count = sets.size();
+            size_t kept = 0;
+
+            for (size_t i = 0; i < count; ++i)
+            {
+                if (Full()) {
+                    return;
+                }
+                const WaveletSet set = sets[i];
+                const bool significant = SetMaximum(set, level) >= threshold;
+                Bits.Write(significant ? 1 : 0, 1);
+
+                if (!significant) {
+                    sets[kept++] = set;
+                } else if (level == 0) {
+                    CodeSignificant(set, 0);
+                } else {
+                    SplitSet(set, level, threshold);
+                }
+            }
+
+            // Splitting only adds sets to lower levels, which are done
+            sets.resize(kept);
+        }
+
+        // Refinement pass: Coefficients that were significant before this plane
+        for (size_t i = 0; i < refine_count; ++i)
+        {
+            if (Full()) {
+                return;
+            }
+            Bits.Write((Magnitude[Significant[i]] >> plane) & 1, 1);
+        }
+    }
+}
+
+} // namespace
+
+
+//------------------------------------------------------------------------------
+// WaveletDecoder
+
+namespace {
+
+class WaveletDecoder
+{
+public:
+    BitReader Bits;
+
+
+    void Initialize(int width, int height, int levels);
+
+    void DecodePlanes(int planes);
+
+    // Reconstruct coefficients from the bits that were received
+    void Reconstruct(int16_t* coeffs) const;
+
+protected:
+    int Width = 0;
+    int BandCount = 0;
+    WaveletBand Bands[kMaxBands];
+
+    // Bits of the magnitude received so far
+    std::vector<uint16_t> Magnitude;
+    std::vector<uint8_t> Negative;
+
+    // Lowest plane received for each significant coefficient
+    std::vector<uint8_t> LowestPlane;
+
+    std::vector<WaveletSet> Sets[kMaxQuadtreeLevels];
+    std::vector<int> Significant;
+
+    // Set once the stream runs out
+    bool Stopped = false;
+
+
+    int Index(const WaveletSet& set) const
+    {
+        const WaveletBand& band = Bands[set.Band];
+        return (band.Y + set.Y) * Width + band.X + set.X;
+    }
+
+    // Returns false and stops decoding if the stream ran out
+    bool ReadBit(unsigned& bit)
+    {
+        if (Bits.BitsRemaining() <= 0) {
+            Stopped = true;
+            return false;
+        }
+        bit = Bits.Read(1);
+        return true;
+    }
+
+    // Returns false if the stream ran out before the sign bit
+    bool DecodeSignificant(const WaveletSet& set, int plane);
+
+    void SplitSet(const WaveletSet& set, int level, int plane);
+};
+
+void WaveletDecoder::Initialize(int width, int height, int levels)
+{
+    Width = width;
+    BandCount = ComputeBands(width, height, levels, Bands);
+
+    const int n = width * height;
+    Magnitude.assign(n, 0);
+    Negative.assign(n, 0);
+    LowestPlane.assign(n, 0);
+
+    for (int level = 0; level < kMaxQuadtreeLevels; ++level) {
+        Sets[level].clear();
+    }
+    for (int b = 0; b < BandCount; ++b) {
+        WaveletSet root;
+        root.Band = static_cast<uint8_t>( b );
+        root.X = 0;
+        root.Y = 0;
+        Sets[Bands[b].TopLevel].push_back(root);
+    }
+    Significant.clear();
+    Stopped = false;
+}
+
+bool WaveletDecoder::DecodeSignificant(const WaveletSet& set, int plane)
+{
+    unsigned negative;
+    if (!ReadBit(negative)) {
+        return false;
+    }
+    const int i = Index(set);
+    Magnitude[i] = static_cast<uint16_t>( 1u << plane );
+    Negative[i] = static_cast<uint8_t>( negative );
+    LowestPlane[i] = static_cast<uint8_t>( plane );
+    Significant.push_back(i);
+    return true;
+}
+
+void WaveletDecoder::SplitSet(const WaveletSet& set, int level, int plane)
+{
+    const WaveletBand& band = Bands[set.Band];
+    const int child_level = level - 1;
+
+    WaveletSet children[4];
+    int count = 0;
+    for (int j = 0; j < 4; ++j) {
+        const int cx = set.X * 2 + (j & 1), cy = set.Y * 2 + (j >> 1);
+        if (band.Contains(child_level, cx, cy)) {
+            children[count].Band = set.Band;
+            children[count].X = static_cast<uint16_t>( cx );
+            children[count].Y = static_cast<uint16_t>( cy );
+            ++count;
+        }
+    }
+
+    bool any_significant = false;
+    for (int j = 0; j < count; ++j) {
+        const WaveletSet& child = children[j];
+
+        unsigned significant = 1;
+        if (j < count - 1 || any_significant) {
+            if (!ReadBit(significant)) {
+                return;
+            }
+        }
+
+        if (!significant) {
+            Sets[child_level].push_back(child);
+            continue;
+        }
+        any_significant = true;
+
+        if (child_level == 0) {
+            if (!DecodeSignificant(child, plane)) {
+                return;
+            }
+        } else {
+            SplitSet(child, child_level, plane);
+            if (Stopped) {
+                return;
+            }
+        }
+    }
+}
+
+void WaveletDecoder::DecodePlanes(int planes)
+{
+    for (int plane = planes - 1; plane >= 0; --plane)
+    {
+        const size_t refine_count = Significant.size();
+
+        for (int level = 0; level < kMaxQuadtreeLevels; ++level)
+        {
+            std::vector<WaveletSet>& sets = Sets[level];
+            const size_t count = sets.size();
+            size_t kept = 0;
+
+            for (size_t i = 0; i < count; ++i)
+            {
+                const WaveletSet set = sets[i];
+                unsigned significant;
+                if (!ReadBit(significant)) {
+                    return;
+                }
+
+                if (!significant) {
+                    sets[kept++] = set;
+                } else if (level == 0) {
+                    if (!DecodeSignificant(set, plane)) {
+                        return;
+                    }
+                } else {
+                    SplitSet(set, level, plane);
+                    if (Stopped) {
+                        return;
+                    }
+                }
+            }
+
+            sets.resize(kept);
+        }
+
+        for (size_t i = 0; i < refine_count; ++i)
+        {
+            unsigned bit;
+            if (!ReadBit(bit)) {
+                return;
+            }
+            const int index = Significant[i];
+            Magnitude[index] = static_cast<uint16_t>( Magnitude[index] | (bit << plane) );
+            LowestPlane[index] = static_cast<uint8_t>( plane );
+        }
+    }
+}
+
+void WaveletDecoder::Reconstruct(int16_t* coeffs) const
+{
+    const int n = static_cast<int>( Magnitude.size() );
+    for (int i = 0; i < n; ++i)
+    {
+        int x = Magnitude[i];
+        if (x == 0) {
+            coeffs[i] = 0;
+            continue;
+        }
+
+        // Place the value in the middle of the range that is still unknown
+        const int plane = LowestPlane[i];
+        if (plane > 0) {
+            x += 1 << (plane - 1);
+        }
+        if (x > 32767) {
+            x = 32767;
+        }
+        coeffs[i] = static_cast<int16_t>( Negative[i] ? -x : x );
+    }
+}
+
+} // namespace
+
+
+//------------------------------------------------------------------------------
+// API
+
+static size_t GetMaxOutputBytes(int n, int planes)
+{
+    // Each coefficient takes at most a significance bit and a refinement bit
+    // per plane plus a sign bit.  There are fewer sets than coefficients and
+    // each set is tested at most once per plane, plus once when it is split.
+    const size_t max_bits = static_cast<size_t>( n ) * (3 * planes + 2) +
+        static_cast<size_t>( kMaxBands ) * kMaxQuadtreeLevels * (planes + 1);
+    return kWaveletHeaderBytes + max_bits / 8 + 16;
+}
+
+size_t WaveletCompressBound(int width, int height)
+{
+    // Coefficients are 16-bit so there are at most 16 planes
+    return GetMaxOutputBytes(width * height, 16);
+}
+
+void WaveletCompress(
+    const uint8_t* image,
+    int width,
+    int height,
+    int max_bytes,
+    std::vector<uint8_t>& compressed)
+{
+    const int n = width * height;
+    const int levels = ChooseLevels(width, height);
+
+    std::vector<int16_t> coeffs(n), temp;
+    for (int i = 0; i < n; ++i) {
+        coeffs[i] = static_cast<int16_t>( image[i] - 128 );
+    }
+    ForwardTransform(coeffs.data(), width, height, levels, temp);
+
+    WaveletEncoder encoder;
+    const int planes = encoder.Initialize(coeffs.data(), width, height, levels);
+
+    const size_t max_output = GetMaxOutputBytes(n, planes);
+
+    // The limit is only checked between sets, so the encoder may write more
+    // than max_bytes.  The extra bytes are cut off below.
+    encoder.ByteLimit = static_cast<int>( max_output );
+    if (max_bytes > 0 && max_bytes - kWaveletHeaderBytes < encoder.ByteLimit) {
+        encoder.ByteLimit = max_bytes - kWaveletHeaderBytes;
+    }
+
+    compressed.resize(max_output);
+    compressed[0] = static_cast<uint8_t>( levels );
+    compressed[1] = static_cast<uint8_t>( planes );
+
+    encoder.Bits.Reset(compressed.data() + kWaveletHeaderBytes);
+    encoder.EncodePlanes(planes);
+
+    size_t bytes = kWaveletHeaderBytes + encoder.Bits.Flush();
+    if (max_bytes > 0 && bytes > static_cast<size_t>( max_bytes )) {
+        bytes = max_bytes < kWaveletHeaderBytes ? kWaveletHeaderBytes : max_bytes;
+    }
+    compressed.resize(bytes);
+}
+
+bool WaveletDecompress(
+    const uint8_t* data,
+    int bytes,
+    int width,
+    int height,
+    std::vector<uint8_t>& image)
+{
+    if (bytes < kWaveletHeaderBytes || width < 1 || height < 1) {
+        return false;
+    }
+    const int levels = data[0];
+    const int planes = data[1];
+    if (levels > kWaveletMaxLevels || planes > kMaxPlanes) {
+        return false;
+    }
+
+    const int n = width * height;
+    std::vector<int16_t> coeffs(n), temp;
+
+    WaveletDecoder decoder;
+    decoder.Initialize(width, height, levels);
+    decoder.Bits.Reset(data + kWaveletHeaderBytes, bytes - kWaveletHeaderBytes);
+    decoder.DecodePlanes(planes);
+    decoder.Reconstruct(coeffs.data());
+
+    InverseTransform(coeffs.data(), width, height, levels, temp);
+
+    image.resize(n);
+    for (int i = 0; i < n; ++i) {
+        int x = coeffs[i] + 128;
+        if (x < 0) {
+            x = 0;
+        } else if (x > 255) {
+            x = 255;
+        }
+        image[i] = static_cast<uint8_t>( x );
+    }
+    return true;
+}
+
+
+} // namespace zdepth
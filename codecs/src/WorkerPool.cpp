@@ -0,0 +1,168 @@
+// Copyright 2019 (c) Christopher A. Taylor.  All rights reserved.
+
+#include "WorkerPool.hpp"
+
+#include <memory>
+
+namespace zdepth {
+
+
+//------------------------------------------------------------------------------
+// WorkerPool
+
+WorkerPool& WorkerPool::Shared()
+{
+    // The calling thread participates in ParallelFor() so leave one core for it
+    static WorkerPool pool(static_cast<int>( std::thread::hardware_concurrency() ) - 1);
+    return pool;
+}
+
+WorkerPool::WorkerPool(int thread_count)
+{
+    if (thread_count < 1) {
+        thread_count = 1;
+    }
+    Threads.reserve(thread_count);
+    for (int i = 0; i < thread_count; ++i) {
+        Threads.emplace_back(&WorkerPool::WorkerLoop, this);
+    }
+}
+
+WorkerPool::~WorkerPool()
+{
+    {
+        std::lock_guard<std::mutex> locker(QueueLock);
+        Terminated = true;
+    }
+    QueueCondition.notify_all();
+
+    for (auto& thread : Threads) {
+        thread.join();
+    }
+}
+
+void WorkerPool::Submit(std::function<void()> task)
+{
+    {
+        std::lock_guard<std::mutex> locker(QueueLock);
+        Queue.push_back(std::move(task));
+    }
+    QueueCondition.notify_one();
+}
+
+void WorkerPool::SubmitBackground(std::function<void()> task)
+{
+    {
+        std::lock_guard<std::mutex> locker(QueueLock);
+        BackgroundQueue.push_back(std::move(task));
+    }
+    QueueCondition.notify_one();
+}
+
+int WorkerPool::IdleThreadCount()
+{
+    std::lock_guard<std::mutex> locker(QueueLock);
+    const int queued = static_cast<int>( Queue.size() + BackgroundQueue.size() );
+    return IdleThreads > queued ? IdleThreads - queued : 0;
+}
+
+void WorkerPool::WorkerLoop()
+{
+    for (;;)
+    {
+        std::function<void()> task;
+        {
+            std::unique_lock<std::mutex> locker(QueueLock);
+            ++IdleThreads;
+            QueueCondition.wait(locker, [this]() {
+                return Terminated || !Queue.empty() || !BackgroundQueue.empty();
+            });
+            --IdleThreads;
+            if (!Queue.empty()) {
+                task = std::move(Queue.front());
+                Queue.pop_front();
+            } else if (!Terminated) {
+                task = std::move(BackgroundQueue.front());
+                BackgroundQueue.pop_front();
+            } else {
+                return; // Background tasks are dropped
+            }
+        }
+        task();
+    }
+}
+
+namespace {
+
+// State shared between the caller of ParallelFor() and its helper tasks.
+// Helpers may start after the loop is finished, so it is reference counted.
+struct ParallelForState
+{
+    const std::function<void(int)>* Fn = nullptr;
+    int Count = 0;
+    std::atomic<int> Next = ATOMIC_VAR_INIT(0);
+
+    std::mutex DoneLock;
+    std::condition_variable DoneCondition;
+    int Done = 0;
+
+
+    // Claim and run indices until none are left
+    void Run()
+    {
+        int completed = 0;
+        for (;;) {
+            const int i = Next.fetch_add(1);
+            if (i >= Count) {
+                break;
+            }
+            (*Fn)(i);
+            ++completed;
+        }
+        if (completed > 0) {
+            std::lock_guard<std::mutex> locker(DoneLock);
+            Done += completed;
+            if (Done >= Count) {
+                DoneCondition.notify_all();
+            }
+        }
+    }
+};
+
+} // namespace
+
+void WorkerPool::ParallelFor(int count, const std::function<void(int)>& fn)
+{
+    if (count <= 0) {
+        return;
+    }
+    if (count == 1) {
+        fn(0);
+        return;
+    }
+
+    auto state = std::make_shared<ParallelForState>();
+    state->Fn = &fn;
+    state->Count = count;
+
+    int helpers = count - 1;
+    if (helpers > ThreadCount()) {
+        helpers = ThreadCount();
+    }
+    for (int i = 0; i < helpers; ++i) {
+        Submit([state]() {
+            state->Run();
+        });
+    }
+
+    state->Run();
+
+    // Wait for indices claimed by helpers to finish
+    std::unique_lock<std::mutex> locker(state->DoneLock);
+    state->DoneCondition.wait(locker, [&state]() {
+        return state->Done >= state->Count;
+    });
+}
+
+
+} // namespace zdepth
@@ -11,18 +11,19 @@
     Hardware acceleration for H.264/HEVC video compression is leveraged when
     possible to reduce CPU usage during encoding and decoding.
 
-    Currently requires Windows, an NVidia graphics card, and CUDA v10.1.
+    H.264/HEVC requires an NVidia graphics card and CUDA v10.1.  Without them
+    the Low bits are compressed with a CPU codec instead (see VideoCodec.hpp).
 */
 
 /*
     To compress depth data use:
 
-        DepthCompressor x;
+        DepthEncoder x;
         x.Compress(...);
 
     To decompress depth data use:
 
-        DepthCompressor y;
+        DepthDecoder y;
         y.Decompress(...);
 
     Application notes:
@@ -68,7 +69,9 @@
 
     High 3-bit compression with Zstd:
 
-        (1) Combine 4-bit nibbles together into bytes.
+        (1) Combine 4-bit nibbles together into bytes, with the first pixel
+            of each pair in the low nibble.  The last byte of an image
+            with an odd number of pixels holds only one pixel.
         (2) Encode with Zstd.
 
     Low 8-bit compression with H.264:
@@ -107,6 +110,7 @@
 #pragma once
 
 #include <stdint.h>
+#include <memory>
 #include <vector>
 
 // Compiler-specific force inline keyword
@@ -137,11 +141,23 @@ enum DepthFlags
 {
     DepthFlags_Keyframe = 1,    // Frame is an IDR
     DepthFlags_HEVC = 2,        // Use HEVC instead of H.264
+    DepthFlags_Tiled = 4,       // High bits are split into row tiles
+    DepthFlags_LowCodec = 8,    // LowCodec field selects the Low bits codec
+    DepthFlags_Replenish = 16,  // Only changed blocks are sent (see below)
+    DepthFlags_Residual = 32,   // Low bits corrections follow the Low bits
+    DepthFlags_WholeValue = 64, // Depth is not split into High and Low bits
+    DepthFlags_Lossless = 128,  // Quantized depth is coded without loss
 };
 
 // Number of bytes in header
 static const int kDepthHeaderBytes = 26;
 
+// Largest number of residual enhancement layers
+static const int kMaxDepthLayers = 8;
+
+// Number of bytes in tile header, not including the tile size table
+static const int kDepthTileHeaderBytes = 4;
+
 /*
     File format:
 
@@ -152,6 +168,78 @@ static const int kDepthHeaderBytes = 26;
     The P-frames are able to use predictors that reference the previous frame.
     The decoder keeps track of the previously decoded Frame Number and rejects
     frames that cannot be decoded due to a missing previous frame.
+
+    When DepthFlags_Tiled is set, the High section starts with a
+    DepthTileHeader followed by TileCount 32-bit compressed tile sizes.
+    The tiles follow in order.  Each tile is an independent Zstd frame holding
+    the packed high bits for TileRows rows of the image (the last tile may be
+    shorter).  HighCompressedBytes covers the tile table and all the tiles.
+
+    On P-frames a High plane that is identical to the previous frame may be
+    skipped: HighCompressedBytes = 0 repeats the whole previous High plane,
+    and a tile size of 0 repeats that tile from the previous frame.
+    These frames can only be decoded if the previous frame was decoded.
+
+    When DepthFlags_LowCodec is set, the LowCodec byte holds the VideoType
+    used for the Low bits and DepthFlags_HEVC is ignored by the decoder.
+    Older files without this flag use H.264, or HEVC if DepthFlags_HEVC is set.
+
+    When DepthFlags_Replenish is set, the frame updates the previous decoded
+    frame instead of holding High and Low sections.  The data that follows
+    the header is one Zstd frame of HighCompressedBytes bytes that unpacks to
+    HighUncompressedBytes bytes:
+
+        Skip map: One bit per 8x8 block in raster order, LSB first,
+            1 = block changed, 0 = block repeats the previous frame.
+        Changed pixels: For each changed block in raster order, the
+            quantized depth of its pixels in raster order (blocks on the
+            right and bottom edges are cut to the image size).  Each value
+            is stored as the difference from the pixel to its left, or from
+            the pixel above for the first column, or from the last pixel of
+            the previous row sent for the first pixel of each block (0 for
+            the first block), mapped to unsigned by zig-zag.  The low bytes
+            of all the values come first, then the high bytes.
+
+    MinimumDepth, MaximumDepth and LowCompressedBytes are 0.
+    These frames can only be decoded if the previous frame was decoded.
+
+    When DepthFlags_Residual is set, a residual section follows the Low bits
+    to the end of the file, holding corrections for Low bytes that the video
+    codec got too wrong.  It is a uint32_t of uncompressed bytes followed by
+    one Zstd frame that unpacks to a list of corrections in pixel order.
+    Each correction is two LEB128 varints: The number of pixels skipped
+    since the last correction, and the zig-zag mapped value to add to the
+    decoded Low byte.
+
+    If ResidualLayers is not 0, the residual corrections are split into that
+    many enhancement layers instead, from coarse to fine.  Each layer is a
+    uint32_t of layer bytes followed by a residual section as above, or
+    nothing if the layer bytes are 0.  The layers correct different pixels
+    so any number of them can be applied in order, and dropping layers from
+    the end gives a valid frame with a larger error (see DropDepthLayers).
+    Without layers ResidualLayers is 0.
+
+    When DepthFlags_WholeValue is set, the depth is not split into High and
+    Low bits.  The High section is one Zstd frame holding a bitmask with one
+    bit per pixel in raster order, LSB first, where 1 = no depth.  It is left
+    out (both High sizes are 0) if every pixel has depth.  The Low section is
+    the quantized and rescaled depth as one LOCO-I image with MaxValue 2047
+    (see LocoCodec.hpp).  Pixels without depth decode to 0 whatever their
+    value, and other pixels that decode to 0 become 1.  LowCodec is
+    VideoType::Loco.
+
+    When DepthFlags_Lossless is set, the quantized depth (before rescaling)
+    is coded exactly and no video decoder is needed.  The High section is one
+    Zstd frame, LowCompressedBytes, LowCodec, MinimumDepth and MaximumDepth
+    are 0.  It unpacks to LEB128 varint run lengths covering every pixel in
+    raster order, alternating between runs of pixels without depth and runs
+    of pixels with depth, starting with a (possibly empty) run without depth.
+    Then for each pixel with depth there is the zig-zag mapped difference
+    from a prediction: First the low bytes of all differences, then the high
+    bytes.  The prediction is the LOCO-I median of the left, upper and
+    upper-left pixels if all three have depth; or the average of left and
+    upper if both have depth; else whichever of them has depth; else the
+    previous pixel with depth in raster order, or 0 for the first.
 */
 
 #pragma pack(push)
@@ -169,11 +257,18 @@ struct DepthHeader
     /* 12 */ uint32_t HighUncompressedBytes;
     /* 16 */ uint32_t HighCompressedBytes;
     /* 20 */ uint32_t LowCompressedBytes;
-    /* 24 */ uint8_t LowMinimum;
-    /* 25 */ uint8_t LowMaximum;
+    /* 24 */ uint8_t LowCodec;
+    /* 25 */ uint8_t ResidualLayers;
     // Compressed data follows: High bits, then low bits.
 };
 
+struct DepthTileHeader
+{
+    /* 0 */ uint16_t TileRows;
+    /* 2 */ uint16_t TileCount;
+    // Followed by uint32_t compressed bytes for each tile.
+};
+
 #pragma pack(pop)
 
 // No error codes are unrecoverable.  To recover, simply keep passing frames
@@ -201,6 +296,127 @@ const char* DepthResultString(DepthResult result);
 bool IsDepthFrame(const uint8_t* file_data, unsigned file_bytes);
 bool IsKeyFrame(const uint8_t* file_data, unsigned file_bytes);
 
+// Cut a frame down to at most max_bytes without re-encoding it, by dropping
+// the end of its Low bits.  Only frames using VideoType::Wavelet can be cut.
+// Returns false if the frame cannot be made that small.
+bool TruncateDepthFrame(std::vector<uint8_t>& compressed, unsigned max_bytes);
+
+// Number of residual enhancement layers in a frame (see LayerBounds).
+// Returns 0 for frames without layers, and -1 if the frame is invalid.
+int GetDepthLayerCount(const uint8_t* file_data, unsigned file_bytes);
+
+// Keep only the first layer_count residual enhancement layers of a frame,
+// without re-encoding it.  Frames without layers are left as they are.
+// Returns false if the frame is invalid.
+bool DropDepthLayers(std::vector<uint8_t>& compressed, int layer_count);
+
+
+//------------------------------------------------------------------------------
+// DepthOutput
+
+// Caller's buffer for decoded depth, such as an upload staging buffer
+struct DepthOutput
+{
+    // First pixel of the output rectangle
+    uint16_t* Depth = nullptr;
+
+    // Bytes from the start of one row to the next.  Must be even and at
+    // least 2 * the width of the rectangle.
+    size_t RowStride = 0;
+
+    // Rectangle of the image to write.  Width or Height = 0 extends it to
+    // the right or bottom edge of the image.
+    int X = 0;
+    int Y = 0;
+    int Width = 0;
+    int Height = 0;
+
+    // Known alignment in bytes of Depth and RowStride.  16 or more lets the
+    // decoder write with aligned non-temporal stores, which suits write-
+    // combined memory like GPU upload heaps.  0 = Unknown.
+    int Alignment = 0;
+};
+
+
+//------------------------------------------------------------------------------
+// DepthFrameView
+
+/*
+    Non-owning view of a compressed frame, for reading its header straight
+    from a receive buffer or a memory-mapped recording without copying it.
+    Parse() checks that the header is valid and that its sections add up to
+    the size of the frame, which is what the decoder checks before it starts.
+*/
+struct DepthFrameView
+{
+    // Frame data, which must stay valid while the view is used
+    const uint8_t* Data = nullptr;
+    size_t Bytes = 0;
+
+    // Header at the start of Data
+    const DepthHeader* Header = nullptr;
+
+    // Video codec used for the Low bits
+    VideoType LowType = VideoType::H264;
+
+    // Sections after the header.  Residual is nullptr without a residual.
+    const uint8_t* High = nullptr;
+    const uint8_t* Low = nullptr;
+    const uint8_t* Residual = nullptr;
+    unsigned ResidualBytes = 0;
+
+    // Returns Success if the view is set up.  Otherwise it is left empty.
+    DepthResult Parse(const uint8_t* data, size_t bytes);
+
+    bool IsKeyframe() const
+    {
+        return Header != nullptr && (Header->Flags & DepthFlags_Keyframe) != 0;
+    }
+};
+
+
+//------------------------------------------------------------------------------
+// Frame Probing
+
+// Summary of a frame header for relays and indexers
+struct DepthFrameInfo
+{
+    // Offset of the frame in the buffer given to ProbeDepthFrames(), and the
+    // size of the frame
+    size_t Offset = 0;
+    size_t Bytes = 0;
+
+    int Width = 0;
+    int Height = 0;
+    uint16_t FrameNumber = 0;
+    bool Keyframe = false;
+
+    // DepthFlags of the frame, and the video codec used for its Low bits
+    uint8_t Flags = 0;
+    VideoType LowType = VideoType::H264;
+
+    // Sections of the frame, as offsets from the start of the frame.
+    // ResidualBytes = 0 if there is no residual section.
+    unsigned HighOffset = 0;
+    unsigned HighBytes = 0;
+    unsigned LowOffset = 0;
+    unsigned LowBytes = 0;
+    unsigned ResidualOffset = 0;
+    unsigned ResidualBytes = 0;
+    int ResidualLayers = 0;
+};
+
+// Check the header of one frame of exactly `bytes` bytes and describe it,
+// without reading the compressed data
+DepthResult ProbeDepthFrame(const uint8_t* data, size_t bytes, DepthFrameInfo& info);
+
+// Index frames stored back to back, such as a recording, by jumping from
+// header to header.  Appends the info of each frame to infos.  Frames with
+// one residual section end with a Zstd frame, so its block headers are read
+// to find where the frame ends.  Returns the bytes holding whole valid
+// frames, so scanning stops at the first frame that is invalid or cut off.
+size_t ProbeDepthFrames(const uint8_t* data, size_t bytes, std::vector<DepthFrameInfo>& infos);
+
 
 //------------------------------------------------------------------------------
 // Depth Quantization
@@ -289,6 +505,39 @@ void ZstdCompress(
     const std::vector<uint8_t>& uncompressed,
     std::vector<uint8_t>& compressed);
 
+void ZstdCompress(
+    const uint8_t* uncompressed_data,
+    int uncompressed_bytes,
+    int level,
+    std::vector<uint8_t>& compressed);
+
+// Compress into a buffer.  Returns the compressed size, or 0 if it failed or
+// did not fit.  ZSTD_compressBound() bytes are always enough.
+size_t ZstdCompress(
+    const uint8_t* uncompressed_data,
+    int uncompressed_bytes,
+    int level,
+    uint8_t* compressed,
+    size_t capacity);
+
+// Compress with the multithreaded Zstd context shared by the whole process,
+// so compressors reuse one set of worker threads instead of each spawning
+// their own.  If another thread is using the shared context, this falls back
+// to single-threaded compression rather than waiting for it.
+void ZstdCompressMultithreaded(
+    const uint8_t* uncompressed_data,
+    int uncompressed_bytes,
+    int level,
+    int worker_count,
+    std::vector<uint8_t>& compressed);
+size_t ZstdCompressMultithreaded(
+    const uint8_t* uncompressed_data,
+    int uncompressed_bytes,
+    int level,
+    int worker_count,
+    uint8_t* compressed,
+    size_t capacity);
+
 bool ZstdDecompress(
     const uint8_t* compressed_data,
     int compressed_bytes,
@@ -297,31 +546,430 @@ bool ZstdDecompress(
 
 
 //------------------------------------------------------------------------------
-// DepthCompressor
+// Zstd Level Control
+
+/*
+    Picks the Zstd level for the High plane of each frame so that compression
+    fits in a time budget.
+
+    For each level it keeps an EWMA of the measured compression time per
+    input byte, so predictions scale with the frame size.  Host load changes
+    affect every level about the same way, so each new measurement also
+    rescales the estimates of the levels that were not used.  Each frame the
+    highest level predicted to fit in the budget is chosen, stepping up at
+    most one level past the levels that have been measured.
+*/
+
+static const int kZstdMinLevel = -5;
+static const int kZstdMaxLevel = 6;
+
+class ZstdLevelController
+{
+public:
+    ZstdLevelController();
+
+    // Pick the level for compressing the given number of bytes
+    int ChooseLevel(int budget_usec, int bytes) const;
+
+    // Record how long a level took to compress the given number of bytes
+    void Update(int level, int bytes, unsigned usec);
+
+    // Predicted compression time for a level, or 0 if not known yet
+    unsigned PredictUsec(int level, int bytes) const;
+
+protected:
+    static const int kLevelCount = kZstdMaxLevel - kZstdMinLevel + 1;
+
+    // EWMA of microseconds per byte for each level, 0 = not measured yet
+    float UsecPerByte[kLevelCount];
+};
+
 
-class DepthCompressor
+//------------------------------------------------------------------------------
+// Rate Control
+
+/*
+    Picks the coding parameters for each frame so that whole compressed
+    frames, High and Low planes together, follow a target bitrate.
+
+    It models a buffer that fills with each compressed frame and drains at
+    the target rate, like the VBV of a video encoder.  The budget for a frame
+    is the drain for one frame, corrected to bring the buffer back to half
+    full over about two frames, and never more than the room left in the
+    buffer.  Keyframes get a few frames worth of budget when there is room.
+    Bytes of frames that overflow the buffer anyway are paid back from the
+    budgets of the next second of frames.
+
+    The High plane and headers are predicted from the last frame of the same
+    kind, and the rest of the budget goes to the Low plane.  For each video
+    type the Low bytes are modelled as C * step^-k, where the step is the
+    quality parameter of that type and C is measured on every frame, for
+    keyframes and P-frames separately.  The parameters of every type are set
+    each frame, so a backend that falls back to another type still gets a
+    sensible setting.  Until a type is measured, C is a prior for a hard
+    scene so the first frame stays in budget.  Wavelet frames are cut to the
+    budget exactly, and the NVENC bitrate is set so that its own rate control
+    aims for the budget within the frame.
+*/
+
+class RateController
 {
 public:
+    RateController();
+
+    // Set the target.  The buffer model is reset if the target changes
+    void Configure(int bitrate, int fps, int buffer_msec);
+
+    // Set the coding parameters for the next frame and return its budget
+    // in bytes
+    unsigned PlanFrame(bool keyframe, VideoParameters& params);
+
+    // Record the frame that was sent.  low_bytes = 0 if the frame did not
+    // use the video encoder
+    void Update(
+        bool keyframe,
+        VideoType low_type,
+        const VideoParameters& params,
+        unsigned frame_bytes,
+        unsigned low_bytes);
+
+    // Returns true if the buffer is more than half full
+    bool IsOverTarget() const
+    {
+        return BufferBytes > BufferSize / 2;
+    }
+
+    // Bytes in the buffer model after the last frame
+    unsigned GetBufferBytes() const
+    {
+        return static_cast<unsigned>( BufferBytes );
+    }
+
+    // Average bits per second over about the last second
+    unsigned GetAchievedBitrate() const
+    {
+        return static_cast<unsigned>( AchievedBitrate );
+    }
+
+protected:
+    int Bitrate = 0;
+    int Fps = 0;
+    int BufferMsec = 0;
+
+    // Bytes drained from the buffer each frame, and the buffer size
+    float FrameBytes = 0.f;
+    float BufferSize = 0.f;
+    float BufferBytes = 0.f;
+
+    // Bytes that overflowed the buffer and are not paid back yet, and the
+    // part of it taken from the budget of the current frame
+    float Debt = 0.f;
+    float DebtRepay = 0.f;
+
+    // Bytes the last keyframe left above half full that are not paid back
+    // yet, and the part of it taken from the budget of each frame
+    float KeyframeDebt = 0.f;
+    float KeyframeRepay = 0.f;
+
+    // Bytes of each frame that are not the Low plane: [P-frame, keyframe]
+    float OtherBytes[2];
+
+    // Low plane complexity C for each video type: [P-frame, keyframe].
+    // 0 = not measured yet
+    float Complexity[kVideoTypeCount][2];
+
+    // Step of the last frame coded with each video type, or 0 if none.
+    // For LOCO-I the step is 2 * LocoNear + 1.
+    float LastStep[kVideoTypeCount];
+
+    // Bytes of the frames in the last second
+    std::vector<unsigned> History;
+    int HistoryIndex = 0;
+    uint64_t HistorySum = 0;
+    float AchievedBitrate = 0.f;
+
+
+    // Complexity C for the type, or a prior for images of this many pixels
+    // if not measured yet.  Returns 0 if there is no prior for the type.
+    float GetComplexity(VideoType type, int kind, int pixels) const;
+};
+
+
+//------------------------------------------------------------------------------
+// CompressionStats
+
+// Statistics for the last frame passed to DepthEncoder::Compress()
+struct CompressionStats
+{
+    // Zstd level used for the High plane
+    int ZstdLevel = 0;
+
+    // Time the level controller predicted for the High plane (0 = unknown)
+    unsigned HighPredictedUsec = 0;
+
+    // Time spent compressing the High plane
+    unsigned HighUsec = 0;
+
+    // Time spent in the whole Compress() call
+    unsigned TotalUsec = 0;
+
+    // Compressed bytes for each part of the frame
+    unsigned HighBytes = 0;
+    unsigned LowBytes = 0;
+
+    // Number of 8x8 blocks sent if the frame used conditional replenishment,
+    // or 0 for a normal frame
+    unsigned ReplenishBlocks = 0;
+
+    // Number of Low bytes corrected, and bytes of the residual section
+    unsigned ResidualCount = 0;
+    unsigned ResidualBytes = 0;
+
+    // Lossless fallback: True if the frame was sent lossless, and the size
+    // of the lossless candidate.  LosslessBytes is 0 if it was not tried.
+    bool Lossless = false;
+    unsigned LosslessBytes = 0;
+
+    // Parallel candidates: Index into CompressorSettings::CandidateNears of
+    // the candidate that was sent, or -1 for the normal frame, the number of
+    // candidates started on idle workers and that finished before the
+    // deadline, and the time Compress() waited for them, which is at most
+    // CandidateDeadlineUsec
+    int Candidate = -1;
+    unsigned CandidatesStarted = 0;
+    unsigned CandidatesFinished = 0;
+    unsigned CandidateWaitUsec = 0;
+
+    // Rate control: Budget for this frame in bytes, bytes in the buffer
+    // model afterwards, and the bits per second achieved over about the
+    // last second.  All 0 if rate control is disabled.
+    unsigned RateBudgetBytes = 0;
+    unsigned RateBufferBytes = 0;
+    unsigned AchievedBitrate = 0;
+};
+
+
+//------------------------------------------------------------------------------
+// CompressorSettings
+
+struct CompressorSettings
+{
+    // Split the High plane into stripes of this many image rows that are
+    // each compressed with Zstd independently.  The decoder can decompress
+    // the stripes in parallel, decode just the rows it needs, and a corrupted
+    // stripe only loses those rows.  0 = Compress High as one Zstd frame.
+    int HighTileRows = 0;
+
+    // Untiled High planes of at least this many bytes are compressed with
+    // multiple Zstd worker threads.  A 640x576 camera has a 184 KB High plane
+    // and stays single-threaded, while mosaics of several cameras benefit.
+    // 0 = Always single-threaded.
+    int ZstdThreadsMinBytes = 512 * 1024;
+
+    // On P-frames, compare the High plane with the previous frame and send
+    // unchanged High planes or tiles as a few bytes that tell the decoder to
+    // reuse its copy.  Static cameras often repeat most of the High plane.
+    bool HighSkipUnchanged = false;
+
+    // Conditional replenishment for static cameras: On P-frames, compare
+    // each 8x8 block of the quantized depth with the decoder's copy of the
+    // previous frame, and send just the changed blocks with Zstd instead of
+    // running the video encoder.  Unchanged blocks cost about one bit, and
+    // the time spent scales with the amount of motion.
+    bool Replenish = false;
+
+    // A block has changed if any quantized depth value moved by more than
+    // this, or became zero or non-zero.  Sensor noise needs a few units.
+    int ReplenishThreshold = 2;
+
+    // Fall back to a normal P-frame if more than this percentage of the
+    // blocks changed, because the video encoder does better on motion
+    int ReplenishMaxPercent = 25;
+
+    // Hard bound on the error of the Low bits: The encoder decodes its own
+    // Low bits, and sends corrections for every pixel that is off by more
+    // than this.  Depth error is then at most about this many quantized units.
+    // Each correction costs about a byte, so small bounds can double the size
+    // of a lossy stream.  TargetBitrate is ignored while corrections are on.
+    // 0 = No corrections.
+    int ResidualBound = 0;
+
+    // Layered residuals: Error bounds for enhancement layers of residual
+    // corrections, from coarse to fine, for example { 8, 2, 0 }.  The video
+    // encoder should run at a low quality for a coarse base layer.  Each
+    // layer corrects the Low bytes that are off by more than its bound, so a
+    // decoder with the first k layers has the error bound of layer k.
+    // Relays can drop layers with DropDepthLayers().  Up to kMaxDepthLayers
+    // layers, and overrides ResidualBound.  Empty = No layers.
+    std::vector<int> LayerBounds;
+
+    // Decoder: Smooth the steps that block-based video codecs leave in the
+    // Low bits at the edges of 8x8 blocks.  Only edges where the High bits
+    // are the same on both sides are touched, so real object edges are kept.
+    // Frames with residual corrections are not filtered.
+    bool Deblock = false;
+
+    // Code the quantized depth as a single 11-bit image with near-lossless
+    // LOCO-I on the CPU, instead of splitting it into High and Low planes
+    // for a video encoder.  VideoParameters::LocoNear is the largest error
+    // in quantized depth units and VideoParameters::Type is ignored.
+    // Missing depth (zero) is always kept exactly.
+    bool WholeValue = false;
+
+    // Also code each frame exactly (up to quantization) with Zstd on the CPU,
+    // and send that instead if it is no more than LosslessMarginPercent
+    // larger than the lossy frame.  Scenes with little detail or large holes
+    // are often as small this way.  After a lossless frame the video encoder
+    // sends a keyframe, which is itself replaced if lossless is cheaper than
+    // a typical P-frame.
+    bool LosslessFallback = false;
+    int LosslessMarginPercent = 10;
+
+    // Parallel candidates: While the normal frame is coded, whole-value
+    // frames (see WholeValue) with each of these LocoNear values are coded
+    // on idle worker threads, and the smallest frame within the error budget
+    // is sent.  If no frame is within the budget the normal frame is sent.
+    // Candidates only run on idle workers, leaving one free for the video
+    // encoder, so they never delay it.  With fewer idle workers than values
+    // only the first values are tried.  The shared pool has one worker less
+    // than there are hardware threads, and the CPU video codecs run on one
+    // of them, so candidates need at least 4 hardware threads with those
+    // codecs and 3 with H.264 or H.265.  On smaller machines none are coded.
+    // Ignored if WholeValue is set.  Empty = No candidates.
+    std::vector<int> CandidateNears;
+
+    // Error budget for candidates in quantized depth units: The largest
+    // error and the RMS error over pixels with depth.  The normal frame is
+    // decoded again to measure it.  0 = No limit.
+    int CandidateMaxError = 0;
+    float CandidateMaxRmse = 0.f;
+
+    // Time in microseconds that Compress() waits for candidates after the
+    // normal frame is done.  Candidates that are not done by then are not
+    // considered, so this bounds the extra latency.
+    int CandidateDeadlineUsec = 2000;
+
+    // Region of interest: When Compress() is not given an importance map,
+    // derive one from the nearest depth in each 8x8 block.  Blocks nearer
+    // than ImportanceNearMm are the most important, falling linearly to
+    // unimportant at ImportanceFarMm.  Blocks without depth are unimportant.
+    bool ImportanceFromDepth = false;
+    int ImportanceNearMm = 1000;
+    int ImportanceFarMm = 3000;
+
+    // Largest quantization step in quantized depth units, for blocks of
+    // importance 0.  With the Loco codec or WholeValue, depth in other
+    // blocks is rounded to a step between this and 1 for importance 255,
+    // which compresses better.  Dct instead skips unimportant macroblocks
+    // in P-frames when the previous frame is close enough, and H.264 and
+    // H.265 raise their QP.  Wavelet ignores the map, because the rounding
+    // steps cost it more bits than they save.
+    int ImportanceMaxStep = 4;
+
+    // Rate control: Target bits per second for the whole compressed frames
+    // including the High plane.  Each frame the controller sets the bitrate
+    // or quality parameter of the video type and the Zstd level, overriding
+    // those fields of VideoParameters.  See RateController above.
+    // Ignored with residual corrections (see ResidualBound).
+    // 0 = No rate control.
+    int TargetBitrate = 0;
+
+    // Size of the rate control buffer in milliseconds at the target rate.
+    // Frames can be larger than the average by up to about half of this.
+    int RateBufferMsec = 100;
+
+    // Number of Zstd worker threads.  0 = One per hardware thread.
+    int ZstdThreads = 0;
+
+    // Time budget in microseconds for compressing the High plane.
+    // The Zstd level is adjusted every frame between kZstdMinLevel and
+    // kZstdMaxLevel to use as much of the budget as possible.
+    // 0 = Always use Zstd level 1.
+    int HighBudgetUsec = 0;
+};
+
+
+//------------------------------------------------------------------------------
+// DepthEncoder
+
+// Shared state of the candidates for one frame, defined in zdepth.cpp
+struct CandidateFrame;
+
+// Compresses one stream of depth frames.  Buffers are allocated by the first
+// call to Compress().  Encoders can be moved but not copied.
+class DepthEncoder
+{
+public:
+    void SetSettings(const CompressorSettings& settings)
+    {
+        Settings = settings;
+    }
+
     // Compress depth array to buffer
     // Set keyframe to indicate this frame should not reference the previous one
+    // The buffer is left empty if no video backend could code the frame
     void Compress(
         const VideoParameters& params,
         const uint16_t* unquantized_depth,
         std::vector<uint8_t>& compressed,
         bool keyframe);
 
-    // Decompress buffer to depth array.
-    // Resulting depth buffer is row-first, stride=width*2 (no surprises).
-    // Returns false if input is invalid
-    DepthResult Decompress(
-        const std::vector<uint8_t>& compressed,
-        int& width,
-        int& height,
-        std::vector<uint16_t>& depth_out);
+    // Compress with an importance map, with one byte for each 8x8 block in
+    // raster order, (width + 7) / 8 in each row, from 0 (unimportant) to 255.
+    // Depth in unimportant blocks is quantized more coarsely and the video
+    // encoder spends fewer bits on them.  params.Importance is ignored.
+    // nullptr = Derive it from depth if ImportanceFromDepth is set.
+    void Compress(
+        const VideoParameters& params,
+        const uint16_t* unquantized_depth,
+        const uint8_t* importance,
+        std::vector<uint8_t>& compressed,
+        bool keyframe);
+
+    // Largest frame that Compress() can produce for these parameters with
+    // the current settings, for sizing buffers for the overloads below
+    size_t CompressBound(const VideoParameters& params) const;
+
+    // Compress into a caller's buffer, such as a network send slab or a
+    // ring buffer slot, instead of a vector.  The High bits, the Low bits
+    // and the residual are written straight into it, and the header last.
+    // Returns the size of the frame, or 0 if it did not fit in capacity or
+    // could not be coded.
+    // That frame is lost, so the next one should be a keyframe.  A buffer of
+    // CompressBound() bytes always fits.
+    size_t Compress(
+        const VideoParameters& params,
+        const uint16_t* unquantized_depth,
+        uint8_t* compressed,
+        size_t capacity,
+        bool keyframe);
+    size_t Compress(
+        const VideoParameters& params,
+        const uint16_t* unquantized_depth,
+        const uint8_t* importance,
+        uint8_t* compressed,
+        size_t capacity,
+        bool keyframe);
+
+    // Statistics for the last call to Compress()
+    const CompressionStats& GetStats() const
+    {
+        return Stats;
+    }
 
 protected:
+    CompressorSettings Settings;
+    CompressionStats Stats;
+    ZstdLevelController LevelController;
+    RateController RateControl;
+
     // Depth values quantized
     std::vector<uint16_t> QuantizedDepth;
+
+    // Importance of each 8x8 block for the current frame, and the nearest
+    // depth in each block when it is derived from depth
+    std::vector<uint8_t> ImportanceMap;
+    std::vector<uint16_t> ImportanceNearest;
     uint64_t FrameCount = 0;
 
     std::vector<uint8_t> High;
@@ -330,18 +978,437 @@ protected:
     // Results of compression
     std::vector<uint8_t> HighOut, LowOut;
 
+    // Compress() into a caller's buffer: The buffer and its size, or nullptr
+    // when compressing into a vector
+    uint8_t* FrameDest = nullptr;
+    size_t FrameCapacity = 0;
+
+    // Bytes of the frame written to FrameDest, or 0 if it is in FrameSpill
+    size_t FrameDestBytes = 0;
+    std::vector<uint8_t> FrameSpill;
+
+    // Bytes of the High section written to FrameDest, or 0 if it is in HighOut
+    size_t HighDirectBytes = 0;
+
+    // Compressed High tiles before they are concatenated into HighOut
+    std::vector<std::vector<uint8_t>> TileOut;
+
+    // High plane of the previous frame for skipping unchanged tiles
+    std::vector<uint8_t> HighPrevious;
+    int HighPreviousWidth = 0;
+
+    // Quantized depth of the previous frame as the decoder has it, for
+    // conditional replenishment.  Width = 0 if there is no previous frame.
+    std::vector<uint16_t> ReplenishReference;
+    int ReplenishWidth = 0;
+    int ReplenishHeight = 0;
+
+    // Uncompressed replenishment data and changed values before packing
+    std::vector<uint8_t> ReplenishData;
+    std::vector<uint16_t> ReplenishValues;
+
     // Video compressor used for low bits
     VideoCodec Codec;
 
+    // Decodes the Low bits again to find the corrections to send
+    VideoCodec ResidualCodec;
+    std::vector<uint8_t> LowDecoded;
+
+    // Uncompressed and compressed residual section
+    std::vector<uint8_t> ResidualData, ResidualOut;
+
+    // Compressed corrections of one residual layer
+    std::vector<uint8_t> ResidualLayer;
+
+    // Uncompressed and compressed lossless candidate
+    std::vector<uint8_t> LosslessData, LosslessOut;
+
+    // The video decoder has not seen the last Low frame, because a lossless
+    // frame was sent instead
+    bool LowKeyframeNeeded = false;
+
+    // Moving average of the size of lossy P-frames
+    float LossyPFrameBytes = 0.f;
+
+    // Candidates for the current frame, which may still be running on
+    // worker threads from an earlier frame
+    std::shared_ptr<CandidateFrame> Candidates;
 
-    // Transform the data for compression by Zstd/H.264
+
+    // Derive the importance map if needed, and if coarsen is set round
+    // QuantizedDepth in unimportant blocks to coarser steps.
+    // Returns the importance map to pass to the video encoder, or nullptr.
+    const uint8_t* ApplyImportance(
+        int width,
+        int height,
+        const uint16_t* unquantized_depth,
+        const uint8_t* importance,
+        bool coarsen);
+
+    // Zstd level for compressing the given number of High bytes
+    int ChooseZstdLevel(int bytes) const;
+
+    // True if the settings ask for rate control.  Residual corrections turn
+    // it off: Lowering the video quality adds corrections, which the
+    // controller would answer by lowering the quality further.
+    bool HasRateControl() const;
+
+    // Account for a compressed frame in the rate controller and stats
+    void UpdateRateControl(
+        bool keyframe,
+        VideoType low_type,
+        const VideoParameters& low_params,
+        size_t frame_bytes,
+        unsigned low_bytes);
+
+    // Compress High into HighOut as a single Zstd frame or as row tiles.
+    // Returns the number of High bytes that were compressed (not repeated).
+    int CompressHigh(
+        int width,
+        int height,
+        int tile_rows,
+        int level,
+        bool keyframe);
+
+    // Compress QuantizedDepth as a conditional replenishment frame.
+    // Returns false if a normal frame should be sent instead.
+    bool CompressReplenish(
+        DepthHeader& header,
+        std::vector<uint8_t>& compressed);
+
+    // Compress the rescaled QuantizedDepth as a whole-value frame
+    void CompressWholeValue(
+        DepthHeader& header,
+        int near,
+        std::vector<uint8_t>& compressed);
+
+    // Pack the quantized depth before rescaling into LosslessOut
+    void CompressLossless(
+        int width,
+        int height);
+
+    // Replace the lossy frame in `compressed` with the lossless candidate if
+    // it is within the margin of compare_bytes.  Returns true if replaced.
+    bool ChooseLossless(
+        DepthHeader header,
+        float compare_bytes,
+        VideoType low_type,
+        std::vector<uint8_t>& compressed);
+
+    // Start coding the rescaled QuantizedDepth as candidates on the workers
+    void StartCandidates(
+        int width,
+        int height);
+
+    // Decode LowOut like the decoder will and measure the error of the Low
+    // bits in rescaled units.  Returns false if it did not decode.
+    bool MeasureLowError(
+        int width,
+        int height,
+        VideoType type,
+        float& max_error,
+        float& rmse);
+
+    // Wait for the candidates and replace the normal frame in `compressed`
+    // with the best one, counting the normal frame as compare_bytes.
+    // Returns true if replaced.
+    bool FinishCandidates(
+        DepthHeader header,
+        VideoType low_type,
+        float compare_bytes,
+        bool measured,
+        float max_error,
+        float rmse,
+        std::vector<uint8_t>& compressed);
+
+    // Drop the queued candidates of a frame that is not sent
+    void CancelCandidates();
+
+    // True if the settings ask for residual corrections
+    bool HasResidual() const;
+
+    // Error bound of the Low bits after all residual corrections
+    int GetResidualBound() const;
+
+    // Decode LowOut and compress corrections for Low into ResidualOut, as
+    // one section or as layers.  Sets the residual fields of the header.
+    // Returns false if there is nothing to correct.
+    bool CompressResidual(
+        DepthHeader& header,
+        VideoType type);
+
+    // Transform the data for compression by Zstd/H.264, writing Low in the
+    // layout the video encoder takes
     void Filter(
-        const std::vector<uint16_t>& depth_in);
+        const std::vector<uint16_t>& depth_in,
+        VideoLayout layout);
+};
+
+
+//------------------------------------------------------------------------------
+// DepthDecoderScratch
+
+// Buffers that a decoder only uses while it decodes a frame.  Players with
+// many streams can share one between all the decoders that run on the same
+// thread, so it is allocated once rather than for each stream.  Decoders
+// sharing it must not decode at the same time.
+struct DepthDecoderScratch
+{
+    // Low bits of the frame
+    std::vector<uint8_t> Low;
+
+    // High bits for each pixel, unpacked for the deblocking filter
+    std::vector<uint8_t> HighNibbles;
+
+    // Quantized rows decoded for a DepthOutput
+    std::vector<uint16_t> OutputRows;
+
+    // Uncompressed residual, replenishment and lossless sections
+    std::vector<uint8_t> ResidualData;
+    std::vector<uint8_t> ReplenishData;
+    std::vector<uint8_t> LosslessData;
+};
+
+
+//------------------------------------------------------------------------------
+// DepthDecoder
+
+// Decompresses one stream of depth frames.  Buffers are allocated by the
+// first call to decompress.  Decoders can be moved but not copied.
+class DepthDecoder
+{
+public:
+    // Only the decoder settings are used (Deblock)
+    void SetSettings(const CompressorSettings& settings)
+    {
+        Deblock = settings.Deblock;
+    }
+
+    // Use scratch buffers shared with other decoders on the same thread
+    // (see DepthDecoderScratch), instead of allocating its own
+    void SetScratch(const std::shared_ptr<DepthDecoderScratch>& scratch)
+    {
+        Scratch = scratch;
+    }
+
+    // Decompress buffer to depth array.
+    // Resulting depth buffer is row-first, stride=width*2 (no surprises).
+    // Returns false if input is invalid
+    DepthResult Decompress(
+        const std::vector<uint8_t>& compressed,
+        int& width,
+        int& height,
+        std::vector<uint16_t>& depth_out);
+
+    // Decompress straight from a buffer, such as a receive buffer or a
+    // memory-mapped file, without copying it into a vector first.
+    // The same goes for the overloads of the functions below.
+    DepthResult Decompress(
+        const uint8_t* data,
+        size_t bytes,
+        int& width,
+        int& height,
+        std::vector<uint16_t>& depth_out);
+
+    // Decompress only image rows [first_row, first_row + row_count).
+    // row_count is clamped to the height of the image.
+    // For tiled frames only the High tiles covering those rows are decoded.
+    // Conditional replenishment frames need the whole previous frame, so
+    // they return MissingFrame after a call that decoded only some rows.
+    // Resulting depth buffer is row-first, stride=width*2 with row_count rows.
+    DepthResult DecompressRows(
+        const std::vector<uint8_t>& compressed,
+        int first_row,
+        int row_count,
+        int& width,
+        int& height,
+        std::vector<uint16_t>& depth_out);
+
+    // Decompress into a caller's buffer with any row stride, and optionally
+    // only a rectangle of the image, so depth goes straight to where it is
+    // used.  Only the rows of the rectangle are decoded, as for
+    // DecompressRows().  Width and height are set to the size of the image.
+    // Returns Corrupted if the rectangle is not inside the image or does not
+    // fit the row stride.
+    DepthResult Decompress(
+        const uint8_t* data,
+        size_t bytes,
+        const DepthOutput& output,
+        int& width,
+        int& height);
+
+    DepthResult DecompressRows(
+        const uint8_t* data,
+        size_t bytes,
+        int first_row,
+        int row_count,
+        int& width,
+        int& height,
+        std::vector<uint16_t>& depth_out);
+
+    // Decompress a preview at 1/scale of the size in each direction, for
+    // thumbnails.  scale is 1, 2, 4 or 8, and width and height are set to
+    // the size of the preview.  Pixels are sampled rather than averaged so
+    // no depth appears between objects.  The High bits are still decoded in
+    // full, and so are the Low bits of video types with P-frames, which need
+    // every frame.  Wavelet previews decode only the start of the embedded
+    // Low bits, and LOCO-I previews skip them for a coarse depth from the
+    // High bits alone.  Whole-value, lossless and conditional replenishment
+    // frames are decoded in full and then sampled.  Replenishment frames
+    // that follow a Wavelet or LOCO-I preview return MissingFrame until the
+    // next keyframe.
+    DepthResult DecompressPreview(
+        const std::vector<uint8_t>& compressed,
+        int scale,
+        int& width,
+        int& height,
+        std::vector<uint16_t>& depth_out);
+    DepthResult DecompressPreview(
+        const uint8_t* data,
+        size_t bytes,
+        int scale,
+        int& width,
+        int& height,
+        std::vector<uint16_t>& depth_out);
+
+    // Number of High tiles that failed to decode in the last tiled frame.
+    // The depth for the rows of each corrupted tile is set to zero.
+    int GetCorruptTileCount() const
+    {
+        return CorruptTiles;
+    }
+
+protected:
+    // Smooth block edges in Low (see CompressorSettings::Deblock)
+    bool Deblock = false;
+
+    // Created on the first frame unless SetScratch() was called
+    std::shared_ptr<DepthDecoderScratch> Scratch;
+
+    uint64_t FrameCount = 0;
+
+    // Number of the last frame, and whether it was decoded successfully.
+    // Video P-frames can only follow a decoded frame.
+    uint16_t LastFrame = 0;
+    bool LastFrameValid = false;
+
+    // High bits of the last frame, kept to repeat unchanged tiles
+    std::vector<uint8_t> High;
+    int CorruptTiles = 0;
+
+    // Frame that High was decoded from, and which rows are valid.
+    // Rows outside of DecompressRows() or in corrupted tiles are not valid.
+    std::vector<uint8_t> HighRowsValid;
+    int HighValidWidth = 0;
+    uint16_t HighValidFrame = 0;
+
+    // Quantized depth of the previous frame, for conditional replenishment.
+    // Width = 0 if there is no previous frame.
+    std::vector<uint16_t> ReplenishReference;
+    int ReplenishWidth = 0;
+    int ReplenishHeight = 0;
+    uint16_t ReplenishFrame = 0;
+
+    // Video decoder used for low bits
+    VideoCodec Codec;
+
+
+    // Returns true if the given rows of High can be reused for this frame
+    bool CanRepeatHigh(
+        const DepthHeader& header,
+        int first_row,
+        int row_count) const;
+
+    // Decoder shared by DecompressRows() and DecompressPreview().
+    // preview_scale = 1 for a full resolution decode.
+    // Quantized rows are dequantized into depth_out, or into output if it
+    // is not nullptr.
+    DepthResult DecodeFrame(
+        const uint8_t* data,
+        size_t bytes,
+        int first_row,
+        int row_count,
+        int preview_scale,
+        const DepthOutput* output,
+        int& width,
+        int& height,
+        std::vector<uint16_t>& depth_out);
+
+    // Decompress High section into High, decoding at least the given rows
+    DepthResult DecompressHigh(
+        const DepthHeader& header,
+        const uint8_t* data,
+        int first_row,
+        int row_count);
+
+    // Apply a conditional replenishment frame to ReplenishReference
+    DepthResult DecompressReplenish(
+        const DepthHeader& header,
+        const uint8_t* data);
+
+    // Decompress a whole-value frame into quantized depth
+    DepthResult DecompressWholeValue(
+        const DepthHeader& header,
+        const uint8_t* data,
+        std::vector<uint16_t>& depth_out);
+
+    // Decompress a lossless frame into quantized depth
+    DepthResult DecompressLossless(
+        const DepthHeader& header,
+        const uint8_t* data,
+        std::vector<uint16_t>& depth_out);
+
+    // Apply the residual section, or each of its layers, to Low
+    DepthResult DecompressResidualLayers(
+        const DepthHeader& header,
+        const uint8_t* data,
+        unsigned bytes,
+        int pixel_count);
+
+    // Apply one residual section to Low
+    DepthResult DecompressResidual(
+        const uint8_t* data,
+        unsigned bytes,
+        int pixel_count);
+
+    // Smooth block edges in Low where High is continuous, for the given rows
+    void DeblockLow(
+        int width,
+        int first_row,
+        int row_count);
+
+    // Undo the transform for pixels [begin, end) of the image
     void Unfilter(
+        int begin,
+        int end,
+        std::vector<uint16_t>& depth_out);
+
+    // Unfilter every scale-th pixel of every scale-th row.
+    // has_low = false: Use only the High bits.
+    void UnfilterPreview(
         int width,
         int height,
+        int scale,
+        bool has_low,
         std::vector<uint16_t>& depth_out);
 };
 
 
+//------------------------------------------------------------------------------
+// DepthCompressor
+
+// Encoder and decoder in one object, as in earlier versions.  New code should
+// use DepthEncoder and DepthDecoder, which do not carry each other's state.
+// Separate objects must still be used for compressing and decompressing.
+class DepthCompressor : public DepthEncoder, public DepthDecoder
+{
+public:
+    void SetSettings(const CompressorSettings& settings)
+    {
+        DepthEncoder::SetSettings(settings);
+        DepthDecoder::SetSettings(settings);
+    }
+};
+
+
 } // namespace zdepth
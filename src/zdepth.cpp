@@ -3,9 +3,26 @@
 #include "zdepth.hpp"
 
 #include "libdivide.h"
+#include "DctCodec.hpp"
+#include "LocoCodec.hpp"
+#include "WaveletCodec.hpp"
+#include "WorkerPool.hpp"
 
 #include <zstd.h> // Zstd
 #include <string.h> // memcpy
+#include <stdlib.h> // abs
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+#if defined(__SSE2__) || defined(_M_X64) || defined(_M_AMD64)
+    #define DEPTH_ENABLE_SSE2
+    #include <emmintrin.h>
+#endif
 
 namespace zdepth {
 
@@ -19,6 +36,84 @@ static const int kBlockSize = 8;
 // Zstd compression level
 static const int kZstdLevel = 1;
 
+// Largest supported image width or height
+static const int kMaxDimension = 4096;
+
+// Largest quantized and rescaled depth value
+static const int kWholeValueMax = 2047;
+
+// Largest value from AzureKinectQuantizeDepth()
+static const int kMaxQuantizedDepth = 2039;
+
+// Weight of each new P-frame in the estimate of the lossy P-frame size
+static const float kLossyEstimateAlpha = 0.25f;
+
+// Fraction of the High time budget the level controller aims to use,
+// leaving headroom for timing jitter between frames
+static const float kZstdBudgetHeadroom = 0.85f;
+
+// Weight of each new timing measurement in the level controller EWMA
+static const float kZstdTimingAlpha = 0.2f;
+
+// Assumed slowdown of each Zstd level relative to the one below it,
+// for levels that have not been measured yet
+static const float kZstdLevelSlowdown = 1.3f;
+
+// Rate control: Number of frames over which the buffer is brought back to
+// half full
+static const float kRateReactionFrames = 2.f;
+
+// Rate control: Budget for a keyframe in frames, if the buffer has room
+static const float kRateKeyframeFrames = 3.f;
+
+// Rate control: Number of frames over which the bytes a keyframe took beyond
+// half the buffer are paid back.  Paying them back within the reaction time
+// starves the first P-frames, which then cost more to repair.
+static const float kRateKeyframeRepayFrames = 10.f;
+
+// Rate control: Smallest budget for a frame, as a fraction of the average
+static const float kRateMinBudget = 0.25f;
+
+// Rate control: Smallest budget for the Low plane in bytes
+static const float kRateMinLowBytes = 256.f;
+
+// Rate control: Weight of each new measurement of the Low plane complexity
+static const float kRateComplexityAlpha = 0.5f;
+
+// Rate control: Exponent k of the Low plane size model C * step^-k
+// for the DCT quantizer and the LOCO quantization step 2 * near + 1
+static const float kRateDctExponent = 0.8f;
+static const float kRateLocoExponent = 0.6f;
+
+// Rate control: Low plane complexity C of DCT and LOCO-I in bytes per pixel,
+// assumed until the first frame is measured.  This is a noisy scene, so the
+// first frame errs on the small side.
+static const float kRateComplexityPrior = 1.f;
+
+// Rate control: High plane and header bytes per pixel, assumed until the
+// first frame is measured
+static const float kRateOtherPrior = 1.f / 16.f;
+
+// Rate control: Largest factor by which the DCT or LOCO-I step can change
+// from one frame to the next, in either direction.  The size model is only
+// good near the step it was measured at, and a P-frame after a coarse one
+// has to repair its reference, so larger jumps oscillate.
+static const float kRateMaxStepChange = 1.25f;
+
+// Rate control: Largest LocoNear that will be chosen
+static const int kRateMaxLocoNear = 32;
+
+// Rate control: Zstd level for High while the buffer is over half full,
+// if there is no time budget for High
+static const int kRateZstdLevel = 3;
+
+static uint64_t GetTimeUsec()
+{
+    const auto now = std::chrono::steady_clock::now().time_since_epoch();
+    return static_cast<uint64_t>(
+        std::chrono::duration_cast<std::chrono::microseconds>(now).count() );
+}
+
 const char* DepthResultString(DepthResult result)
 {
     switch (result)
@@ -56,6 +151,265 @@ bool IsKeyFrame(const uint8_t* file_data, unsigned file_bytes)
     return (file_data[1] & 1) != 0;
 }
 
+bool TruncateDepthFrame(std::vector<uint8_t>& compressed, unsigned max_bytes)
+{
+    const unsigned file_bytes = static_cast<unsigned>( compressed.size() );
+    if (!IsDepthFrame(compressed.data(), file_bytes)) {
+        return false;
+    }
+    if (file_bytes <= max_bytes) {
+        return true;
+    }
+
+    DepthHeader* header = reinterpret_cast<DepthHeader*>( compressed.data() );
+    if ((header->Flags & DepthFlags_Replenish) != 0 ||
+        (header->Flags & DepthFlags_LowCodec) == 0 ||
+        header->LowCodec != static_cast<uint8_t>( VideoType::Wavelet ))
+    {
+        return false;
+    }
+    const unsigned low_offset = kDepthHeaderBytes + header->HighCompressedBytes;
+    const unsigned low_end = low_offset + header->LowCompressedBytes;
+    if ((header->Flags & DepthFlags_Residual) != 0 ? file_bytes <= low_end : file_bytes != low_end) {
+        return false;
+    }
+    if (max_bytes < low_offset + kWaveletHeaderBytes) {
+        return false;
+    }
+
+    // The Low bits are an embedded bitstream, so any prefix can be decoded.
+    // Residual corrections are for the complete Low bits so they are dropped.
+    header->Flags &= ~DepthFlags_Residual;
+    header->ResidualLayers = 0;
+    header->LowCompressedBytes = max_bytes - low_offset;
+    compressed.resize(max_bytes);
+    return true;
+}
+
+int GetDepthLayerCount(const uint8_t* file_data, unsigned file_bytes)
+{
+    if (!IsDepthFrame(file_data, file_bytes)) {
+        return -1;
+    }
+    const DepthHeader* header = reinterpret_cast<const DepthHeader*>( file_data );
+    if (header->ResidualLayers > kMaxDepthLayers) {
+        return -1;
+    }
+    return header->ResidualLayers;
+}
+
+bool DropDepthLayers(std::vector<uint8_t>& compressed, int layer_count)
+{
+    const unsigned file_bytes = static_cast<unsigned>( compressed.size() );
+    const int frame_layers = GetDepthLayerCount(compressed.data(), file_bytes);
+    if (frame_layers < 0 || layer_count < 0) {
+        return false;
+    }
+    if (layer_count >= frame_layers) {
+        return true;
+    }
+
+    DepthHeader* header = reinterpret_cast<DepthHeader*>( compressed.data() );
+    if ((header->Flags & DepthFlags_Residual) == 0) {
+        return false;
+    }
+
+    // Walk the sizes of the layers to keep, which follow the Low bits
+    uint64_t offset = static_cast<uint64_t>( kDepthHeaderBytes ) +
+        header->HighCompressedBytes + header->LowCompressedBytes;
+    for (int layer = 0; layer < layer_count; ++layer) {
+        if (offset + sizeof(uint32_t) > file_bytes) {
+            return false;
+        }
+        uint32_t section_bytes;
+        memcpy(&section_bytes, compressed.data() + offset, sizeof(uint32_t));
+        offset += sizeof(uint32_t) + section_bytes;
+        if (offset > file_bytes) {
+            return false;
+        }
+    }
+
+    // Without any layers the frame has no residual section at all
+    if (layer_count == 0) {
+        header->Flags &= ~DepthFlags_Residual;
+    }
+    header->ResidualLayers = static_cast<uint8_t>( layer_count );
+    compressed.resize(static_cast<size_t>( offset ));
+    return true;
+}
+
+
+//------------------------------------------------------------------------------
+// DepthFrameView
+
+DepthResult DepthFrameView::Parse(const uint8_t* data, size_t bytes)
+{
+    *this = DepthFrameView();
+
+    if (!data || bytes < kDepthHeaderBytes) {
+        return DepthResult::FileTruncated;
+    }
+    const DepthHeader* header = reinterpret_cast<const DepthHeader*>( data );
+    if (header->Magic != kDepthFormatMagic) {
+        return DepthResult::WrongFormat;
+    }
+
+    VideoType low_type = VideoType::H264;
+    if ((header->Flags & DepthFlags_LowCodec) != 0) {
+        if (header->LowCodec >= kVideoTypeCount) {
+            return DepthResult::Corrupted;
+        }
+        low_type = static_cast<VideoType>( header->LowCodec );
+    } else if ((header->Flags & DepthFlags_HEVC) != 0) {
+        low_type = VideoType::H265;
+    }
+
+    const int width = header->Width;
+    const int height = header->Height;
+    if (width < 1 || width > kMaxDimension || height < 1 || height > kMaxDimension) {
+        return DepthResult::Corrupted;
+    }
+
+    // Only frames with High and Low bits can have a residual section, which
+    // runs to the end of the frame
+    const uint8_t single_section_flags = DepthFlags_Replenish | DepthFlags_WholeValue | DepthFlags_Lossless;
+    const bool residual = (header->Flags & DepthFlags_Residual) != 0 &&
+        (header->Flags & single_section_flags) == 0;
+    const uint64_t total_bytes = static_cast<uint64_t>( kDepthHeaderBytes ) +
+        header->HighCompressedBytes + header->LowCompressedBytes;
+    if (residual ? bytes <= total_bytes : bytes != total_bytes) {
+        return DepthResult::FileTruncated;
+    }
+    if (header->ResidualLayers > kMaxDepthLayers || (!residual && header->ResidualLayers != 0)) {
+        return DepthResult::Corrupted;
+    }
+
+    Data = data;
+    Bytes = bytes;
+    Header = header;
+    LowType = low_type;
+    High = data + kDepthHeaderBytes;
+    Low = High + header->HighCompressedBytes;
+    if (residual) {
+        Residual = Low + header->LowCompressedBytes;
+        ResidualBytes = static_cast<unsigned>( bytes - total_bytes );
+    }
+    return DepthResult::Success;
+}
+
+
+//------------------------------------------------------------------------------
+// Frame Probing
+
+static void FillFrameInfo(const DepthFrameView& frame, size_t offset, DepthFrameInfo& info)
+{
+    const DepthHeader* header = frame.Header;
+    info.Offset = offset;
+    info.Bytes = frame.Bytes;
+    info.Width = header->Width;
+    info.Height = header->Height;
+    info.FrameNumber = header->FrameNumber;
+    info.Keyframe = frame.IsKeyframe();
+    info.Flags = header->Flags;
+    info.LowType = frame.LowType;
+    info.HighOffset = kDepthHeaderBytes;
+    info.HighBytes = header->HighCompressedBytes;
+    info.LowOffset = info.HighOffset + info.HighBytes;
+    info.LowBytes = header->LowCompressedBytes;
+    info.ResidualOffset = info.LowOffset + info.LowBytes;
+    info.ResidualBytes = frame.ResidualBytes;
+    info.ResidualLayers = header->ResidualLayers;
+}
+
+DepthResult ProbeDepthFrame(const uint8_t* data, size_t bytes, DepthFrameInfo& info)
+{
+    DepthFrameView frame;
+    const DepthResult result = frame.Parse(data, bytes);
+    if (result != DepthResult::Success) {
+        return result;
+    }
+    FillFrameInfo(frame, 0, info);
+    return DepthResult::Success;
+}
+
+// Size of the frame at the start of data, or 0 if it is not all there.
+// The residual section has no size in the header, so it is found from the
+// sizes of its layers, or from the Zstd frame of a single section.
+static size_t FindFrameBytes(const uint8_t* data, size_t bytes)
+{
+    if (bytes < kDepthHeaderBytes) {
+        return 0;
+    }
+    const DepthHeader* header = reinterpret_cast<const DepthHeader*>( data );
+    if (header->Magic != kDepthFormatMagic) {
+        return 0;
+    }
+
+    uint64_t total_bytes = static_cast<uint64_t>( kDepthHeaderBytes ) +
+        header->HighCompressedBytes + header->LowCompressedBytes;
+    if (total_bytes > bytes) {
+        return 0;
+    }
+    const uint8_t single_section_flags = DepthFlags_Replenish | DepthFlags_WholeValue | DepthFlags_Lossless;
+    if ((header->Flags & DepthFlags_Residual) == 0 || (header->Flags & single_section_flags) != 0) {
+        return static_cast<size_t>( total_bytes );
+    }
+
+    const int layer_count = header->ResidualLayers;
+    if (layer_count > kMaxDepthLayers) {
+        return 0;
+    }
+    if (layer_count > 0) {
+        for (int layer = 0; layer < layer_count; ++layer) {
+            if (total_bytes + sizeof(uint32_t) > bytes) {
+                return 0;
+            }
+            uint32_t section_bytes;
+            memcpy(&section_bytes, data + total_bytes, sizeof(uint32_t));
+            total_bytes += sizeof(uint32_t) + section_bytes;
+            if (total_bytes > bytes) {
+                return 0;
+            }
+        }
+        return static_cast<size_t>( total_bytes );
+    }
+
+    // Uncompressed size, then one Zstd frame
+    total_bytes += sizeof(uint32_t);
+    if (total_bytes >= bytes) {
+        return 0;
+    }
+    const size_t zstd_bytes = ZSTD_findFrameCompressedSize(
+        data + total_bytes,
+        static_cast<size_t>( bytes - total_bytes ));
+    if (ZSTD_isError(zstd_bytes)) {
+        return 0;
+    }
+    return static_cast<size_t>( total_bytes + zstd_bytes );
+}
+
+size_t ProbeDepthFrames(const uint8_t* data, size_t bytes, std::vector<DepthFrameInfo>& infos)
+{
+    size_t offset = 0;
+    while (offset < bytes) {
+        const size_t frame_bytes = FindFrameBytes(data + offset, bytes - offset);
+        if (frame_bytes == 0) {
+            break;
+        }
+
+        DepthFrameView frame;
+        if (frame.Parse(data + offset, frame_bytes) != DepthResult::Success) {
+            break;
+        }
+        DepthFrameInfo info;
+        FillFrameInfo(frame, offset, info);
+        infos.push_back(info);
+
+        offset += frame_bytes;
+    }
+    return offset;
+}
+
 
 //------------------------------------------------------------------------------
 // Depth Quantization
@@ -248,20 +602,140 @@ void ZstdCompress(
     const std::vector<uint8_t>& uncompressed,
     std::vector<uint8_t>& compressed)
 {
-    compressed.resize(ZSTD_compressBound(uncompressed.size()));
-    const size_t size = ZSTD_compress(
-        compressed.data(),
-        compressed.size(),
+    ZstdCompress(
         uncompressed.data(),
-        uncompressed.size(),
-        kZstdLevel);
+        static_cast<int>( uncompressed.size() ),
+        kZstdLevel,
+        compressed);
+}
+
+void ZstdCompress(
+    const uint8_t* uncompressed_data,
+    int uncompressed_bytes,
+    int level,
+    std::vector<uint8_t>& compressed)
+{
+    compressed.resize(ZSTD_compressBound(uncompressed_bytes));
+    const size_t size = ZstdCompress(
+        uncompressed_data,
+        uncompressed_bytes,
+        level,
+        compressed.data(),
+        compressed.size());
+    compressed.resize(size);
+}
+
+size_t ZstdCompress(
+    const uint8_t* uncompressed_data,
+    int uncompressed_bytes,
+    int level,
+    uint8_t* compressed,
+    size_t capacity)
+{
+    const size_t size = ZSTD_compress(
+        compressed,
+        capacity,
+        uncompressed_data,
+        uncompressed_bytes,
+        level);
     if (ZSTD_isError(size)) {
-        compressed.clear();
-        return;
+        return 0;
     }
+    return size;
+}
+
+// Multithreaded Zstd context shared by all compressors in the process.
+// The zstdmt worker threads belong to the context, so keeping one context
+// alive means the threads are started once and reused for every frame.
+struct SharedZstdContext
+{
+    std::mutex Lock;
+    ZSTD_CCtx* Context = nullptr;
+    int WorkerCount = 0;
+
+    ~SharedZstdContext()
+    {
+        ZSTD_freeCCtx(Context);
+    }
+};
+
+static SharedZstdContext& GetSharedZstdContext()
+{
+    static SharedZstdContext shared;
+    return shared;
+}
+
+void ZstdCompressMultithreaded(
+    const uint8_t* uncompressed_data,
+    int uncompressed_bytes,
+    int level,
+    int worker_count,
+    std::vector<uint8_t>& compressed)
+{
+    compressed.resize(ZSTD_compressBound(uncompressed_bytes));
+    const size_t size = ZstdCompressMultithreaded(
+        uncompressed_data,
+        uncompressed_bytes,
+        level,
+        worker_count,
+        compressed.data(),
+        compressed.size());
     compressed.resize(size);
 }
 
+size_t ZstdCompressMultithreaded(
+    const uint8_t* uncompressed_data,
+    int uncompressed_bytes,
+    int level,
+    int worker_count,
+    uint8_t* compressed,
+    size_t capacity)
+{
+    if (worker_count <= 0) {
+        worker_count = static_cast<int>( std::thread::hardware_concurrency() );
+    }
+
+    SharedZstdContext& shared = GetSharedZstdContext();
+    std::unique_lock<std::mutex> locker(shared.Lock, std::try_to_lock);
+    if (!locker.owns_lock() || worker_count <= 1) {
+        return ZstdCompress(uncompressed_data, uncompressed_bytes, level, compressed, capacity);
+    }
+
+    if (!shared.Context) {
+        shared.Context = ZSTD_createCCtx();
+        if (!shared.Context) {
+            locker.unlock();
+            return ZstdCompress(uncompressed_data, uncompressed_bytes, level, compressed, capacity);
+        }
+    }
+    ZSTD_CCtx_setParameter(shared.Context, ZSTD_c_compressionLevel, level);
+
+    // Changing the worker count restarts the worker threads, so only do it
+    // when a different count is requested
+    if (shared.WorkerCount != worker_count) {
+        const size_t result = ZSTD_CCtx_setParameter(
+            shared.Context,
+            ZSTD_c_nbWorkers,
+            worker_count);
+        if (ZSTD_isError(result)) {
+            locker.unlock();
+            return ZstdCompress(uncompressed_data, uncompressed_bytes, level, compressed, capacity);
+        }
+        shared.WorkerCount = worker_count;
+    }
+
+    const size_t size = ZSTD_compress2(
+        shared.Context,
+        compressed,
+        capacity,
+        uncompressed_data,
+        uncompressed_bytes);
+    if (ZSTD_isError(size)) {
+        return 0;
+    }
+    return size;
+}
+
 bool ZstdDecompress(
     const uint8_t* compressed_data,
     int compressed_bytes,
@@ -285,264 +759,3311 @@ bool ZstdDecompress(
 
 
 //------------------------------------------------------------------------------
-// DepthCompressor
+// Zstd Level Control
 
-void DepthCompressor::Compress(
-    const VideoParameters& params,
-    const uint16_t* unquantized_depth,
-    std::vector<uint8_t>& compressed,
-    bool keyframe)
+ZstdLevelController::ZstdLevelController()
 {
-    // Enforce keyframe if we have not compressed anything yet
-    if (FrameCount == 0) {
-        keyframe = true;
+    for (int i = 0; i < kLevelCount; ++i) {
+        UsecPerByte[i] = 0.f;
     }
+}
 
-    DepthHeader header;
-    header.Magic = kDepthFormatMagic;
-    header.Flags = 0;
-    if (keyframe) {
-        header.Flags |= DepthFlags_Keyframe;
+int ZstdLevelController::ChooseLevel(int budget_usec, int bytes) const
+{
+    const float target_usec = budget_usec * kZstdBudgetHeadroom;
+
+    // Until something has been measured, start from the default level
+    int highest_measured = -1;
+    for (int i = 0; i < kLevelCount; ++i) {
+        if (UsecPerByte[i] > 0.f) {
+            highest_measured = i;
+        }
     }
-    if (params.Type == VideoType::H265) {
-        header.Flags |= DepthFlags_HEVC;
+    if (highest_measured < 0) {
+        return kZstdLevel;
     }
-    header.Width = static_cast<uint16_t>( params.Width );
-    header.Height = static_cast<uint16_t>( params.Height );
-    const int n = params.Width * params.Height;
-    
-    
-    header.FrameNumber = static_cast<uint16_t>( FrameCount );
-    ++FrameCount;
-    
-
-    QuantizeDepthImage(n, unquantized_depth, QuantizedDepth);
-    RescaleImage_11Bits(QuantizedDepth, header.MinimumDepth, header.MaximumDepth);
-    Filter(QuantizedDepth);
-
-    Codec.EncodeBegin(
-        params,
-        keyframe,
-        Low,
-        LowOut);
-
-    // Interleave Zstd compression with video encoder work.
-    // Only saves about 400 microseconds from a 5000 microsecond encode.
-    ZstdCompress(High, HighOut);
-    header.HighUncompressedBytes = static_cast<uint32_t>( High.size() );
-    header.HighCompressedBytes = static_cast<uint32_t>( HighOut.size() );
 
-    Codec.EncodeFinish(LowOut);
-    header.LowCompressedBytes = static_cast<uint32_t>( LowOut.size() );
-
-    // Calculate output size
-    size_t total_size = kDepthHeaderBytes + HighOut.size() + LowOut.size();
-    compressed.resize(total_size);
-    uint8_t* copy_dest = compressed.data();
+    // Explore at most one level above what has been measured
+    int i = highest_measured + 1;
+    if (i >= kLevelCount) {
+        i = kLevelCount - 1;
+    }
 
-    // Write header
-    memcpy(copy_dest, &header, kDepthHeaderBytes);
-    copy_dest += kDepthHeaderBytes;
+    for (; i > 0; --i) {
+        const unsigned predicted = PredictUsec(i + kZstdMinLevel, bytes);
+        if (predicted > 0 && predicted <= target_usec) {
+            break;
+        }
+    }
+    return i + kZstdMinLevel;
+}
 
-    // Concatenate the compressed data
-    memcpy(copy_dest, HighOut.data(), HighOut.size());
-    copy_dest += HighOut.size();
-    memcpy(copy_dest, LowOut.data(), LowOut.size());
+unsigned ZstdLevelController::PredictUsec(int level, int bytes) const
+{
+    const int index = level - kZstdMinLevel;
+    if (index < 0 || index >= kLevelCount) {
+        return 0;
+    }
+    float usec_per_byte = UsecPerByte[index];
+
+    // Extrapolate from the nearest measured level
+    for (int distance = 1; usec_per_byte <= 0.f && distance < kLevelCount; ++distance) {
+        const int below = index - distance;
+        const int above = index + distance;
+        float scale = 1.f;
+        for (int j = 0; j < distance; ++j) {
+            scale *= kZstdLevelSlowdown;
+        }
+        if (below >= 0 && UsecPerByte[below] > 0.f) {
+            usec_per_byte = UsecPerByte[below] * scale;
+        } else if (above < kLevelCount && UsecPerByte[above] > 0.f) {
+            usec_per_byte = UsecPerByte[above] / scale;
+        }
+    }
+    if (usec_per_byte <= 0.f) {
+        return 0;
+    }
+    return static_cast<unsigned>( usec_per_byte * bytes ) + 1;
 }
 
-DepthResult DepthCompressor::Decompress(
-    const std::vector<uint8_t>& compressed,
-    int& width,
-    int& height,
-    std::vector<uint16_t>& depth_out)
+void ZstdLevelController::Update(int level, int bytes, unsigned usec)
 {
-    if (compressed.size() < kDepthHeaderBytes) {
-        return DepthResult::FileTruncated;
+    const int index = level - kZstdMinLevel;
+    if (index < 0 || index >= kLevelCount || bytes <= 0) {
+        return;
     }
-    const uint8_t* src = compressed.data();
+    const float measured = usec / static_cast<float>( bytes );
 
-    const DepthHeader* header = reinterpret_cast<const DepthHeader*>( src );
-    if (header->Magic != kDepthFormatMagic) {
-        return DepthResult::WrongFormat;
+    const float old_estimate = UsecPerByte[index];
+    if (old_estimate <= 0.f) {
+        UsecPerByte[index] = measured;
+        return;
     }
-    const bool keyframe = (header->Flags & DepthFlags_Keyframe) != 0;
-    VideoType video_codec_type = VideoType::H264;
-    if ((header->Flags & DepthFlags_HEVC) != 0) {
-        video_codec_type = VideoType::H265;
+    const float new_estimate = old_estimate + (measured - old_estimate) * kZstdTimingAlpha;
+    UsecPerByte[index] = new_estimate;
+
+    // Apply the same change in host load to the other levels
+    const float scale = new_estimate / old_estimate;
+    for (int i = 0; i < kLevelCount; ++i) {
+        if (i != index) {
+            UsecPerByte[i] *= scale;
+        }
     }
-    const unsigned frame_number = header->FrameNumber;
+}
 
-    // We can only start decoding on a keyframe because these contain SPS/PPS.
-    
+
+//------------------------------------------------------------------------------
+// Rate Control
+
+RateController::RateController()
+{
+    for (int kind = 0; kind < 2; ++kind) {
+        OtherBytes[kind] = 0.f;
+        for (int type = 0; type < kVideoTypeCount; ++type) {
+            Complexity[type][kind] = 0.f;
+        }
+    }
+    for (int type = 0; type < kVideoTypeCount; ++type) {
+        LastStep[type] = 0.f;
+    }
+}
+
+void RateController::Configure(int bitrate, int fps, int buffer_msec)
+{
+    if (fps <= 0) {
+        fps = 30;
+    }
+    if (bitrate == Bitrate && fps == Fps && buffer_msec == BufferMsec) {
+        return;
+    }
+    Bitrate = bitrate;
+    Fps = fps;
+    BufferMsec = buffer_msec;
+
+    FrameBytes = bitrate / 8.f / fps;
+
+    // The buffer must hold at least two average frames
+    BufferSize = bitrate / 8.f * buffer_msec / 1000.f;
+    if (BufferSize < FrameBytes * 2.f) {
+        BufferSize = FrameBytes * 2.f;
+    }
+
+    // Start half full, where the controller aims to keep it
+    BufferBytes = BufferSize * 0.5f;
+    Debt = 0.f;
+    DebtRepay = 0.f;
+    KeyframeDebt = 0.f;
+    KeyframeRepay = 0.f;
+
+    History.clear();
+    HistoryIndex = 0;
+    HistorySum = 0;
+    AchievedBitrate = 0.f;
+}
+
+float RateController::GetComplexity(VideoType type, int kind, int pixels) const
+{
+    const float complexity = Complexity[static_cast<int>( type )][kind];
+    if (complexity > 0.f) {
+        return complexity;
+    }
+
+    // Keyframes are harder to code than P-frames, so until the first P-frame
+    // is measured the keyframe estimate errs on the small side
+    const float other_kind = Complexity[static_cast<int>( type )][kind ^ 1];
+    if (other_kind > 0.f) {
+        return other_kind;
+    }
+
+    // Nothing measured yet: Assume a hard scene so the first frame does not
+    // overflow the buffer
+    if (type == VideoType::Dct || type == VideoType::Loco) {
+        return pixels * kRateComplexityPrior;
+    }
+    return 0.f;
+}
+
+unsigned RateController::PlanFrame(bool keyframe, VideoParameters& params)
+{
+    const int kind = keyframe ? 1 : 0;
+    const int pixels = params.Width * params.Height;
+
+    // Bring the buffer back to half full over a few frames, except for the
+    // excess of the last keyframe, which is paid back at a fixed rate
+    float budget = FrameBytes - (BufferBytes - BufferSize * 0.5f - KeyframeDebt) / kRateReactionFrames;
+    budget -= std::min(KeyframeRepay, KeyframeDebt);
+
+    // Pay back bytes that overflowed the buffer over about a second, so the
+    // long-run average converges on the target
+    DebtRepay = Debt / Fps;
+    budget -= DebtRepay;
+    if (keyframe) {
+        budget += FrameBytes * (kRateKeyframeFrames - 1.f);
+    }
+
+    // Do not overflow the buffer
+    const float room = BufferSize - BufferBytes + FrameBytes;
+    if (budget > room) {
+        budget = room;
+    }
+    if (budget < FrameBytes * kRateMinBudget) {
+        budget = FrameBytes * kRateMinBudget;
+    }
+
+    float other_bytes = OtherBytes[kind];
+    if (other_bytes <= 0.f) {
+        other_bytes = OtherBytes[kind ^ 1];
+    }
+    if (other_bytes <= 0.f) {
+        other_bytes = pixels * kRateOtherPrior;
+    }
+    float low_budget = budget - other_bytes;
+    if (low_budget < kRateMinLowBytes) {
+        low_budget = kRateMinLowBytes;
+    }
+
+    // H.264/H.265: C is the ratio of the Low bytes to the bytes requested
+    const VideoType nvenc_type = (params.Type == VideoType::H265) ? VideoType::H265 : VideoType::H264;
+    float nvenc_ratio = GetComplexity(nvenc_type, kind, pixels);
+    if (nvenc_ratio <= 0.f) {
+        nvenc_ratio = 1.f;
+    }
+    params.Bitrate = static_cast<int>( low_budget / nvenc_ratio * 8.f * Fps );
+
+    params.WaveletFrameBytes = static_cast<int>( low_budget );
+
+    const float dct_complexity = GetComplexity(VideoType::Dct, kind, pixels);
+    if (dct_complexity > 0.f) {
+        const float step = std::pow(dct_complexity / low_budget, 1.f / kRateDctExponent);
+        int quantizer = static_cast<int>( step + 0.5f );
+        // Stay near the step of the last frame, rounded outward so the
+        // quantizer can always move by one.  A keyframe may get as coarse as
+        // its budget needs, and the P-frames after it refine step by step.
+        const float last = LastStep[static_cast<int>( VideoType::Dct )];
+        if (last > 0.f) {
+            const int finest = static_cast<int>( std::floor(last / kRateMaxStepChange) );
+            const int coarsest = static_cast<int>( std::ceil(last * kRateMaxStepChange) );
+            quantizer = std::max(quantizer, finest);
+            if (!keyframe) {
+                quantizer = std::min(quantizer, coarsest);
+            }
+        }
+        if (quantizer < kDctMinQuantizer) {
+            quantizer = kDctMinQuantizer;
+        } else if (quantizer > kDctMaxQuantizer) {
+            quantizer = kDctMaxQuantizer;
+        }
+        params.DctQuantizer = quantizer;
+    }
+
+    const float loco_complexity = GetComplexity(VideoType::Loco, kind, pixels);
+    if (loco_complexity > 0.f) {
+        const float step = std::pow(loco_complexity / low_budget, 1.f / kRateLocoExponent);
+        int near = static_cast<int>( (step - 1.f) * 0.5f + 0.5f );
+        const float last = LastStep[static_cast<int>( VideoType::Loco )];
+        if (last > 0.f) {
+            const int finest = static_cast<int>( std::floor((last / kRateMaxStepChange - 1.f) * 0.5f) );
+            const int coarsest = static_cast<int>( std::ceil((last * kRateMaxStepChange - 1.f) * 0.5f) );
+            near = std::max(near, finest);
+            if (!keyframe) {
+                near = std::min(near, coarsest);
+            }
+        }
+        if (near < 0) {
+            near = 0;
+        } else if (near > kRateMaxLocoNear) {
+            near = kRateMaxLocoNear;
+        }
+        params.LocoNear = near;
+    }
+
+    return static_cast<unsigned>( budget );
+}
+
+void RateController::Update(
+    bool keyframe,
+    VideoType low_type,
+    const VideoParameters& params,
+    unsigned frame_bytes,
+    unsigned low_bytes)
+{
+    const int kind = keyframe ? 1 : 0;
+
+    // The excess of an overflowing frame is not kept in the buffer, or one
+    // hard scene would starve the next few frames.  It is a debt paid back
+    // over about a second instead.
+    Debt -= DebtRepay;
+    if (Debt < 0.f) {
+        Debt = 0.f;
+    }
+    DebtRepay = 0.f;
+    BufferBytes += frame_bytes - FrameBytes;
+    if (BufferBytes < 0.f) {
+        BufferBytes = 0.f;
+    } else if (BufferBytes > BufferSize) {
+        Debt += BufferBytes - BufferSize;
+        BufferBytes = BufferSize;
+    }
+
+    // What a keyframe leaves above half full is paid back over several
+    // frames.  Frames that come in under budget pay it back early.
+    if (keyframe) {
+        KeyframeDebt = BufferBytes - BufferSize * 0.5f;
+        KeyframeRepay = KeyframeDebt / kRateKeyframeRepayFrames;
+    } else {
+        KeyframeDebt -= KeyframeRepay;
+    }
+    if (KeyframeDebt > BufferBytes - BufferSize * 0.5f) {
+        KeyframeDebt = BufferBytes - BufferSize * 0.5f;
+    }
+    if (KeyframeDebt <= 0.f) {
+        KeyframeDebt = 0.f;
+        KeyframeRepay = 0.f;
+    }
+
+    // Average over the last second of frames
+    if (static_cast<int>( History.size() ) < Fps) {
+        History.push_back(frame_bytes);
+    } else {
+        HistorySum -= History[HistoryIndex];
+        History[HistoryIndex] = frame_bytes;
+        HistoryIndex = (HistoryIndex + 1) % Fps;
+    }
+    HistorySum += frame_bytes;
+    AchievedBitrate = HistorySum * 8.f * Fps / History.size();
+
+    if (low_bytes == 0) {
+        return;
+    }
+    OtherBytes[kind] = static_cast<float>( frame_bytes - low_bytes );
+
+    float complexity = 0.f;
+    switch (low_type)
+    {
+    case VideoType::H264:
+    case VideoType::H265:
+        if (params.Bitrate > 0) {
+            complexity = low_bytes / (params.Bitrate / 8.f / Fps);
+        }
+        break;
+    case VideoType::Dct:
+        LastStep[static_cast<int>( low_type )] = static_cast<float>( params.DctQuantizer );
+        complexity = low_bytes * std::pow(static_cast<float>( params.DctQuantizer ), kRateDctExponent);
+        break;
+    case VideoType::Loco:
+        LastStep[static_cast<int>( low_type )] = static_cast<float>( params.LocoNear * 2 + 1 );
+        complexity = low_bytes * std::pow(static_cast<float>( params.LocoNear * 2 + 1 ), kRateLocoExponent);
+        break;
+    default:
+        // Wavelet frames are cut to the budget
+        break;
+    }
+    if (complexity <= 0.f) {
+        return;
+    }
+
+    float& estimate = Complexity[static_cast<int>( low_type )][kind];
+    if (estimate <= 0.f) {
+        estimate = complexity;
+    } else {
+        estimate += (complexity - estimate) * kRateComplexityAlpha;
+    }
+}
+
+
+//------------------------------------------------------------------------------
+// DepthEncoder
+
+// Defined with the High tiles below
+static size_t GetHighBound(int width, int height, int tile_rows);
+
+// Returns true if frames of this video type can reference the previous one
+static bool HasPFrames(VideoType type)
+{
+    return type == VideoType::H264 ||
+        type == VideoType::H265 ||
+        type == VideoType::Dct;
+}
+
+void DepthEncoder::Compress(
+    const VideoParameters& params,
+    const uint16_t* unquantized_depth,
+    std::vector<uint8_t>& compressed,
+    bool keyframe)
+{
+    Compress(params, unquantized_depth, nullptr, compressed, keyframe);
+}
+
+void DepthEncoder::Compress(
+    const VideoParameters& params,
+    const uint16_t* unquantized_depth,
+    const uint8_t* importance,
+    std::vector<uint8_t>& compressed,
+    bool keyframe)
+{
+    const uint64_t t0 = GetTimeUsec();
+
+    // Enforce keyframe if we have not compressed anything yet
+    if (FrameCount == 0) {
+        keyframe = true;
+    }
+
+    DepthHeader header;
+    header.Magic = kDepthFormatMagic;
+    header.Flags = 0;
+    if (keyframe) {
+        header.Flags |= DepthFlags_Keyframe;
+    }
+    header.Flags |= DepthFlags_LowCodec;
+    header.LowCodec = static_cast<uint8_t>( params.Type );
+    header.ResidualLayers = 0;
+    const int tile_rows = Settings.HighTileRows;
+    if (tile_rows > 0) {
+        header.Flags |= DepthFlags_Tiled;
+    }
+    header.Width = static_cast<uint16_t>( params.Width );
+    header.Height = static_cast<uint16_t>( params.Height );
+    const int n = params.Width * params.Height;
+    Stats.Lossless = false;
+    Stats.LosslessBytes = 0;
+    Stats.Candidate = -1;
+    Stats.CandidatesStarted = 0;
+    Stats.CandidatesFinished = 0;
+    Stats.CandidateWaitUsec = 0;
+    
+    
+    header.FrameNumber = static_cast<uint16_t>( FrameCount );
+    ++FrameCount;
+    
+
+    QuantizeDepthImage(n, unquantized_depth, QuantizedDepth);
+
+    // Rate control overrides the quality parameters of the video encoder
+    VideoParameters low_params = params;
+    const bool coarsen = Settings.WholeValue ||
+        params.Type == VideoType::Loco;
+    low_params.Importance = ApplyImportance(
+        params.Width,
+        params.Height,
+        unquantized_depth,
+        importance,
+        coarsen);
+    Stats.RateBudgetBytes = 0;
+    if (HasRateControl()) {
+        RateControl.Configure(Settings.TargetBitrate, params.Fps, Settings.RateBufferMsec);
+        Stats.RateBudgetBytes = RateControl.PlanFrame(keyframe, low_params);
+    }
+
+    if (Settings.Replenish)
+    {
+        if (!keyframe && CompressReplenish(header, compressed)) {
+            UpdateRateControl(false, params.Type, low_params, compressed.size(), 0);
+            Stats.TotalUsec = static_cast<unsigned>( GetTimeUsec() - t0 );
+            return;
+        }
+
+        // The decoder will have this frame up to the Low bits error
+        ReplenishReference = QuantizedDepth;
+        ReplenishWidth = params.Width;
+        ReplenishHeight = params.Height;
+    }
+    Stats.ReplenishBlocks = 0;
+
+    // The lossless candidate codes the depth before rescaling
+    if (Settings.LosslessFallback) {
+        CompressLossless(params.Width, params.Height);
+    }
+
+    RescaleImage_11Bits(QuantizedDepth, header.MinimumDepth, header.MaximumDepth);
+
+    if (Settings.WholeValue) {
+        CompressWholeValue(header, low_params.LocoNear, compressed);
+        const float compare_bytes = static_cast<float>( compressed.size() );
+        if (Settings.LosslessFallback && ChooseLossless(header, compare_bytes, VideoType::Loco, compressed)) {
+            header.LowCompressedBytes = 0;
+        }
+        UpdateRateControl(keyframe, VideoType::Loco, low_params, compressed.size(), header.LowCompressedBytes);
+        Stats.TotalUsec = static_cast<unsigned>( GetTimeUsec() - t0 );
+        return;
+    }
+
+    // The video decoder missed the frame the video encoder coded before the
+    // last lossless frame, so it needs a keyframe to resynchronize
+    const bool forced_keyframe = LowKeyframeNeeded && !keyframe;
+    if (forced_keyframe) {
+        keyframe = true;
+        header.Flags |= DepthFlags_Keyframe;
+    }
+
+    Filter(QuantizedDepth, Codec.GetInputLayout(low_params));
+
+    Codec.EncodeBegin(
+        low_params,
+        keyframe,
+        Low,
+        LowOut);
+
+    // Candidates start after the video encoder so they queue behind it
+    const bool candidates = !Settings.CandidateNears.empty();
+    if (candidates) {
+        StartCandidates(params.Width, params.Height);
+    }
+
+    // A new backend or a fallback codes a keyframe even if none was
+    // requested, so the rest of the frame must not reference the previous
+    // one either
+    if (!keyframe && Codec.GetEncodedKeyframe()) {
+        keyframe = true;
+        header.Flags |= DepthFlags_Keyframe;
+    }
+
+    // Interleave Zstd compression with video encoder work.
+    // Only saves about 400 microseconds from a 5000 microsecond encode.
+    // Large High planes also spread the Zstd work across worker threads
+    // while the video encoder runs.
+    const int high_bytes = static_cast<int>( High.size() );
+    const int level = ChooseZstdLevel(high_bytes);
+    const unsigned predicted_usec = LevelController.PredictUsec(level, high_bytes);
+    const uint64_t t1 = GetTimeUsec();
+    const int compressed_bytes = CompressHigh(
+        params.Width,
+        params.Height,
+        tile_rows,
+        level,
+        keyframe);
+    const unsigned high_usec = static_cast<unsigned>( GetTimeUsec() - t1 );
+    if (compressed_bytes > 0) {
+        LevelController.Update(level, compressed_bytes, high_usec);
+    }
+
+    // The codec drops a backend that fails, so the frame is coded again as
+    // a keyframe by the next one until none is left
+    bool low_success = Codec.EncodeFinish(LowOut);
+    bool low_retried = false;
+    while (!low_success && Codec.EncodeBegin(low_params, true, Low, LowOut)) {
+        low_success = Codec.EncodeFinish(LowOut);
+        low_retried = true;
+    }
+    if (low_success && low_retried && !keyframe) {
+        keyframe = true;
+        header.Flags |= DepthFlags_Keyframe;
+
+        // The High section may repeat parts of the previous frame
+        if (Settings.HighSkipUnchanged) {
+            CompressHigh(params.Width, params.Height, tile_rows, level, true);
+        }
+    }
+    if (!low_success) {
+        if (candidates) {
+            CancelCandidates();
+        }
+        compressed.clear();
+        FrameDestBytes = 0;
+        Stats.TotalUsec = static_cast<unsigned>( GetTimeUsec() - t0 );
+        return;
+    }
+
+    // The codec may have fallen back to another type if the requested one
+    // is not available on this machine
+    const VideoType low_type = Codec.GetEncodedType();
+    if (keyframe) {
+        LowKeyframeNeeded = false;
+    }
+    header.LowCodec = static_cast<uint8_t>( low_type );
+
+    // The HEVC flag is still set so older decoders can read H.265 files
+    if (low_type == VideoType::H265) {
+        header.Flags |= DepthFlags_HEVC;
+    }
+
+    header.HighUncompressedBytes = static_cast<uint32_t>( High.size() );
+    const size_t high_size = HighDirectBytes > 0 ? HighDirectBytes : HighOut.size();
+    header.HighCompressedBytes = static_cast<uint32_t>( high_size );
+    header.LowCompressedBytes = static_cast<uint32_t>( LowOut.size() );
+
+    ResidualOut.clear();
+    LowDecoded.clear();
+    Stats.ResidualCount = 0;
+    if (HasResidual()) {
+        CompressResidual(header, low_type);
+    }
+
+    // Candidates are only compared by error if there is an error budget
+    float max_error = 0.f, rmse = 0.f;
+    bool measured = false;
+    if (candidates && (Settings.CandidateMaxError > 0 || Settings.CandidateMaxRmse > 0.f)) {
+        measured = MeasureLowError(params.Width, params.Height, low_type, max_error, rmse);
+    }
+
+    // Calculate output size
+    size_t total_size = kDepthHeaderBytes + high_size + LowOut.size() + ResidualOut.size();
+
+    // Write into the caller's buffer if it fits, where the High section may
+    // already be.  Otherwise the frame goes in the vector.
+    uint8_t* frame = nullptr;
+    if (FrameDest != nullptr && total_size <= FrameCapacity) {
+        frame = FrameDest;
+        FrameDestBytes = total_size;
+    } else {
+        compressed.resize(total_size);
+        frame = compressed.data();
+    }
+    uint8_t* copy_dest = frame + kDepthHeaderBytes;
+
+    // Concatenate the compressed data
+    if (HighDirectBytes == 0) {
+        memcpy(copy_dest, HighOut.data(), HighOut.size());
+    } else if (frame != FrameDest) {
+        memcpy(copy_dest, FrameDest + kDepthHeaderBytes, HighDirectBytes);
+    }
+    copy_dest += high_size;
+    memcpy(copy_dest, LowOut.data(), LowOut.size());
+    if (!ResidualOut.empty()) {
+        copy_dest += LowOut.size();
+        memcpy(copy_dest, ResidualOut.data(), ResidualOut.size());
+    }
+
+    // Write header last
+    memcpy(frame, &header, kDepthHeaderBytes);
+
+    Stats.ZstdLevel = level;
+    Stats.HighPredictedUsec = predicted_usec;
+    Stats.HighUsec = high_usec;
+    Stats.HighBytes = header.HighCompressedBytes;
+    Stats.LowBytes = header.LowCompressedBytes;
+    Stats.ResidualBytes = static_cast<unsigned>( ResidualOut.size() );
+
+    // Other frames replace this one if they are smaller.  Keyframes that
+    // were only forced by an earlier replaced frame are compared with the
+    // size of a typical P-frame, and sent until that is known (compare_bytes
+    // is 0) unless they are over the candidate error budget.
+    float compare_bytes = static_cast<float>( total_size );
+    if (!keyframe) {
+        if (LossyPFrameBytes <= 0.f) {
+            LossyPFrameBytes = compare_bytes;
+        } else {
+            LossyPFrameBytes += (compare_bytes - LossyPFrameBytes) * kLossyEstimateAlpha;
+        }
+    } else if (forced_keyframe) {
+        compare_bytes = LossyPFrameBytes;
+    }
+
+    unsigned low_bytes = header.LowCompressedBytes;
+    if (candidates &&
+        FinishCandidates(header, low_type, compare_bytes, measured, max_error, rmse, compressed))
+    {
+        FrameDestBytes = 0;
+        total_size = compressed.size();
+        compare_bytes = static_cast<float>( total_size );
+        low_bytes = 0;
+    }
+    if (Settings.LosslessFallback && compare_bytes > 0.f &&
+        ChooseLossless(header, compare_bytes, low_type, compressed))
+    {
+        FrameDestBytes = 0;
+        total_size = compressed.size();
+        low_bytes = 0;
+    }
+    UpdateRateControl(keyframe, low_type, low_params, total_size, low_bytes);
+    Stats.TotalUsec = static_cast<unsigned>( GetTimeUsec() - t0 );
+}
+
+size_t DepthEncoder::Compress(
+    const VideoParameters& params,
+    const uint16_t* unquantized_depth,
+    uint8_t* compressed,
+    size_t capacity,
+    bool keyframe)
+{
+    return Compress(params, unquantized_depth, nullptr, compressed, capacity, keyframe);
+}
+
+size_t DepthEncoder::Compress(
+    const VideoParameters& params,
+    const uint16_t* unquantized_depth,
+    const uint8_t* importance,
+    uint8_t* compressed,
+    size_t capacity,
+    bool keyframe)
+{
+    FrameDest = compressed;
+    FrameCapacity = capacity;
+    FrameDestBytes = 0;
+    Compress(params, unquantized_depth, importance, FrameSpill, keyframe);
+    FrameDest = nullptr;
+    FrameCapacity = 0;
+    if (FrameDestBytes > 0) {
+        return FrameDestBytes;
+    }
+
+    // Replenishment, whole-value, lossless and candidate frames and frames
+    // that did not fit are built in the vector
+    const size_t bytes = FrameSpill.size();
+    if (bytes > capacity) {
+        return 0;
+    }
+    memcpy(compressed, FrameSpill.data(), bytes);
+    return bytes;
+}
+
+size_t DepthEncoder::CompressBound(const VideoParameters& params) const
+{
+    const size_t n = static_cast<size_t>( params.Width ) * params.Height;
+
+    // Each frame takes exactly one of the paths below, so the bound is the
+    // largest of them rather than their sum.  Whole-value mode never sends
+    // High and Low sections.
+    size_t bound = 0;
+    if (!Settings.WholeValue) {
+        bound = GetHighBound(params.Width, params.Height, Settings.HighTileRows) +
+            GetVideoCompressBound(params);
+    }
+    if (!Settings.WholeValue && HasResidual()) {
+        // Each pixel is corrected by at most one layer with a delta of up to
+        // 2 bytes and a skip of 1 byte, plus a byte for every 128 skipped
+        // pixels.  Each layer adds two sizes and the overhead of a Zstd frame.
+        int layer_count = 1;
+        if (!Settings.LayerBounds.empty()) {
+            layer_count = std::min(static_cast<int>( Settings.LayerBounds.size() ), kMaxDepthLayers);
+        }
+        bound += ZSTD_compressBound(n * 3 + n / 64 + 16) +
+            layer_count * (2 * sizeof(uint32_t) + ZSTD_compressBound(0) + 1);
+    }
+
+    // Replenishment sends a skip map of less than one bit per pixel and
+    // two bytes for each changed value
+    if (Settings.Replenish) {
+        bound = std::max(bound, ZSTD_compressBound(n / 8 + 1 + n * 2));
+    }
+
+    // Whole-value frames and candidates send a bit mask and the values
+    if (Settings.WholeValue || !Settings.CandidateNears.empty()) {
+        const size_t whole_value = ZSTD_compressBound((n + 7) / 8) +
+            LocoCompressBound(params.Width, params.Height, kWholeValueMax);
+        bound = std::max(bound, whole_value);
+    }
+
+    // Lossless frames send runs of at most two bytes per pixel, plus the
+    // values in two bytes each
+    if (Settings.LosslessFallback) {
+        bound = std::max(bound, ZSTD_compressBound(n * 4 + 16));
+    }
+
+    return kDepthHeaderBytes + bound;
+}
+
+int DepthEncoder::ChooseZstdLevel(int bytes) const
+{
+    if (Settings.HighBudgetUsec > 0) {
+        return LevelController.ChooseLevel(Settings.HighBudgetUsec, bytes);
+    }
+    if (HasRateControl() && RateControl.IsOverTarget()) {
+        return kRateZstdLevel;
+    }
+    return kZstdLevel;
+}
+
+bool DepthEncoder::HasRateControl() const
+{
+    return Settings.TargetBitrate > 0 && !HasResidual();
+}
+
+void DepthEncoder::UpdateRateControl(
+    bool keyframe,
+    VideoType low_type,
+    const VideoParameters& low_params,
+    size_t frame_bytes,
+    unsigned low_bytes)
+{
+    if (!HasRateControl()) {
+        Stats.RateBufferBytes = 0;
+        Stats.AchievedBitrate = 0;
+        return;
+    }
+
+    RateControl.Update(
+        keyframe,
+        low_type,
+        low_params,
+        static_cast<unsigned>( frame_bytes ),
+        low_bytes);
+
+    Stats.RateBufferBytes = RateControl.GetBufferBytes();
+    Stats.AchievedBitrate = RateControl.GetAchievedBitrate();
+}
+
+
+//------------------------------------------------------------------------------
+// DepthDecoder
+
+DepthResult DepthDecoder::Decompress(
+    const std::vector<uint8_t>& compressed,
+    int& width,
+    int& height,
+    std::vector<uint16_t>& depth_out)
+{
+    return Decompress(
+        compressed.data(),
+        compressed.size(),
+        width,
+        height,
+        depth_out);
+}
+
+DepthResult DepthDecoder::Decompress(
+    const uint8_t* data,
+    size_t bytes,
+    int& width,
+    int& height,
+    std::vector<uint16_t>& depth_out)
+{
+    return DecompressRows(
+        data,
+        bytes,
+        0,
+        kMaxDimension,
+        width,
+        height,
+        depth_out);
+}
+
+DepthResult DepthDecoder::DecompressRows(
+    const std::vector<uint8_t>& compressed,
+    int first_row,
+    int row_count,
+    int& width,
+    int& height,
+    std::vector<uint16_t>& depth_out)
+{
+    return DecompressRows(
+        compressed.data(),
+        compressed.size(),
+        first_row,
+        row_count,
+        width,
+        height,
+        depth_out);
+}
+
+DepthResult DepthDecoder::Decompress(
+    const uint8_t* data,
+    size_t bytes,
+    const DepthOutput& output,
+    int& width,
+    int& height)
+{
+    // The image size is needed to check the rectangle
+    DepthFrameView frame;
+    const DepthResult parse_result = frame.Parse(data, bytes);
+    if (parse_result != DepthResult::Success) {
+        return parse_result;
+    }
+    const int image_width = frame.Header->Width;
+    const int image_height = frame.Header->Height;
+
+    DepthOutput rect = output;
+    if (rect.Width == 0) {
+        rect.Width = image_width - rect.X;
+    }
+    if (rect.Height == 0) {
+        rect.Height = image_height - rect.Y;
+    }
+    if (!rect.Depth ||
+        rect.X < 0 || rect.Width < 1 || rect.Width > image_width - rect.X ||
+        rect.Y < 0 || rect.Height < 1 || rect.Height > image_height - rect.Y ||
+        (rect.RowStride & 1) != 0 || rect.RowStride < rect.Width * sizeof(uint16_t))
+    {
+        return DepthResult::Corrupted;
+    }
+
+    if (!Scratch) {
+        Scratch = std::make_shared<DepthDecoderScratch>();
+    }
+    return DecodeFrame(
+        data,
+        bytes,
+        rect.Y,
+        rect.Height,
+        1,
+        &rect,
+        width,
+        height,
+        Scratch->OutputRows);
+}
+
+DepthResult DepthDecoder::DecompressRows(
+    const uint8_t* data,
+    size_t bytes,
+    int first_row,
+    int row_count,
+    int& width,
+    int& height,
+    std::vector<uint16_t>& depth_out)
+{
+    return DecodeFrame(
+        data,
+        bytes,
+        first_row,
+        row_count,
+        1,
+        nullptr,
+        width,
+        height,
+        depth_out);
+}
+
+DepthResult DepthDecoder::DecompressPreview(
+    const std::vector<uint8_t>& compressed,
+    int scale,
+    int& width,
+    int& height,
+    std::vector<uint16_t>& depth_out)
+{
+    return DecompressPreview(
+        compressed.data(),
+        compressed.size(),
+        scale,
+        width,
+        height,
+        depth_out);
+}
+
+DepthResult DepthDecoder::DecompressPreview(
+    const uint8_t* data,
+    size_t bytes,
+    int scale,
+    int& width,
+    int& height,
+    std::vector<uint16_t>& depth_out)
+{
+    if (scale != 1 && scale != 2 && scale != 4 && scale != 8) {
+        return DepthResult::Corrupted;
+    }
+
+    const DepthResult result = DecodeFrame(
+        data,
+        bytes,
+        0,
+        kMaxDimension,
+        scale,
+        nullptr,
+        width,
+        height,
+        depth_out);
+    if (result == DepthResult::Success) {
+        width = (width + scale - 1) / scale;
+        height = (height + scale - 1) / scale;
+    }
+    return result;
+}
+
+// Dequantize decoded rows in place, or into the rectangle of the output
+static void WriteDepth(
+    std::vector<uint16_t>& depth,
+    int width,
+    const DepthOutput* output)
+{
+    if (!output) {
+        DequantizeDepthImage(depth);
+        return;
+    }
+
+    const int row_count = static_cast<int>( depth.size() ) / width;
+    const int count = std::min(output->Width, width - output->X);
+    uint8_t* dest_row = reinterpret_cast<uint8_t*>( output->Depth );
+
+#ifdef DEPTH_ENABLE_SSE2
+    // Upload memory is often write-combined, where streaming whole aligned
+    // vectors avoids reading it back
+    const bool stream = output->Alignment >= 16 &&
+        (reinterpret_cast<uintptr_t>( dest_row ) & 15) == 0 &&
+        (output->RowStride & 15) == 0;
+#endif // DEPTH_ENABLE_SSE2
+
+    for (int y = 0; y < row_count; ++y, dest_row += output->RowStride)
+    {
+        const uint16_t* src = depth.data() + y * width + output->X;
+        uint16_t* dest = reinterpret_cast<uint16_t*>( dest_row );
+        int i = 0;
+
+#ifdef DEPTH_ENABLE_SSE2
+        if (stream) {
+            for (; i + 8 <= count; i += 8) {
+                uint16_t values[8];
+                for (int j = 0; j < 8; ++j) {
+                    values[j] = AzureKinectDequantizeDepth(src[i + j]);
+                }
+                _mm_stream_si128(
+                    reinterpret_cast<__m128i*>( dest + i ),
+                    _mm_loadu_si128(reinterpret_cast<const __m128i*>( values )));
+            }
+        }
+#endif // DEPTH_ENABLE_SSE2
+
+        for (; i < count; ++i) {
+            dest[i] = AzureKinectDequantizeDepth(src[i]);
+        }
+    }
+
+#ifdef DEPTH_ENABLE_SSE2
+    if (stream) {
+        _mm_sfence();
+    }
+#endif // DEPTH_ENABLE_SSE2
+}
+
+// Keep every scale-th pixel of every scale-th row, in place
+static void SubsampleImage(
+    std::vector<uint16_t>& image,
+    int width,
+    int height,
+    int scale)
+{
+    const int preview_width = (width + scale - 1) / scale;
+    const int preview_height = (height + scale - 1) / scale;
+    uint16_t* dest = image.data();
+    for (int y = 0; y < height; y += scale) {
+        const uint16_t* row = image.data() + y * width;
+        for (int x = 0; x < width; x += scale) {
+            *dest++ = row[x];
+        }
+    }
+    image.resize(preview_width * preview_height);
+}
+
+DepthResult DepthDecoder::DecodeFrame(
+    const uint8_t* data,
+    size_t bytes,
+    int first_row,
+    int row_count,
+    int preview_scale,
+    const DepthOutput* output,
+    int& width,
+    int& height,
+    std::vector<uint16_t>& depth_out)
+{
+    DepthFrameView frame;
+    const DepthResult parse_result = frame.Parse(data, bytes);
+    if (parse_result != DepthResult::Success) {
+        return parse_result;
+    }
+    if (!Scratch) {
+        Scratch = std::make_shared<DepthDecoderScratch>();
+    }
+    const DepthHeader* header = frame.Header;
+    const bool keyframe = (header->Flags & DepthFlags_Keyframe) != 0;
+    const bool replenish = (header->Flags & DepthFlags_Replenish) != 0;
+    const bool whole_value = (header->Flags & DepthFlags_WholeValue) != 0;
+    const bool lossless = (header->Flags & DepthFlags_Lossless) != 0;
+    const VideoType video_codec_type = frame.LowType;
+    const unsigned frame_number = header->FrameNumber;
+
+    // We can only start decoding on a keyframe because these contain SPS/PPS.
+    
 
     if (!keyframe && FrameCount == 0) {
         return DepthResult::MissingFrame;
-        
+        
+    }
+    ++FrameCount;
+
+    // P-frames of the video decoder reference the previous frame, so they
+    // cannot be decoded after a gap.  The other frame kinds check their own
+    // references below.
+    const bool p_frame = !keyframe && !replenish && !lossless && !whole_value &&
+        HasPFrames(video_codec_type);
+    if (p_frame &&
+        (!LastFrameValid || frame_number != static_cast<uint16_t>( LastFrame + 1 )))
+    {
+        return DepthResult::MissingFrame;
+    }
+
+    width = header->Width;
+    height = header->Height;
+    if (first_row < 0 || first_row >= height || row_count < 1) {
+        return DepthResult::Corrupted;
+    }
+    LastFrame = static_cast<uint16_t>( frame_number );
+    LastFrameValid = false;
+    if (row_count > height - first_row) {
+        row_count = height - first_row;
+    }
+
+    if (replenish)
+    {
+        if (keyframe || header->LowCompressedBytes != 0) {
+            return DepthResult::Corrupted;
+        }
+
+        const DepthResult result = DecompressReplenish(*header, frame.High);
+        if (result != DepthResult::Success) {
+            return result;
+        }
+
+        depth_out.assign(
+            ReplenishReference.begin() + first_row * width,
+            ReplenishReference.begin() + (first_row + row_count) * width);
+        if (preview_scale > 1) {
+            SubsampleImage(depth_out, width, height, preview_scale);
+        }
+        WriteDepth(depth_out, width, output);
+        LastFrameValid = true;
+        return DepthResult::Success;
+    }
+
+    if (lossless || whole_value)
+    {
+        DepthResult result;
+        if (lossless) {
+            if (header->LowCompressedBytes != 0) {
+                return DepthResult::Corrupted;
+            }
+            result = DecompressLossless(
+                *header,
+                frame.High,
+                depth_out);
+        } else {
+            result = DecompressWholeValue(
+                *header,
+                frame.High,
+                depth_out);
+        }
+        if (result != DepthResult::Success) {
+            return result;
+        }
+
+        // Keep the whole frame for any conditional replenishment that follows
+        ReplenishReference = depth_out;
+        ReplenishWidth = width;
+        ReplenishHeight = height;
+        ReplenishFrame = header->FrameNumber;
+
+        if (row_count != height) {
+            depth_out.assign(
+                ReplenishReference.begin() + first_row * width,
+                ReplenishReference.begin() + (first_row + row_count) * width);
+        }
+        if (preview_scale > 1) {
+            SubsampleImage(depth_out, width, height, preview_scale);
+        }
+        WriteDepth(depth_out, width, output);
+        LastFrameValid = true;
+        return DepthResult::Success;
+    }
+
+    if (header->HighUncompressedBytes < 2) {
+        return DepthResult::Corrupted;
+    }
+    if (header->HighUncompressedBytes != static_cast<unsigned>( (width * height + 1) / 2 )) {
+        return DepthResult::Corrupted;
+    }
+
+    const bool residual = frame.Residual != nullptr;
+
+    // Decompress high bits
+    const DepthResult high_result = DecompressHigh(*header, frame.High, first_row, row_count);
+    if (high_result != DepthResult::Success) {
+        return high_result;
+    }
+
+    // Previews must decode all of the Low bits of video types with P-frames
+    // to keep their reference frame.  For the others they only decode a
+    // prefix of the embedded Wavelet stream, or skip the LOCO-I Low bits.
+    unsigned low_bytes = header->LowCompressedBytes;
+    const bool full_low = preview_scale <= 1 || HasPFrames(video_codec_type);
+    if (!full_low) {
+        if (video_codec_type == VideoType::Wavelet) {
+            const unsigned prefix_bytes = low_bytes / (preview_scale * preview_scale);
+            low_bytes = std::min(low_bytes, std::max(prefix_bytes, static_cast<unsigned>( kWaveletHeaderBytes )));
+        } else {
+            low_bytes = 0;
+        }
+    }
+
+    if (low_bytes > 0) {
+        const bool success = Codec.Decode(
+            width,
+            height,
+            video_codec_type,
+            frame.Low,
+            low_bytes,
+            Scratch->Low);
+        if (!success) {
+            return DepthResult::Corrupted;
+        }
+    }
+
+    // Residual corrections are for the complete Low bits, and the preview
+    // does not keep a reference for conditional replenishment
+    if (!full_low) {
+        UnfilterPreview(width, height, preview_scale, low_bytes > 0, depth_out);
+        UndoRescaleImage_11Bits(header->MinimumDepth, header->MaximumDepth, depth_out);
+        ReplenishWidth = 0;
+        DequantizeDepthImage(depth_out);
+        LastFrameValid = true;
+        return DepthResult::Success;
+    }
+
+    // Corrections are relative to the unfiltered Low bits, so they cannot
+    // be combined with the filter
+    if (Deblock && !residual &&
+        (video_codec_type == VideoType::H264 ||
+         video_codec_type == VideoType::H265 ||
+         video_codec_type == VideoType::Dct))
+    {
+        DeblockLow(width, first_row, row_count);
+    }
+
+    if (residual) {
+        const DepthResult residual_result = DecompressResidualLayers(*header, frame.Residual, frame.ResidualBytes, width * height);
+        if (residual_result != DepthResult::Success) {
+            return residual_result;
+        }
+    }
+
+    const int begin = first_row * width;
+    Unfilter(begin, begin + row_count * width, depth_out);
+    UndoRescaleImage_11Bits(header->MinimumDepth, header->MaximumDepth, depth_out);
+
+    // Keep the whole frame for any conditional replenishment that follows
+    if (row_count == height) {
+        ReplenishReference = depth_out;
+        ReplenishWidth = width;
+        ReplenishHeight = height;
+        ReplenishFrame = header->FrameNumber;
+    } else {
+        ReplenishWidth = 0;
+    }
+
+    if (preview_scale > 1) {
+        SubsampleImage(depth_out, width, height, preview_scale);
+    }
+    WriteDepth(depth_out, width, output);
+
+    LastFrameValid = true;
+    return DepthResult::Success;
+}
+
+
+//------------------------------------------------------------------------------
+// DepthEncoder : Importance
+
+const uint8_t* DepthEncoder::ApplyImportance(
+    int width,
+    int height,
+    const uint16_t* unquantized_depth,
+    const uint8_t* importance,
+    bool coarsen)
+{
+    const int map_width = (width + 7) / 8;
+    const int map_height = (height + 7) / 8;
+    const uint16_t* quantized = QuantizedDepth.data();
+
+    if (!importance)
+    {
+        if (!Settings.ImportanceFromDepth) {
+            return nullptr;
+        }
+
+        // Find the nearest valid depth in each block
+        std::vector<uint16_t>& nearest = ImportanceNearest;
+        nearest.assign(map_width * map_height, 0xffff);
+        for (int y = 0; y < height; ++y) {
+            uint16_t* block_row = nearest.data() + (y / 8) * map_width;
+            const int offset = y * width;
+            for (int x = 0; x < width; ++x) {
+                if (quantized[offset + x] == 0) {
+                    continue;
+                }
+                uint16_t& block = block_row[x / 8];
+                if (block > unquantized_depth[offset + x]) {
+                    block = unquantized_depth[offset + x];
+                }
+            }
+        }
+
+        const int near_mm = Settings.ImportanceNearMm;
+        const int far_mm = Settings.ImportanceFarMm;
+        ImportanceMap.resize(nearest.size());
+        for (size_t i = 0; i < nearest.size(); ++i) {
+            const int depth = nearest[i];
+            if (depth <= near_mm) {
+                ImportanceMap[i] = 255;
+            } else if (depth >= far_mm || depth == 0xffff) {
+                ImportanceMap[i] = 0;
+            } else {
+                ImportanceMap[i] = static_cast<uint8_t>( 255 * (far_mm - depth) / (far_mm - near_mm) );
+            }
+        }
+        importance = ImportanceMap.data();
+    }
+
+    // Steps in the Low bits cost block-based video codecs more than the
+    // noise they remove, so those only get the importance map
+    const int max_step = Settings.ImportanceMaxStep;
+    if (max_step <= 1 || !coarsen) {
+        return importance;
+    }
+
+    // Round to the nearest multiple of the step for the block, keeping
+    // every pixel with depth within the range of quantized values
+    uint16_t* values = QuantizedDepth.data();
+    for (int y = 0; y < height; ++y) {
+        const uint8_t* block_row = importance + (y / 8) * map_width;
+        uint16_t* row = values + y * width;
+        for (int x0 = 0; x0 < width; x0 += 8) {
+            const int step = 1 + ((255 - block_row[x0 / 8]) * (max_step - 1) + 127) / 255;
+            if (step <= 1) {
+                continue;
+            }
+            const int x1 = std::min(x0 + 8, width);
+            for (int x = x0; x < x1; ++x) {
+                const int value = row[x];
+                if (value == 0) {
+                    continue;
+                }
+                int rounded = (value + step / 2) / step * step;
+                if (rounded > kMaxQuantizedDepth) {
+                    rounded -= step;
+                }
+                if (rounded >= 1) {
+                    row[x] = static_cast<uint16_t>( rounded );
+                }
+            }
+        }
+    }
+
+    return importance;
+}
+
+
+//------------------------------------------------------------------------------
+// High Tiles
+
+// Rows per tile are rounded up to keep pairs of pixels in the same tile
+static int RoundTileRows(int tile_rows, int width)
+{
+    if (tile_rows > 0xfffe) {
+        tile_rows = 0xfffe;
+    }
+    if (width & 1) {
+        tile_rows = (tile_rows + 1) & ~1;
+    }
+    return tile_rows;
+}
+
+// Largest High section for the image size and tile rows
+static size_t GetHighBound(int width, int height, int tile_rows)
+{
+    const int high_bytes = (width * height + 1) / 2;
+    if (tile_rows <= 0) {
+        return ZSTD_compressBound(high_bytes);
+    }
+
+    tile_rows = RoundTileRows(tile_rows, width);
+    const int tile_count = (height + tile_rows - 1) / tile_rows;
+    const int tile_bytes = tile_rows * width / 2;
+    size_t bound = kDepthTileHeaderBytes + tile_count * sizeof(uint32_t);
+    for (int offset = 0; offset < high_bytes; offset += tile_bytes) {
+        bound += ZSTD_compressBound(std::min(tile_bytes, high_bytes - offset));
+    }
+    return bound;
+}
+
+int DepthEncoder::CompressHigh(
+    int width,
+    int height,
+    int tile_rows,
+    int level,
+    bool keyframe)
+{
+    const int high_bytes = static_cast<int>( High.size() );
+
+    // Stripes can only repeat the previous frame if the decoder has it
+    const bool skip_unchanged = Settings.HighSkipUnchanged &&
+        !keyframe &&
+        HighPreviousWidth == width &&
+        HighPrevious.size() == High.size();
+    if (Settings.HighSkipUnchanged) {
+        HighPreviousWidth = width;
+    }
+
+    int compressed_bytes = high_bytes;
+
+    // Compressing into a caller's buffer puts the High section in place
+    // after the header, if it is sure to fit
+    uint8_t* dest = nullptr;
+    HighDirectBytes = 0;
+    if (FrameDest != nullptr && FrameCapacity >= kDepthHeaderBytes + GetHighBound(width, height, tile_rows)) {
+        dest = FrameDest + kDepthHeaderBytes;
+    }
+
+    if (tile_rows <= 0)
+    {
+        HighOut.clear();
+        if (skip_unchanged && memcmp(High.data(), HighPrevious.data(), high_bytes) == 0) {
+            // Empty High section repeats the previous High plane
+            compressed_bytes = 0;
+        } else {
+            const int min_bytes = Settings.ZstdThreadsMinBytes;
+            const bool multithreaded = min_bytes > 0 && high_bytes >= min_bytes;
+            if (!dest) {
+                if (multithreaded) {
+                    ZstdCompressMultithreaded(
+                        High.data(),
+                        high_bytes,
+                        level,
+                        Settings.ZstdThreads,
+                        HighOut);
+                } else {
+                    ZstdCompress(High.data(), high_bytes, level, HighOut);
+                }
+            } else {
+                const size_t capacity = ZSTD_compressBound(high_bytes);
+                if (multithreaded) {
+                    HighDirectBytes = ZstdCompressMultithreaded(
+                        High.data(),
+                        high_bytes,
+                        level,
+                        Settings.ZstdThreads,
+                        dest,
+                        capacity);
+                } else {
+                    HighDirectBytes = ZstdCompress(High.data(), high_bytes, level, dest, capacity);
+                }
+
+                // Zstd never produces an empty frame, so 0 is a failure.
+                // Retry into HighOut rather than leave it empty, since an
+                // empty High section would repeat the previous High plane.
+                if (HighDirectBytes == 0) {
+                    ZstdCompress(High.data(), high_bytes, level, HighOut);
+                }
+            }
+        }
+
+        if (Settings.HighSkipUnchanged) {
+            HighPrevious = High;
+        }
+        return compressed_bytes;
+    }
+
+    tile_rows = RoundTileRows(tile_rows, width);
+    const int tile_count = (height + tile_rows - 1) / tile_rows;
+    const int tile_bytes = tile_rows * width / 2;
+
+    TileOut.resize(tile_count);
+    std::atomic<int> skipped_bytes(0);
+
+    WorkerPool::Shared().ParallelFor(tile_count, [&](int tile) {
+        const int offset = tile * tile_bytes;
+        int bytes = high_bytes - offset;
+        if (bytes > tile_bytes) {
+            bytes = tile_bytes;
+        }
+
+        // Empty tile repeats the same tile of the previous frame
+        if (skip_unchanged &&
+            memcmp(High.data() + offset, HighPrevious.data() + offset, bytes) == 0)
+        {
+            TileOut[tile].clear();
+            skipped_bytes += bytes;
+            return;
+        }
+
+        ZstdCompress(High.data() + offset, bytes, level, TileOut[tile]);
+    });
+
+    compressed_bytes -= skipped_bytes;
+    if (Settings.HighSkipUnchanged) {
+        HighPrevious = High;
+    }
+
+    size_t total_bytes = kDepthTileHeaderBytes + tile_count * sizeof(uint32_t);
+    for (const auto& tile : TileOut) {
+        total_bytes += tile.size();
+    }
+    if (!dest) {
+        HighOut.resize(total_bytes);
+        dest = HighOut.data();
+    } else {
+        HighOut.clear();
+        HighDirectBytes = total_bytes;
+    }
+
+    DepthTileHeader tile_header;
+    tile_header.TileRows = static_cast<uint16_t>( tile_rows );
+    tile_header.TileCount = static_cast<uint16_t>( tile_count );
+    memcpy(dest, &tile_header, kDepthTileHeaderBytes);
+    dest += kDepthTileHeaderBytes;
+
+    for (const auto& tile : TileOut) {
+        const uint32_t tile_size = static_cast<uint32_t>( tile.size() );
+        memcpy(dest, &tile_size, sizeof(uint32_t));
+        dest += sizeof(uint32_t);
+    }
+    for (const auto& tile : TileOut) {
+        memcpy(dest, tile.data(), tile.size());
+        dest += tile.size();
+    }
+
+    return compressed_bytes;
+}
+
+bool DepthDecoder::CanRepeatHigh(
+    const DepthHeader& header,
+    int first_row,
+    int row_count) const
+{
+    if ((header.Flags & DepthFlags_Keyframe) != 0) {
+        return false;
+    }
+    if (header.Width != HighValidWidth ||
+        header.FrameNumber != static_cast<uint16_t>( HighValidFrame + 1 ))
+    {
+        return false;
+    }
+    if (static_cast<int>( High.size() ) != (header.Width * header.Height + 1) / 2) {
+        return false;
+    }
+    for (int row = first_row; row < first_row + row_count; ++row) {
+        if (!HighRowsValid[row]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+DepthResult DepthDecoder::DecompressHigh(
+    const DepthHeader& header,
+    const uint8_t* data,
+    int first_row,
+    int row_count)
+{
+    const int width = header.Width;
+    const int height = header.Height;
+
+    // Rows of High that match this frame after decoding
+    std::vector<uint8_t> rows_valid(height, 0);
+
+    const unsigned section_bytes = header.HighCompressedBytes;
+    if ((header.Flags & DepthFlags_Tiled) == 0)
+    {
+        if (section_bytes == 0) {
+            // Repeat of the whole previous High plane
+            if (!CanRepeatHigh(header, 0, height)) {
+                return DepthResult::MissingFrame;
+            }
+        } else {
+            const bool success = ZstdDecompress(
+                data,
+                section_bytes,
+                header.HighUncompressedBytes,
+                High);
+            if (!success) {
+                HighValidWidth = 0;
+                return DepthResult::Corrupted;
+            }
+        }
+
+        HighValidWidth = width;
+        HighValidFrame = header.FrameNumber;
+        HighRowsValid.assign(height, 1);
+        return DepthResult::Success;
+    }
+
+    if (section_bytes < kDepthTileHeaderBytes) {
+        return DepthResult::Corrupted;
+    }
+    DepthTileHeader tile_header;
+    memcpy(&tile_header, data, kDepthTileHeaderBytes);
+
+    const int tile_rows = tile_header.TileRows;
+    const int tile_count = tile_header.TileCount;
+    if (tile_rows < 1 || RoundTileRows(tile_rows, width) != tile_rows) {
+        return DepthResult::Corrupted;
+    }
+    if (tile_count != (height + tile_rows - 1) / tile_rows) {
+        return DepthResult::Corrupted;
+    }
+    const unsigned table_bytes = kDepthTileHeaderBytes + tile_count * sizeof(uint32_t);
+    if (section_bytes < table_bytes) {
+        return DepthResult::Corrupted;
+    }
+
+    // Find the offset of each tile and make sure they add up
+    std::vector<unsigned> offsets(tile_count + 1);
+    const uint8_t* table = data + kDepthTileHeaderBytes;
+    unsigned offset = table_bytes;
+    for (int tile = 0; tile < tile_count; ++tile) {
+        offsets[tile] = offset;
+        uint32_t tile_size;
+        memcpy(&tile_size, table + tile * sizeof(uint32_t), sizeof(uint32_t));
+        if (tile_size > section_bytes - offset) {
+            return DepthResult::Corrupted;
+        }
+        offset += tile_size;
+    }
+    if (offset != section_bytes) {
+        return DepthResult::Corrupted;
+    }
+    offsets[tile_count] = offset;
+
+    const int first_tile = first_row / tile_rows;
+    const int last_tile = (first_row + row_count - 1) / tile_rows;
+
+    // Repeated tiles keep the rows from the previous frame, even outside
+    // of the rows being decoded, if those rows are still valid
+    for (int tile = 0; tile < tile_count; ++tile) {
+        if (offsets[tile + 1] != offsets[tile]) {
+            continue;
+        }
+        const int tile_first_row = tile * tile_rows;
+        int tile_row_count = height - tile_first_row;
+        if (tile_row_count > tile_rows) {
+            tile_row_count = tile_rows;
+        }
+        if (CanRepeatHigh(header, tile_first_row, tile_row_count)) {
+            memset(rows_valid.data() + tile_first_row, 1, tile_row_count);
+        } else if (tile >= first_tile && tile <= last_tile) {
+            HighValidWidth = 0;
+            return DepthResult::MissingFrame;
+        }
+    }
+
+    const int high_bytes = static_cast<int>( header.HighUncompressedBytes );
+    const int tile_bytes = tile_rows * width / 2;
+    High.resize(high_bytes);
+
+    std::atomic<int> corrupt_tiles(0);
+
+    WorkerPool::Shared().ParallelFor(last_tile - first_tile + 1, [&](int i) {
+        const int tile = first_tile + i;
+        const unsigned tile_size = offsets[tile + 1] - offsets[tile];
+        if (tile_size == 0) {
+            return; // Repeated
+        }
+
+        uint8_t* dest = High.data() + tile * tile_bytes;
+        int bytes = high_bytes - tile * tile_bytes;
+        if (bytes > tile_bytes) {
+            bytes = tile_bytes;
+        }
+
+        const size_t size = ZSTD_decompress(
+            dest,
+            bytes,
+            data + offsets[tile],
+            tile_size);
+        if (ZSTD_isError(size) || size != static_cast<size_t>( bytes )) {
+            // Zero high bits decode as missing depth
+            memset(dest, 0, bytes);
+            ++corrupt_tiles;
+            return;
+        }
+
+        const int tile_first_row = tile * tile_rows;
+        int tile_row_count = height - tile_first_row;
+        if (tile_row_count > tile_rows) {
+            tile_row_count = tile_rows;
+        }
+        memset(rows_valid.data() + tile_first_row, 1, tile_row_count);
+    });
+
+    CorruptTiles = corrupt_tiles;
+    HighValidWidth = width;
+    HighValidFrame = header.FrameNumber;
+    HighRowsValid.swap(rows_valid);
+    return DepthResult::Success;
+}
+
+
+//------------------------------------------------------------------------------
+// Conditional Replenishment
+
+// Returns true if any value in the block moved by more than the threshold,
+// or changed between zero (no data) and non-zero
+static bool BlockChanged(
+    const uint16_t* current,
+    const uint16_t* previous,
+    int width,
+    int block_width,
+    int block_height,
+    int threshold)
+{
+    for (int y = 0; y < block_height; ++y) {
+        for (int x = 0; x < block_width; ++x) {
+            const int a = current[x];
+            const int b = previous[x];
+            if ((a == 0) != (b == 0) || a - b > threshold || b - a > threshold) {
+                return true;
+            }
+        }
+        current += width;
+        previous += width;
+    }
+    return false;
+}
+
+static DEPTH_INLINE uint16_t ZigZagEncode(int x)
+{
+    return static_cast<uint16_t>( x >= 0 ? x * 2 : -x * 2 - 1 );
+}
+
+static DEPTH_INLINE int ZigZagDecode(unsigned x)
+{
+    return (x & 1) ? -static_cast<int>( (x + 1) >> 1 ) : static_cast<int>( x >> 1 );
+}
+
+bool DepthEncoder::CompressReplenish(
+    DepthHeader& header,
+    std::vector<uint8_t>& compressed)
+{
+    const int width = header.Width;
+    const int height = header.Height;
+    if (ReplenishWidth != width || ReplenishHeight != height) {
+        return false;
+    }
+
+    const int blocks_x = (width + kBlockSize - 1) / kBlockSize;
+    const int blocks_y = (height + kBlockSize - 1) / kBlockSize;
+    const int block_count = blocks_x * blocks_y;
+    const int map_bytes = (block_count + 7) / 8;
+    const int max_changed = block_count * Settings.ReplenishMaxPercent / 100;
+
+    const uint16_t* current = QuantizedDepth.data();
+    uint16_t* reference = ReplenishReference.data();
+
+    ReplenishData.assign(map_bytes, 0);
+    ReplenishValues.clear();
+    int changed = 0;
+    int last = 0;
+
+    for (int block_y = 0, block = 0; block_y < blocks_y; ++block_y)
+    {
+        const int y0 = block_y * kBlockSize;
+        const int block_height = height - y0 < kBlockSize ? height - y0 : kBlockSize;
+
+        for (int block_x = 0; block_x < blocks_x; ++block_x, ++block)
+        {
+            const int x0 = block_x * kBlockSize;
+            const int block_width = width - x0 < kBlockSize ? width - x0 : kBlockSize;
+            const int offset = y0 * width + x0;
+
+            if (!BlockChanged(
+                current + offset,
+                reference + offset,
+                width,
+                block_width,
+                block_height,
+                Settings.ReplenishThreshold))
+            {
+                continue;
+            }
+            if (++changed > max_changed) {
+                return false;
+            }
+            ReplenishData[block / 8] |= static_cast<uint8_t>( 1 << (block % 8) );
+
+            // Predict from the left, the first column from above, and the
+            // first pixel from the last value sent
+            for (int y = 0; y < block_height; ++y) {
+                const uint16_t* row = current + offset + y * width;
+                int prediction = (y == 0) ? last : row[-width];
+                for (int x = 0; x < block_width; ++x) {
+                    ReplenishValues.push_back(ZigZagEncode(row[x] - prediction));
+                    prediction = row[x];
+                }
+                last = prediction;
+            }
+        }
+    }
+
+    // Low bytes then high bytes, so the mostly-zero high bytes compress well
+    const int value_count = static_cast<int>( ReplenishValues.size() );
+    ReplenishData.resize(map_bytes + value_count * 2);
+    uint8_t* low = ReplenishData.data() + map_bytes;
+    uint8_t* high = low + value_count;
+    for (int i = 0; i < value_count; ++i) {
+        low[i] = static_cast<uint8_t>( ReplenishValues[i] );
+        high[i] = static_cast<uint8_t>( ReplenishValues[i] >> 8 );
+    }
+
+    const int data_bytes = static_cast<int>( ReplenishData.size() );
+    const int level = ChooseZstdLevel(data_bytes);
+    const unsigned predicted_usec = LevelController.PredictUsec(level, data_bytes);
+    const uint64_t t0 = GetTimeUsec();
+    ZstdCompress(ReplenishData.data(), data_bytes, level, HighOut);
+    const unsigned usec = static_cast<unsigned>( GetTimeUsec() - t0 );
+    LevelController.Update(level, data_bytes, usec);
+
+    // Update the reference the same way the decoder will
+    for (int block_y = 0, block = 0; block_y < blocks_y; ++block_y)
+    {
+        const int y0 = block_y * kBlockSize;
+        const int block_height = height - y0 < kBlockSize ? height - y0 : kBlockSize;
+
+        for (int block_x = 0; block_x < blocks_x; ++block_x, ++block)
+        {
+            if ((ReplenishData[block / 8] & (1 << (block % 8))) == 0) {
+                continue;
+            }
+            const int x0 = block_x * kBlockSize;
+            const int block_width = width - x0 < kBlockSize ? width - x0 : kBlockSize;
+            for (int y = 0; y < block_height; ++y) {
+                const int offset = (y0 + y) * width + x0;
+                memcpy(reference + offset, current + offset, block_width * sizeof(uint16_t));
+            }
+        }
+    }
+
+    // The decoder does not update its High plane for this frame, so the next
+    // frame cannot repeat it
+    HighPreviousWidth = 0;
+
+    header.Flags = (header.Flags & ~DepthFlags_Tiled) | DepthFlags_Replenish;
+    header.MinimumDepth = 0;
+    header.MaximumDepth = 0;
+    header.HighUncompressedBytes = static_cast<uint32_t>( data_bytes );
+    header.HighCompressedBytes = static_cast<uint32_t>( HighOut.size() );
+    header.LowCompressedBytes = 0;
+
+    compressed.resize(kDepthHeaderBytes + HighOut.size());
+    memcpy(compressed.data(), &header, kDepthHeaderBytes);
+    memcpy(compressed.data() + kDepthHeaderBytes, HighOut.data(), HighOut.size());
+
+    Stats.ZstdLevel = level;
+    Stats.HighPredictedUsec = predicted_usec;
+    Stats.HighUsec = usec;
+    Stats.HighBytes = header.HighCompressedBytes;
+    Stats.LowBytes = 0;
+    Stats.ReplenishBlocks = static_cast<unsigned>( changed );
+    return true;
+}
+
+DepthResult DepthDecoder::DecompressReplenish(
+    const DepthHeader& header,
+    const uint8_t* data)
+{
+    const int width = header.Width;
+    const int height = header.Height;
+    if (ReplenishWidth != width ||
+        ReplenishHeight != height ||
+        header.FrameNumber != static_cast<uint16_t>( ReplenishFrame + 1 ))
+    {
+        return DepthResult::MissingFrame;
+    }
+
+    const int blocks_x = (width + kBlockSize - 1) / kBlockSize;
+    const int blocks_y = (height + kBlockSize - 1) / kBlockSize;
+    const int block_count = blocks_x * blocks_y;
+    const unsigned map_bytes = (block_count + 7) / 8;
+
+    const unsigned data_bytes = header.HighUncompressedBytes;
+    if (data_bytes < map_bytes ||
+        data_bytes > map_bytes + width * height * 2 ||
+        (data_bytes - map_bytes) % 2 != 0)
+    {
+        return DepthResult::Corrupted;
+    }
+
+    // From here on a failure leaves the reference partly updated
+    ReplenishWidth = 0;
+
+    const bool success = ZstdDecompress(
+        data,
+        header.HighCompressedBytes,
+        data_bytes,
+        Scratch->ReplenishData);
+    if (!success) {
+        return DepthResult::Corrupted;
+    }
+
+    // Check the map agrees with the number of values
+    const int value_count = static_cast<int>( (data_bytes - map_bytes) / 2 );
+    int expected_count = 0;
+    for (int block_y = 0, block = 0; block_y < blocks_y; ++block_y) {
+        const int y0 = block_y * kBlockSize;
+        const int block_height = height - y0 < kBlockSize ? height - y0 : kBlockSize;
+        for (int block_x = 0; block_x < blocks_x; ++block_x, ++block) {
+            if ((Scratch->ReplenishData[block / 8] & (1 << (block % 8))) != 0) {
+                const int x0 = block_x * kBlockSize;
+                const int block_width = width - x0 < kBlockSize ? width - x0 : kBlockSize;
+                expected_count += block_width * block_height;
+            }
+        }
+    }
+    if (expected_count != value_count) {
+        return DepthResult::Corrupted;
+    }
+
+    const uint8_t* low = Scratch->ReplenishData.data() + map_bytes;
+    const uint8_t* high = low + value_count;
+    uint16_t* reference = ReplenishReference.data();
+    int last = 0;
+
+    for (int block_y = 0, block = 0; block_y < blocks_y; ++block_y)
+    {
+        const int y0 = block_y * kBlockSize;
+        const int block_height = height - y0 < kBlockSize ? height - y0 : kBlockSize;
+
+        for (int block_x = 0; block_x < blocks_x; ++block_x, ++block)
+        {
+            if ((Scratch->ReplenishData[block / 8] & (1 << (block % 8))) == 0) {
+                continue;
+            }
+            const int x0 = block_x * kBlockSize;
+            const int block_width = width - x0 < kBlockSize ? width - x0 : kBlockSize;
+            const int offset = y0 * width + x0;
+
+            for (int y = 0; y < block_height; ++y) {
+                uint16_t* row = reference + offset + y * width;
+                int prediction = (y == 0) ? last : row[-width];
+                for (int x = 0; x < block_width; ++x) {
+                    const int value = prediction + ZigZagDecode(*low++ | (*high++ << 8));
+                    if (value < 0 || value > 2047) {
+                        return DepthResult::Corrupted;
+                    }
+                    row[x] = static_cast<uint16_t>( value );
+                    prediction = value;
+                }
+                last = prediction;
+            }
+        }
+    }
+
+    ReplenishWidth = width;
+    ReplenishFrame = header.FrameNumber;
+    return DepthResult::Success;
+}
+
+
+//------------------------------------------------------------------------------
+// Residual
+
+static void AppendUint32(std::vector<uint8_t>& data, uint32_t value)
+{
+    const size_t offset = data.size();
+    data.resize(offset + sizeof(uint32_t));
+    memcpy(data.data() + offset, &value, sizeof(uint32_t));
+}
+
+static void WriteVarint(std::vector<uint8_t>& data, unsigned value)
+{
+    while (value >= 0x80) {
+        data.push_back(static_cast<uint8_t>( value | 0x80 ));
+        value >>= 7;
+    }
+    data.push_back(static_cast<uint8_t>( value ));
+}
+
+// Returns false if the data ends early or the value is too large
+static bool ReadVarint(const uint8_t*& data, const uint8_t* end, unsigned& value)
+{
+    value = 0;
+    for (int shift = 0; shift < 32; shift += 7) {
+        if (data >= end) {
+            return false;
+        }
+        const unsigned byte = *data++;
+        value |= (byte & 0x7f) << shift;
+        if ((byte & 0x80) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Returns true if the pixel has depth, so its Low byte matters
+static DEPTH_INLINE bool HasDepth(const uint8_t* high, int i)
+{
+    return ((high[i / 2] >> ((i & 1) * 4)) & 15) != 0;
+}
+
+bool DepthEncoder::HasResidual() const
+{
+    return Settings.ResidualBound > 0 || !Settings.LayerBounds.empty();
+}
+
+int DepthEncoder::GetResidualBound() const
+{
+    if (Settings.LayerBounds.empty()) {
+        return Settings.ResidualBound;
+    }
+
+    // Layer bounds are clamped to be non-increasing
+    const int layer_count = std::min(static_cast<int>( Settings.LayerBounds.size() ), kMaxDepthLayers);
+    int bound = std::max(Settings.LayerBounds[0], 0);
+    for (int layer = 1; layer < layer_count; ++layer) {
+        bound = std::min(bound, std::max(Settings.LayerBounds[layer], 0));
+    }
+    return bound;
+}
+
+bool DepthEncoder::CompressResidual(
+    DepthHeader& header,
+    VideoType type)
+{
+    const int width = header.Width;
+    const int height = header.Height;
+
+    // Decode the Low bits the same way the decoder will
+    const bool success = ResidualCodec.Decode(
+        width,
+        height,
+        type,
+        LowOut.data(),
+        static_cast<int>( LowOut.size() ),
+        LowDecoded);
+    const int n = width * height;
+    if (!success || static_cast<int>( LowDecoded.size() ) < n) {
+        return false;
+    }
+
+    // Bounds of each layer from coarse to fine.  Without layers there is
+    // one section for ResidualBound.
+    int bounds[kMaxDepthLayers];
+    const bool layered = !Settings.LayerBounds.empty();
+    int layer_count = 1;
+    bounds[0] = Settings.ResidualBound;
+    if (layered) {
+        layer_count = std::min(static_cast<int>( Settings.LayerBounds.size() ), kMaxDepthLayers);
+        for (int layer = 0; layer < layer_count; ++layer) {
+            int bound = std::max(Settings.LayerBounds[layer], 0);
+            if (layer > 0 && bound > bounds[layer - 1]) {
+                bound = bounds[layer - 1];
+            }
+            bounds[layer] = bound;
+        }
+    }
+
+    // The High bits are lossless, and folding only mirrors the Low byte,
+    // so the depth error of each pixel is exactly its Low byte error
+    const uint8_t* high = High.data();
+    const uint8_t* low = Low.data();
+    const uint8_t* decoded = LowDecoded.data();
+
+    ResidualOut.clear();
+    int total_count = 0;
+    for (int layer = 0; layer < layer_count; ++layer)
+    {
+        // Each layer corrects the pixels the coarser layers left alone
+        const int bound = bounds[layer];
+        const int upper = layer > 0 ? bounds[layer - 1] : 255;
+
+        ResidualData.clear();
+        int last = -1, count = 0;
+        for (int i = 0; i < n; ++i) {
+            const int delta = low[i] - decoded[i];
+            const int error = std::abs(delta);
+            if (error <= bound || error > upper) {
+                continue;
+            }
+            if (!HasDepth(high, i)) {
+                continue;
+            }
+            WriteVarint(ResidualData, static_cast<unsigned>( i - last - 1 ));
+            WriteVarint(ResidualData, ZigZagEncode(delta));
+            last = i;
+            ++count;
+        }
+        total_count += count;
+
+        uint32_t section_bytes = 0;
+        if (count > 0) {
+            ZstdCompress(ResidualData.data(), static_cast<int>( ResidualData.size() ), kZstdLevel, ResidualLayer);
+            section_bytes = static_cast<uint32_t>( sizeof(uint32_t) + ResidualLayer.size() );
+        }
+        if (layered) {
+            AppendUint32(ResidualOut, section_bytes);
+        }
+        if (count > 0) {
+            AppendUint32(ResidualOut, static_cast<uint32_t>( ResidualData.size() ));
+            ResidualOut.insert(ResidualOut.end(), ResidualLayer.begin(), ResidualLayer.end());
+        }
+    }
+
+    Stats.ResidualCount = static_cast<unsigned>( total_count );
+    if (total_count == 0) {
+        ResidualOut.clear();
+        return false;
+    }
+
+    header.Flags |= DepthFlags_Residual;
+    header.ResidualLayers = static_cast<uint8_t>( layered ? layer_count : 0 );
+    return true;
+}
+
+DepthResult DepthDecoder::DecompressResidualLayers(
+    const DepthHeader& header,
+    const uint8_t* data,
+    unsigned bytes,
+    int pixel_count)
+{
+    const int layer_count = header.ResidualLayers;
+    if (layer_count == 0) {
+        return DecompressResidual(data, bytes, pixel_count);
+    }
+
+    for (int layer = 0; layer < layer_count; ++layer) {
+        if (bytes < sizeof(uint32_t)) {
+            return DepthResult::FileTruncated;
+        }
+        uint32_t section_bytes;
+        memcpy(&section_bytes, data, sizeof(uint32_t));
+        data += sizeof(uint32_t);
+        bytes -= sizeof(uint32_t);
+        if (section_bytes > bytes) {
+            return DepthResult::FileTruncated;
+        }
+
+        // Empty layers have no corrections
+        if (section_bytes > 0) {
+            const DepthResult result = DecompressResidual(data, section_bytes, pixel_count);
+            if (result != DepthResult::Success) {
+                return result;
+            }
+        }
+        data += section_bytes;
+        bytes -= section_bytes;
+    }
+
+    return bytes == 0 ? DepthResult::Success : DepthResult::Corrupted;
+}
+
+DepthResult DepthDecoder::DecompressResidual(
+    const uint8_t* data,
+    unsigned bytes,
+    int pixel_count)
+{
+    if (bytes <= sizeof(uint32_t)) {
+        return DepthResult::Corrupted;
+    }
+    uint32_t data_bytes;
+    memcpy(&data_bytes, data, sizeof(uint32_t));
+
+    // Each pixel takes at most 8 bytes
+    const int n = pixel_count;
+    if (static_cast<int>( Scratch->Low.size() ) < n) {
+        return DepthResult::Corrupted;
+    }
+    if (data_bytes < 2 || data_bytes > static_cast<uint32_t>( n ) * 8) {
+        return DepthResult::Corrupted;
+    }
+
+    const bool success = ZstdDecompress(
+        data + sizeof(uint32_t),
+        static_cast<int>( bytes - sizeof(uint32_t) ),
+        static_cast<int>( data_bytes ),
+        Scratch->ResidualData);
+    if (!success) {
+        return DepthResult::Corrupted;
+    }
+
+    const uint8_t* src = Scratch->ResidualData.data();
+    const uint8_t* end = src + data_bytes;
+    uint8_t* low = Scratch->Low.data();
+    int64_t i = -1;
+    while (src < end) {
+        unsigned skip, value;
+        if (!ReadVarint(src, end, skip) || !ReadVarint(src, end, value)) {
+            return DepthResult::Corrupted;
+        }
+        i += static_cast<int64_t>( skip ) + 1;
+        if (i >= n) {
+            return DepthResult::Corrupted;
+        }
+        const int corrected = low[i] + ZigZagDecode(value);
+        if (corrected < 0 || corrected > 255) {
+            return DepthResult::Corrupted;
+        }
+        low[i] = static_cast<uint8_t>( corrected );
+    }
+
+    return DepthResult::Success;
+}
+
+
+//------------------------------------------------------------------------------
+// Whole Values
+
+/*
+    Without a video encoder there is no need to split depth into 8-bit
+    planes, so the rescaled 11-bit image is coded directly with LOCO-I.
+
+    Missing depth (zero) is sent exactly as a bitmask compressed with Zstd.
+    A jump to zero and back costs LOCO-I a lot, and sensors leave many
+    scattered holes, so the encoder tells LOCO-I that those pixels can
+    decode to anything and it fills them in with its own predictions.
+    Other pixels are clamped to at least 1 after decoding so near-lossless
+    errors cannot turn them into holes.
+*/
+
+// Fill in the header of a whole-value frame and write the frame
+static void WriteWholeValueFrame(
+    DepthHeader& header,
+    int mask_bytes,
+    const std::vector<uint8_t>& mask_out,
+    const std::vector<uint8_t>& low_out,
+    std::vector<uint8_t>& compressed)
+{
+    header.Flags = static_cast<uint8_t>( (header.Flags & DepthFlags_Keyframe) |
+        DepthFlags_WholeValue | DepthFlags_LowCodec );
+    header.LowCodec = static_cast<uint8_t>( VideoType::Loco );
+    header.HighUncompressedBytes = static_cast<uint32_t>( mask_bytes );
+    header.HighCompressedBytes = static_cast<uint32_t>( mask_out.size() );
+    header.LowCompressedBytes = static_cast<uint32_t>( low_out.size() );
+
+    compressed.resize(kDepthHeaderBytes + mask_out.size() + low_out.size());
+    uint8_t* copy_dest = compressed.data();
+    memcpy(copy_dest, &header, kDepthHeaderBytes);
+    copy_dest += kDepthHeaderBytes;
+    if (!mask_out.empty()) {
+        memcpy(copy_dest, mask_out.data(), mask_out.size());
+        copy_dest += mask_out.size();
+    }
+    memcpy(copy_dest, low_out.data(), low_out.size());
+}
+
+void DepthEncoder::CompressWholeValue(
+    DepthHeader& header,
+    int near,
+    std::vector<uint8_t>& compressed)
+{
+    if (near < 0) {
+        near = 0;
+    } else if (near > kLocoMaxNear) {
+        near = kLocoMaxNear;
+    }
+
+    const uint16_t* values = QuantizedDepth.data();
+    const int n = static_cast<int>( QuantizedDepth.size() );
+
+    // Build the zero mask in High
+    const int mask_bytes = (n + 7) / 8;
+    High.assign(mask_bytes, 0);
+    bool any_zeros = false;
+    for (int i = 0; i < n; ++i) {
+        if (values[i] == 0) {
+            High[i >> 3] |= static_cast<uint8_t>( 1 << (i & 7) );
+            any_zeros = true;
+        }
+    }
+
+    Stats.ZstdLevel = 0;
+    Stats.HighPredictedUsec = 0;
+    Stats.HighUsec = 0;
+    HighOut.clear();
+    if (any_zeros) {
+        const int level = ChooseZstdLevel(mask_bytes);
+        Stats.ZstdLevel = level;
+        Stats.HighPredictedUsec = LevelController.PredictUsec(level, mask_bytes);
+        const uint64_t t0 = GetTimeUsec();
+        ZstdCompress(High.data(), mask_bytes, level, HighOut);
+        Stats.HighUsec = static_cast<unsigned>( GetTimeUsec() - t0 );
+        LevelController.Update(level, mask_bytes, Stats.HighUsec);
+    }
+
+    LocoCompress16(
+        values,
+        any_zeros ? High.data() : nullptr,
+        header.Width,
+        header.Height,
+        kWholeValueMax,
+        near,
+        LowOut);
+
+    // The video encoder did not see this frame
+    HighPreviousWidth = 0;
+
+    WriteWholeValueFrame(
+        header,
+        any_zeros ? mask_bytes : 0,
+        HighOut,
+        LowOut,
+        compressed);
+
+    Stats.HighBytes = header.HighCompressedBytes;
+    Stats.LowBytes = header.LowCompressedBytes;
+    Stats.ResidualCount = 0;
+    Stats.ResidualBytes = 0;
+}
+
+DepthResult DepthDecoder::DecompressWholeValue(
+    const DepthHeader& header,
+    const uint8_t* data,
+    std::vector<uint16_t>& depth_out)
+{
+    const int n = header.Width * header.Height;
+
+    const bool any_zeros = header.HighUncompressedBytes != 0;
+    if (any_zeros) {
+        if (header.HighUncompressedBytes != static_cast<unsigned>( (n + 7) / 8 )) {
+            return DepthResult::Corrupted;
+        }
+        const bool success = ZstdDecompress(
+            data,
+            header.HighCompressedBytes,
+            header.HighUncompressedBytes,
+            High);
+        if (!success) {
+            return DepthResult::Corrupted;
+        }
+    } else if (header.HighCompressedBytes != 0) {
+        return DepthResult::Corrupted;
+    }
+    data += header.HighCompressedBytes;
+
+    const bool success = LocoDecompress16(
+        data,
+        header.LowCompressedBytes,
+        header.Width,
+        header.Height,
+        kWholeValueMax,
+        depth_out);
+    if (!success) {
+        return DepthResult::Corrupted;
+    }
+
+    uint16_t* values = depth_out.data();
+    const uint8_t* mask = High.data();
+    for (int i = 0; i < n; ++i) {
+        if (any_zeros && (mask[i >> 3] & (1 << (i & 7))) != 0) {
+            values[i] = 0;
+        } else if (values[i] == 0) {
+            values[i] = 1;
+        }
+    }
+
+    UndoRescaleImage_11Bits(header.MinimumDepth, header.MaximumDepth, depth_out);
+    return DepthResult::Success;
+}
+
+
+//------------------------------------------------------------------------------
+// Lossless
+
+/*
+    Lossless frames code the quantized depth, before rescaling, in the
+    style of RVL: Runs of zero and non-zero pixels, then the non-zero values
+    as differences from a prediction, all compressed with one Zstd frame.
+
+    The prediction uses the median edge detector from LOCO-I when the pixels
+    to the left, above and above-left all have depth, and otherwise the left
+    or upper pixel, or the last value in raster order.
+*/
+
+static DEPTH_INLINE int PredictLossless(
+    const uint16_t* depth,
+    int x,
+    int y,
+    int width,
+    int last)
+{
+    const int left = x > 0 ? depth[-1] : 0;
+    const int up = y > 0 ? depth[-width] : 0;
+    if (left != 0 && up != 0) {
+        const int up_left = depth[-width - 1];
+        if (up_left == 0) {
+            return (left + up + 1) >> 1;
+        }
+        const int min_lu = left < up ? left : up;
+        const int max_lu = left < up ? up : left;
+        if (up_left >= max_lu) {
+            return min_lu;
+        }
+        if (up_left <= min_lu) {
+            return max_lu;
+        }
+        return left + up - up_left;
+    }
+    if (left != 0) {
+        return left;
+    }
+    if (up != 0) {
+        return up;
+    }
+    return last;
+}
+
+void DepthEncoder::CompressLossless(
+    int width,
+    int height)
+{
+    const uint16_t* depth = QuantizedDepth.data();
+    const int n = width * height;
+
+    // Runs of zero and then non-zero pixels until the end of the image
+    LosslessData.clear();
+    int value_count = 0;
+    for (int i = 0; i < n;) {
+        int start = i;
+        while (i < n && depth[i] == 0) {
+            ++i;
+        }
+        WriteVarint(LosslessData, static_cast<unsigned>( i - start ));
+        start = i;
+        while (i < n && depth[i] != 0) {
+            ++i;
+        }
+        WriteVarint(LosslessData, static_cast<unsigned>( i - start ));
+        value_count += i - start;
+    }
+
+    // Low bytes of the zig-zag mapped differences, then the high bytes
+    const size_t runs_bytes = LosslessData.size();
+    LosslessData.resize(runs_bytes + value_count * 2);
+    uint8_t* low = LosslessData.data() + runs_bytes;
+    uint8_t* high = low + value_count;
+
+    int last = 0;
+    for (int y = 0, i = 0; y < height; ++y) {
+        for (int x = 0; x < width; ++x, ++i) {
+            const int value = depth[i];
+            if (value == 0) {
+                continue;
+            }
+            const uint16_t mapped = ZigZagEncode(value - PredictLossless(depth + i, x, y, width, last));
+            *low++ = static_cast<uint8_t>( mapped );
+            *high++ = static_cast<uint8_t>( mapped >> 8 );
+            last = value;
+        }
     }
-    ++FrameCount;
 
-#if 0 // This is okay I guess since we are using intra-frame compression.
-    if (!keyframe && frame_number != CompressedFrameNumber + 1) {
-        return DepthResult::MissingPFrame;
-        
-    }
-#endif
+    ZstdCompress(
+        LosslessData.data(),
+        static_cast<int>( LosslessData.size() ),
+        kZstdLevel,
+        LosslessOut);
+}
 
-    width = header->Width;
-    height = header->Height;
-    if (width < 1 || width > 4096 || height < 1 || height > 4096) {
-        return DepthResult::Corrupted;
-    }
+bool DepthEncoder::ChooseLossless(
+    DepthHeader header,
+    float compare_bytes,
+    VideoType low_type,
+    std::vector<uint8_t>& compressed)
+{
+    const size_t lossless_bytes = kDepthHeaderBytes + LosslessOut.size();
+    Stats.LosslessBytes = static_cast<unsigned>( lossless_bytes );
 
-    // Read header
-    unsigned total_bytes = kDepthHeaderBytes + header->HighCompressedBytes + header->LowCompressedBytes;
-    if (header->HighUncompressedBytes < 2) {
-        return DepthResult::Corrupted;
+    const float limit = compare_bytes * (100 + Settings.LosslessMarginPercent) / 100.f;
+    if (lossless_bytes > limit) {
+        return false;
     }
-    if (compressed.size() != total_bytes) {
-        return DepthResult::FileTruncated;
+
+    // The video decoder will not see the frame the video encoder just coded,
+    // so the next frame must not reference it
+    if (HasPFrames(low_type)) {
+        LowKeyframeNeeded = true;
     }
+    HighPreviousWidth = 0;
+
+    header.Flags = (header.Flags & DepthFlags_Keyframe) | DepthFlags_Lossless;
+    header.MinimumDepth = 0;
+    header.MaximumDepth = 0;
+    header.HighUncompressedBytes = static_cast<uint32_t>( LosslessData.size() );
+    header.HighCompressedBytes = static_cast<uint32_t>( LosslessOut.size() );
+    header.LowCompressedBytes = 0;
+    header.LowCodec = 0;
+
+    compressed.resize(lossless_bytes);
+    memcpy(compressed.data(), &header, kDepthHeaderBytes);
+    memcpy(compressed.data() + kDepthHeaderBytes, LosslessOut.data(), LosslessOut.size());
+
+    Stats.Lossless = true;
+    Stats.HighBytes = header.HighCompressedBytes;
+    Stats.LowBytes = 0;
+    Stats.ResidualCount = 0;
+    Stats.ResidualBytes = 0;
+    return true;
+}
 
-    src += kDepthHeaderBytes;
+DepthResult DepthDecoder::DecompressLossless(
+    const DepthHeader& header,
+    const uint8_t* data,
+    std::vector<uint16_t>& depth_out)
+{
+    const int width = header.Width;
+    const int height = header.Height;
+    const int n = width * height;
 
-    // Compress high bits
-    bool success = ZstdDecompress(
-        src,
-        header->HighCompressedBytes,
-        header->HighUncompressedBytes,
-        High);
-    if (!success) {
+    // Each pixel takes at least two bytes, and each run at least one
+    const unsigned data_bytes = header.HighUncompressedBytes;
+    if (data_bytes < 2 || data_bytes > static_cast<unsigned>( n ) * 4 + 10) {
         return DepthResult::Corrupted;
     }
-
-    src += header->HighCompressedBytes;
-
-    success = Codec.Decode(
-        width,
-        height,
-        video_codec_type,
-        src,
-        header->LowCompressedBytes,
-        Low);
+    const bool success = ZstdDecompress(
+        data,
+        header.HighCompressedBytes,
+        data_bytes,
+        Scratch->LosslessData);
     if (!success) {
         return DepthResult::Corrupted;
     }
 
-    src += header->LowCompressedBytes;
+    // Mark the pixels with depth
+    depth_out.resize(n);
+    uint16_t* depth = depth_out.data();
+    const uint8_t* src = Scratch->LosslessData.data();
+    const uint8_t* end = src + data_bytes;
+    int value_count = 0;
+    for (int i = 0; i < n;) {
+        unsigned zeros, values;
+        if (!ReadVarint(src, end, zeros) || zeros > static_cast<unsigned>( n - i )) {
+            return DepthResult::Corrupted;
+        }
+        for (unsigned j = 0; j < zeros; ++j) {
+            depth[i++] = 0;
+        }
+        if (!ReadVarint(src, end, values) || values > static_cast<unsigned>( n - i )) {
+            return DepthResult::Corrupted;
+        }
+        for (unsigned j = 0; j < values; ++j) {
+            depth[i++] = 1;
+        }
+        value_count += static_cast<int>( values );
+    }
+    if (end - src != static_cast<ptrdiff_t>( value_count ) * 2) {
+        return DepthResult::Corrupted;
+    }
 
-    Unfilter(width, height, depth_out);
-    UndoRescaleImage_11Bits(header->MinimumDepth, header->MaximumDepth, depth_out);
-    DequantizeDepthImage(depth_out);
+    // Undo the prediction in raster order
+    const uint8_t* low = src;
+    const uint8_t* high = low + value_count;
+    int last = 0;
+    for (int y = 0, i = 0; y < height; ++y) {
+        for (int x = 0; x < width; ++x, ++i) {
+            if (depth[i] == 0) {
+                continue;
+            }
+            const unsigned mapped = *low++ | (static_cast<unsigned>( *high++ ) << 8);
+            const int value = PredictLossless(depth + i, x, y, width, last) + ZigZagDecode(mapped);
+            if (value < 1 || value > kWholeValueMax) {
+                return DepthResult::Corrupted;
+            }
+            depth[i] = static_cast<uint16_t>( value );
+            last = value;
+        }
+    }
 
     return DepthResult::Success;
 }
 
 
 //------------------------------------------------------------------------------
-// DepthCompressor : Filtering
+// DepthEncoder : Candidates
+
+/*
+    Candidates are whole-value frames at other LocoNear settings, coded on
+    idle worker threads while the calling thread codes the normal frame.
+    They all read one copy of the rescaled depth and its zero mask.
+
+    Candidates are background tasks on the WorkerPool that start after the
+    video encoder, only on idle workers, so the normal frame never waits for
+    them.  Each candidate decodes itself to measure its error.  Compress()
+    waits up to CandidateDeadlineUsec after the normal frame is done and then
+    sends the smallest finished frame within the error budget.  Candidates
+    that have not started by then are dropped.  Running ones hold their own
+    reference to the CandidateFrame, so they finish in the background without
+    touching the encoder.
+*/
+
+struct CandidateResult
+{
+    int Near = 0;
+    std::vector<uint8_t> LowOut;
+    std::vector<uint16_t> Decoded;
+
+    // Error in rescaled units, or false if the frame did not decode
+    bool Valid = false;
+    unsigned MaxError = 0;
+    float Rmse = 0.f;
+
+    // Set under CandidateFrame::Lock when the results above are written
+    bool Done = false;
+};
 
-void DepthCompressor::Filter(
-    const std::vector<uint16_t>& depth_in)
+struct CandidateFrame
 {
-    const int n = static_cast<int>( depth_in.size() );
-    const uint16_t* depth = depth_in.data();
+    // Rescaled depth and zero mask shared by all candidates
+    std::vector<uint16_t> Values;
+    std::vector<uint8_t> Mask, MaskOut;
+    bool AnyZeros = false;
+    bool MaskDone = false;
+    int Width = 0;
+    int Height = 0;
 
-    High.clear();
-    Low.clear();
-    High.resize(n / 2); // One byte for every two depth values
-    Low.resize(n + n / 2); // Leave room for unused chroma channel
+    std::vector<CandidateResult> Results;
 
-    // Split data into high/low parts
-    for (int i = 0; i < n; i += 2) {
-        const uint16_t depth_0 = depth[i];
-        const uint16_t depth_1 = depth[i + 1];
+    std::mutex Lock;
+    std::condition_variable Finished;
+    int Remaining = 0;
 
-        unsigned high_0 = 0, high_1 = 0;
-        uint8_t low_0 = static_cast<uint8_t>( depth_0 );
-        uint8_t low_1 = static_cast<uint8_t>( depth_1 );
+    // Set once the results are no longer wanted, so queued jobs are skipped
+    std::atomic<bool> Cancelled = ATOMIC_VAR_INIT(false);
 
-        if (depth_0 != 0) {
-            // Read high bits
-            high_0 = depth_0 >> 8;
 
-            // Fold to avoid sharp transitions from 255..0
-            if (high_0 & 1) {
-                low_0 = 255 - low_0;
+    // Code and measure one candidate on a worker thread
+    void CodeCandidate(int index)
+    {
+        CandidateResult& result = Results[index];
+        if (Cancelled) {
+            FinishJob();
+            return;
+        }
+        LocoCompress16(
+            Values.data(),
+            AnyZeros ? Mask.data() : nullptr,
+            Width,
+            Height,
+            kWholeValueMax,
+            result.Near,
+            result.LowOut);
+
+        const bool success = LocoDecompress16(
+            result.LowOut.data(),
+            static_cast<int>( result.LowOut.size() ),
+            Width,
+            Height,
+            kWholeValueMax,
+            result.Decoded);
+
+        unsigned max_error = 0;
+        uint64_t sum = 0;
+        int count = 0;
+        if (success) {
+            const int n = Width * Height;
+            const uint16_t* decoded = result.Decoded.data();
+            for (int i = 0; i < n; ++i) {
+                const int value = Values[i];
+                if (value == 0) {
+                    continue;
+                }
+                // Pixels with depth never decode to 0 (see DecompressWholeValue)
+                const int error = std::abs((decoded[i] != 0 ? decoded[i] : 1) - value);
+                if (max_error < static_cast<unsigned>( error )) {
+                    max_error = static_cast<unsigned>( error );
+                }
+                sum += static_cast<unsigned>( error * error );
+                ++count;
             }
+        }
 
-            // Preserve zeroes by offseting the values by 1
-            ++high_0;
+        std::lock_guard<std::mutex> locker(Lock);
+        result.Valid = success;
+        result.MaxError = max_error;
+        result.Rmse = count > 0 ? std::sqrt(static_cast<float>( sum ) / count) : 0.f;
+        result.Done = true;
+        if (--Remaining <= 0) {
+            Finished.notify_all();
         }
+    }
 
-        if (depth_1 != 0) {
-            // Read high bits
-            high_1 = depth_1 >> 8;
+    void CompressMask()
+    {
+        if (Cancelled) {
+            FinishJob();
+            return;
+        }
+        ZstdCompress(Mask.data(), static_cast<int>( Mask.size() ), kZstdLevel, MaskOut);
 
-            // Fold to avoid sharp transitions from 255..0
-            if (high_1 & 1) {
-                low_1 = 255 - low_1;
-            }
+        std::lock_guard<std::mutex> locker(Lock);
+        MaskDone = true;
+        if (--Remaining <= 0) {
+            Finished.notify_all();
+        }
+    }
 
-            // Preserve zeroes by offseting the values by 1
-            ++high_1;
+    // Account for a skipped job without producing a result
+    void FinishJob()
+    {
+        std::lock_guard<std::mutex> locker(Lock);
+        if (--Remaining <= 0) {
+            Finished.notify_all();
         }
+    }
+};
 
-        High[i / 2] = static_cast<uint8_t>( high_0 | (high_1 << 4) );
-        Low[i] = low_0;
-        Low[i + 1] = low_1;
+// Scale from errors in rescaled units to quantized depth units
+static float RescaledErrorScale(const DepthHeader& header)
+{
+    const int range = header.MaximumDepth - header.MinimumDepth + 1;
+    if (range <= 1) {
+        return 0.f; // Every pixel with depth decodes to the minimum
+    }
+    if (range >= 2048) {
+        return 1.f;
+    }
+    return range / 2047.f;
+}
+
+void DepthEncoder::StartCandidates(int width, int height)
+{
+    // Reuse the buffers unless jobs from an earlier frame are still queued
+    // or running.  Those results are stale, so the queued jobs are dropped.
+    if (Candidates && Candidates.use_count() > 1) {
+        Candidates->Cancelled = true;
+        Candidates = nullptr;
+    }
+    if (!Candidates) {
+        Candidates = std::make_shared<CandidateFrame>();
+    }
+    std::shared_ptr<CandidateFrame> frame = Candidates;
+    frame->Cancelled = false;
+
+    // Candidates only use workers that would otherwise be idle, and one idle
+    // worker is left for the video encoder of the next frame, since running
+    // candidates cannot be stopped.  Later candidates are not coded this
+    // frame if there are not enough idle workers.
+    WorkerPool& pool = WorkerPool::Shared();
+    const int count = std::min(
+        static_cast<int>( Settings.CandidateNears.size() ),
+        std::max(pool.IdleThreadCount() - 1, 0));
+    frame->Results.resize(Settings.CandidateNears.size());
+    for (CandidateResult& result : frame->Results) {
+        result.Done = false;
+    }
+    Stats.CandidatesStarted = static_cast<unsigned>( count );
+    if (count <= 0) {
+        frame->Remaining = 0;
+        frame->MaskDone = false;
+        return;
+    }
+
+    frame->Values = QuantizedDepth;
+    frame->Width = width;
+    frame->Height = height;
+
+    const int n = width * height;
+    const int mask_bytes = (n + 7) / 8;
+    frame->Mask.assign(mask_bytes, 0);
+    frame->AnyZeros = false;
+    const uint16_t* values = frame->Values.data();
+    uint8_t* mask = frame->Mask.data();
+    for (int i = 0; i < n; ++i) {
+        if (values[i] == 0) {
+            mask[i >> 3] |= static_cast<uint8_t>( 1 << (i & 7) );
+            frame->AnyZeros = true;
+        }
+    }
+    frame->MaskOut.clear();
+    frame->MaskDone = !frame->AnyZeros;
+
+    for (int i = 0; i < count; ++i) {
+        int near = Settings.CandidateNears[i];
+        if (near < 0) {
+            near = 0;
+        } else if (near > kLocoMaxNear) {
+            near = kLocoMaxNear;
+        }
+        frame->Results[i].Near = near;
+    }
+    frame->Remaining = count + (frame->AnyZeros ? 1 : 0);
+
+    if (frame->AnyZeros) {
+        pool.SubmitBackground([frame]() {
+            frame->CompressMask();
+        });
+    }
+    for (int i = 0; i < count; ++i) {
+        pool.SubmitBackground([frame, i]() {
+            frame->CodeCandidate(i);
+        });
     }
 }
 
-void DepthCompressor::Unfilter(
+bool DepthEncoder::MeasureLowError(
     int width,
     int height,
-    std::vector<uint16_t>& depth_out)
+    VideoType type,
+    float& max_error,
+    float& rmse)
 {
+    // The residual pass already decoded this frame, and decoding it again
+    // would advance the state of P-frame decoders
+    const bool residual = HasResidual();
+    if (!residual) {
+        const bool success = ResidualCodec.Decode(
+            width,
+            height,
+            type,
+            LowOut.data(),
+            static_cast<int>( LowOut.size() ),
+            LowDecoded);
+        if (!success) {
+            return false;
+        }
+    }
     const int n = width * height;
-    depth_out.resize(n);
-    uint16_t* depth = depth_out.data();
-    const uint8_t* low_data = Low.data();
-    const uint8_t* high_data = High.data();
+    if (static_cast<int>( LowDecoded.size() ) < n) {
+        return false;
+    }
 
-    for (int i = 0; i < n; i += 2) {
-        const uint8_t high = high_data[i / 2];
-        uint8_t low_0 = low_data[i];
-        uint8_t low_1 = low_data[i + 1];
-        unsigned high_0 = high & 15;
-        unsigned high_1 = high >> 4;
+    // Low bytes that are off by more than the bound were corrected exactly
+    const int bound = GetResidualBound();
+    const uint8_t* high = High.data();
+    const uint8_t* low = Low.data();
+    const uint8_t* decoded = LowDecoded.data();
 
-        if (high_0 == 0) {
-            depth[i] = 0;
-        } else {
-            high_0--;
-            if (high_0 & 1) {
-                low_0 = 255 - low_0;
-            }
-            uint16_t x = static_cast<uint16_t>(low_0 | (high_0 << 8));
+    int largest = 0, count = 0;
+    uint64_t sum = 0;
+    for (int i = 0; i < n; ++i) {
+        if (!HasDepth(high, i)) {
+            continue;
+        }
+        int error = std::abs(low[i] - decoded[i]);
+        if (residual && error > bound) {
+            error = 0;
+        }
+        if (largest < error) {
+            largest = error;
+        }
+        sum += static_cast<unsigned>( error * error );
+        ++count;
+    }
 
-            // This value is expected to always be at least 1
-            if (x == 0) {
-                x = 1;
-            }
+    max_error = static_cast<float>( largest );
+    rmse = count > 0 ? std::sqrt(static_cast<float>( sum ) / count) : 0.f;
+    return true;
+}
+
+void DepthEncoder::CancelCandidates()
+{
+    if (Candidates) {
+        Candidates->Cancelled = true;
+    }
+}
 
-            depth[i] = x;
+bool DepthEncoder::FinishCandidates(
+    DepthHeader header,
+    VideoType low_type,
+    float compare_bytes,
+    bool measured,
+    float max_error,
+    float rmse,
+    std::vector<uint8_t>& compressed)
+{
+    std::shared_ptr<CandidateFrame> frame = Candidates;
+    const int count = static_cast<int>( frame->Results.size() );
+
+    const float scale = RescaledErrorScale(header);
+    const int max_allowed = Settings.CandidateMaxError;
+    const float rmse_allowed = Settings.CandidateMaxRmse;
+
+    // The normal frame is kept if it is within the budget and smallest, or
+    // if no candidate is within the budget
+    float best_bytes = 0.f;
+    bool normal_ok = true;
+    if (max_allowed > 0 || rmse_allowed > 0.f) {
+        normal_ok = measured &&
+            (max_allowed <= 0 || max_error * scale <= max_allowed) &&
+            (rmse_allowed <= 0.f || rmse * scale <= rmse_allowed);
+    }
+    if (normal_ok) {
+        // Forced keyframes are sent until the P-frame size is known
+        if (compare_bytes <= 0.f) {
+            frame->Cancelled = true;
+            return false;
         }
+        best_bytes = compare_bytes;
+    }
 
-        if (high_1 == 0) {
-            depth[i + 1] = 0;
-        } else {
-            high_1--;
-            if (high_1 & 1) {
-                low_1 = 255 - low_1;
-            }
-            uint16_t y = static_cast<uint16_t>(low_1 | (high_1 << 8));
+    // Wait for the rest of the candidates until the deadline.  Any that are
+    // still queued after that are dropped.
+    std::vector<bool> done(count);
+    bool mask_done;
+    {
+        const uint64_t t0 = GetTimeUsec();
+        const auto deadline = std::chrono::steady_clock::now() +
+            std::chrono::microseconds(Settings.CandidateDeadlineUsec);
+        std::unique_lock<std::mutex> locker(frame->Lock);
+        frame->Finished.wait_until(locker, deadline, [&frame]() {
+            return frame->Remaining <= 0;
+        });
+        for (int i = 0; i < count; ++i) {
+            done[i] = frame->Results[i].Done;
+        }
+        mask_done = frame->MaskDone;
+        frame->Cancelled = true;
+        Stats.CandidateWaitUsec = static_cast<unsigned>( GetTimeUsec() - t0 );
+    }
+
+    int best = -1, finished = 0;
+    for (int i = 0; i < count; ++i) {
+        const CandidateResult& result = frame->Results[i];
+        if (!done[i] || !mask_done || !result.Valid) {
+            continue;
+        }
+        ++finished;
+
+        if ((max_allowed > 0 && result.MaxError * scale > max_allowed) ||
+            (rmse_allowed > 0.f && result.Rmse * scale > rmse_allowed))
+        {
+            continue;
+        }
+        const float bytes = static_cast<float>( kDepthHeaderBytes + frame->MaskOut.size() + result.LowOut.size() );
+        if (best_bytes <= 0.f || bytes < best_bytes) {
+            best_bytes = bytes;
+            best = i;
+        }
+    }
+
+    Stats.CandidatesFinished = static_cast<unsigned>( finished );
+    if (best < 0) {
+        return false;
+    }
+
+    if (HasPFrames(low_type)) {
+        LowKeyframeNeeded = true;
+    }
+    HighPreviousWidth = 0;
+
+    const CandidateResult& result = frame->Results[best];
+    WriteWholeValueFrame(
+        header,
+        frame->AnyZeros ? static_cast<int>( frame->Mask.size() ) : 0,
+        frame->MaskOut,
+        result.LowOut,
+        compressed);
+
+    Stats.Candidate = best;
+    Stats.HighBytes = header.HighCompressedBytes;
+    Stats.LowBytes = header.LowCompressedBytes;
+    Stats.ResidualCount = 0;
+    Stats.ResidualBytes = 0;
+    return true;
+}
+
+
+//------------------------------------------------------------------------------
+// DepthDecoder : Deblocking
+
+/*
+    H.264, H.265 and the DCT backend quantize 8x8 blocks independently, so
+    smooth ramps in the Low bits come back with small steps at block edges.
+
+    Each block edge is filtered four pixels at a time across the edge:
+    p1 p0 | q0 q1.  If all four pixels have the same non-zero High bits then
+    the depth is continuous there, and a small step between p0 and q0 with
+    flat sides is treated as an artifact.  That step is smoothed with the
+    H.264 normal filter, moving p0 and q0 by at most kDeblockClip.  Folding
+    mirrors the Low bits for odd High values, which keeps steps the same size,
+    so the filter does not need to look at the fold.
+
+    Vertical edges are filtered first and then horizontal edges, as in H.264.
+    The SSE2 version produces exactly the same output as the scalar version.
+*/
+
+// Block edges are on this grid
+static const int kDeblockGrid = 8;
+
+// Steps across the edge smaller than this are smoothed
+static const int kDeblockAlpha = 12;
+
+// Steps on each side of the edge must be smaller than this
+static const int kDeblockBeta = 4;
+
+// Largest change to a pixel
+static const int kDeblockClip = 4;
+
+// Filter one edge position.  `low` and `high` point at q0, and `step` is
+// the distance between pixels across the edge
+static DEPTH_INLINE void DeblockScalar(uint8_t* low, const uint8_t* high, int step)
+{
+    const unsigned h = high[0];
+    if (h == 0 || high[-2 * step] != h || high[-step] != h || high[step] != h) {
+        return;
+    }
+
+    const int p1 = low[-2 * step], p0 = low[-step];
+    const int q0 = low[0], q1 = low[step];
+    if (abs(p0 - q0) >= kDeblockAlpha ||
+        abs(p1 - p0) >= kDeblockBeta ||
+        abs(q1 - q0) >= kDeblockBeta)
+    {
+        return;
+    }
+
+    int delta = ((q0 - p0) * 4 + (p1 - q1) + 4) >> 3;
+    delta = std::min(std::max(delta, -kDeblockClip), kDeblockClip);
+
+    low[-step] = static_cast<uint8_t>( std::min(std::max(p0 + delta, 0), 255) );
+    low[0] = static_cast<uint8_t>( std::min(std::max(q0 - delta, 0), 255) );
+}
+
+#ifdef DEPTH_ENABLE_SSE2
+
+static DEPTH_INLINE __m128i AbsDiffU8(__m128i a, __m128i b)
+{
+    return _mm_or_si128(_mm_subs_epu8(a, b), _mm_subs_epu8(b, a));
+}
+
+// Filter 16 edge positions at once.  Updates p0 and q0
+static DEPTH_INLINE void DeblockSse2(
+    __m128i p1, __m128i& p0, __m128i& q0, __m128i q1,
+    __m128i hp1, __m128i hp0, __m128i hq0, __m128i hq1)
+{
+    const __m128i zero = _mm_setzero_si128();
+
+    // Same non-zero High bits on all four pixels
+    __m128i mask = _mm_and_si128(_mm_cmpeq_epi8(hp1, hp0), _mm_cmpeq_epi8(hq0, hq1));
+    mask = _mm_and_si128(mask, _mm_cmpeq_epi8(hp0, hq0));
+    mask = _mm_andnot_si128(_mm_cmpeq_epi8(hq0, zero), mask);
+
+    // Small steps: |a - b| < limit is (|a - b| -sat (limit - 1)) == 0
+    const __m128i alpha = _mm_set1_epi8(kDeblockAlpha - 1);
+    const __m128i beta = _mm_set1_epi8(kDeblockBeta - 1);
+    mask = _mm_and_si128(mask, _mm_cmpeq_epi8(_mm_subs_epu8(AbsDiffU8(p0, q0), alpha), zero));
+    mask = _mm_and_si128(mask, _mm_cmpeq_epi8(_mm_subs_epu8(AbsDiffU8(p1, p0), beta), zero));
+    mask = _mm_and_si128(mask, _mm_cmpeq_epi8(_mm_subs_epu8(AbsDiffU8(q1, q0), beta), zero));
+
+    if (_mm_movemask_epi8(mask) == 0) {
+        return;
+    }
+
+    const __m128i round = _mm_set1_epi16(4);
+    const __m128i clip_hi = _mm_set1_epi16(kDeblockClip);
+    const __m128i clip_lo = _mm_set1_epi16(-kDeblockClip);
+
+    __m128i p0_out[2], q0_out[2];
+    for (int half = 0; half < 2; ++half)
+    {
+        const __m128i wp1 = half ? _mm_unpackhi_epi8(p1, zero) : _mm_unpacklo_epi8(p1, zero);
+        const __m128i wp0 = half ? _mm_unpackhi_epi8(p0, zero) : _mm_unpacklo_epi8(p0, zero);
+        const __m128i wq0 = half ? _mm_unpackhi_epi8(q0, zero) : _mm_unpacklo_epi8(q0, zero);
+        const __m128i wq1 = half ? _mm_unpackhi_epi8(q1, zero) : _mm_unpacklo_epi8(q1, zero);
+
+        __m128i delta = _mm_slli_epi16(_mm_sub_epi16(wq0, wp0), 2);
+        delta = _mm_add_epi16(delta, _mm_sub_epi16(wp1, wq1));
+        delta = _mm_srai_epi16(_mm_add_epi16(delta, round), 3);
+        delta = _mm_min_epi16(_mm_max_epi16(delta, clip_lo), clip_hi);
+
+        p0_out[half] = _mm_add_epi16(wp0, delta);
+        q0_out[half] = _mm_sub_epi16(wq0, delta);
+    }
+
+    const __m128i p0_new = _mm_packus_epi16(p0_out[0], p0_out[1]);
+    const __m128i q0_new = _mm_packus_epi16(q0_out[0], q0_out[1]);
+    p0 = _mm_or_si128(_mm_and_si128(mask, p0_new), _mm_andnot_si128(mask, p0));
+    q0 = _mm_or_si128(_mm_and_si128(mask, q0_new), _mm_andnot_si128(mask, q0));
+}
+
+// Load 4 bytes from each of 16 rows and transpose into 4 columns
+static DEPTH_INLINE void LoadColumns16x4(
+    const uint8_t* data,
+    int stride,
+    __m128i& c0, __m128i& c1, __m128i& c2, __m128i& c3)
+{
+    int32_t words[16];
+    for (int i = 0; i < 16; ++i) {
+        memcpy(&words[i], data + i * stride, 4);
+    }
+
+    // Rows 0-3, 4-7, 8-11, 12-15 with 4 bytes each
+    const __m128i r0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>( words ));
+    const __m128i r1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>( words + 4 ));
+    const __m128i r2 = _mm_loadu_si128(reinterpret_cast<const __m128i*>( words + 8 ));
+    const __m128i r3 = _mm_loadu_si128(reinterpret_cast<const __m128i*>( words + 12 ));
+
+    // Interleave rows i and i+4, and then rows i and i+2 ...
+    const __m128i t0 = _mm_unpacklo_epi8(r0, r1);
+    const __m128i t1 = _mm_unpackhi_epi8(r0, r1);
+    const __m128i t2 = _mm_unpacklo_epi8(r2, r3);
+    const __m128i t3 = _mm_unpackhi_epi8(r2, r3);
+
+    const __m128i u0 = _mm_unpacklo_epi8(t0, t1);
+    const __m128i u1 = _mm_unpackhi_epi8(t0, t1);
+    const __m128i u2 = _mm_unpacklo_epi8(t2, t3);
+    const __m128i u3 = _mm_unpackhi_epi8(t2, t3);
+
+    // ... so each half of v holds one column of 8 rows
+    const __m128i v0 = _mm_unpacklo_epi8(u0, u1);
+    const __m128i v1 = _mm_unpackhi_epi8(u0, u1);
+    const __m128i v2 = _mm_unpacklo_epi8(u2, u3);
+    const __m128i v3 = _mm_unpackhi_epi8(u2, u3);
+
+    c0 = _mm_unpacklo_epi64(v0, v2);
+    c1 = _mm_unpackhi_epi64(v0, v2);
+    c2 = _mm_unpacklo_epi64(v1, v3);
+    c3 = _mm_unpackhi_epi64(v1, v3);
+}
+
+#endif // DEPTH_ENABLE_SSE2
+
+void DepthDecoder::DeblockLow(
+    int width,
+    int first_row,
+    int row_count)
+{
+    const int n = width * (first_row + row_count);
+    Scratch->HighNibbles.resize(n);
+    uint8_t* nibbles = Scratch->HighNibbles.data();
+    uint8_t* low = Scratch->Low.data();
+    const uint8_t* high = High.data();
+
+    // Unpack the High bits for each pixel in the rows
+    const int pairs = n / 2;
+    int i = first_row * width / 2;
+#ifdef DEPTH_ENABLE_SSE2
+    const __m128i low_nibble = _mm_set1_epi8(15);
+    for (; i + 16 <= pairs; i += 16)
+    {
+        const __m128i packed = _mm_loadu_si128(reinterpret_cast<const __m128i*>( high + i ));
+        const __m128i even = _mm_and_si128(packed, low_nibble);
+        const __m128i odd = _mm_and_si128(_mm_srli_epi16(packed, 4), low_nibble);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>( nibbles + i * 2 ), _mm_unpacklo_epi8(even, odd));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>( nibbles + i * 2 + 16 ), _mm_unpackhi_epi8(even, odd));
+    }
+#endif // DEPTH_ENABLE_SSE2
+    for (; i < pairs; ++i) {
+        nibbles[i * 2] = high[i] & 15;
+        nibbles[i * 2 + 1] = high[i] >> 4;
+    }
+    if (n & 1) {
+        nibbles[n - 1] = high[n / 2] & 15;
+    }
+
+    const int end_row = first_row + row_count;
 
-            // This value is expected to always be at least 1
-            if (y == 0) {
-                y = 1;
+    // Vertical edges, in bands of 16 rows to stay in cache
+    for (int y = first_row; y < end_row;)
+    {
+        int band_rows = end_row - y;
+#ifdef DEPTH_ENABLE_SSE2
+        if (band_rows >= 16) {
+            band_rows = 16;
+        }
+#endif // DEPTH_ENABLE_SSE2
+
+        for (int x = kDeblockGrid; x + 1 < width; x += kDeblockGrid)
+        {
+            const int offset = y * width + x;
+#ifdef DEPTH_ENABLE_SSE2
+            if (band_rows == 16)
+            {
+                __m128i p1, p0, q0, q1, hp1, hp0, hq0, hq1;
+                LoadColumns16x4(low + offset - 2, width, p1, p0, q0, q1);
+                LoadColumns16x4(nibbles + offset - 2, width, hp1, hp0, hq0, hq1);
+
+                DeblockSse2(p1, p0, q0, q1, hp1, hp0, hq0, hq1);
+
+                uint16_t results[16];
+                _mm_storeu_si128(reinterpret_cast<__m128i*>( results ), _mm_unpacklo_epi8(p0, q0));
+                _mm_storeu_si128(reinterpret_cast<__m128i*>( results + 8 ), _mm_unpackhi_epi8(p0, q0));
+                for (int row = 0; row < 16; ++row) {
+                    memcpy(low + offset + row * width - 1, &results[row], 2);
+                }
+                continue;
             }
+#endif // DEPTH_ENABLE_SSE2
+            for (int row = 0; row < band_rows; ++row) {
+                DeblockScalar(low + offset + row * width, nibbles + offset + row * width, 1);
+            }
+        }
+
+        y += band_rows;
+    }
+
+    // Horizontal edges with all four rows inside the decoded rows
+    int first_edge = first_row + 2 + kDeblockGrid - 1;
+    first_edge -= first_edge % kDeblockGrid;
+    for (int y = first_edge; y + 1 < end_row; y += kDeblockGrid)
+    {
+        uint8_t* low_row = low + y * width;
+        const uint8_t* high_row = nibbles + y * width;
+
+        int x = 0;
+#ifdef DEPTH_ENABLE_SSE2
+        for (; x + 16 <= width; x += 16)
+        {
+            __m128i p1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>( low_row + x - 2 * width ));
+            __m128i p0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>( low_row + x - width ));
+            __m128i q0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>( low_row + x ));
+            __m128i q1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>( low_row + x + width ));
+            const __m128i hp1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>( high_row + x - 2 * width ));
+            const __m128i hp0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>( high_row + x - width ));
+            const __m128i hq0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>( high_row + x ));
+            const __m128i hq1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>( high_row + x + width ));
+
+            DeblockSse2(p1, p0, q0, q1, hp1, hp0, hq0, hq1);
+
+            _mm_storeu_si128(reinterpret_cast<__m128i*>( low_row + x - width ), p0);
+            _mm_storeu_si128(reinterpret_cast<__m128i*>( low_row + x ), q0);
+        }
+#endif // DEPTH_ENABLE_SSE2
+        for (; x < width; ++x) {
+            DeblockScalar(low_row + x, high_row + x, width);
+        }
+    }
+}
+
+
+//------------------------------------------------------------------------------
+// Filtering
+
+// Split one pixel into its 4 high bits, which are returned, and 8 low bits
+static DEPTH_INLINE unsigned FilterValue(uint16_t depth, uint8_t& low)
+{
+    low = static_cast<uint8_t>( depth );
+    if (depth == 0) {
+        return 0;
+    }
+
+    // Read high bits
+    const unsigned high = depth >> 8;
+
+    // Fold to avoid sharp transitions from 255..0
+    if (high & 1) {
+        low = 255 - low;
+    }
+
+    // Preserve zeroes by offseting the values by 1
+    return high + 1;
+}
+
+void DepthEncoder::Filter(
+    const std::vector<uint16_t>& depth_in,
+    VideoLayout layout)
+{
+    const int n = static_cast<int>( depth_in.size() );
+    const uint16_t* depth = depth_in.data();
+
+    // Every byte is overwritten below, so the planes are not cleared.
+    // NV12 chroma is never written, so it stays zero once it is allocated.
+    const int low_bytes = GetVideoLayoutBytes(layout, n, 1);
+    const int previous_bytes = static_cast<int>( Low.size() );
+    if (previous_bytes != low_bytes && previous_bytes > n) {
+        Low.resize(n);
+    }
+    High.resize((n + 1) / 2); // One byte for every two depth values
+    Low.resize(low_bytes);
+
+    // Split data into high/low parts
+    const int pairs_end = n & ~1;
+    for (int i = 0; i < pairs_end; i += 2) {
+        uint8_t low_0, low_1;
+        const unsigned high_0 = FilterValue(depth[i], low_0);
+        const unsigned high_1 = FilterValue(depth[i + 1], low_1);
+
+        High[i / 2] = static_cast<uint8_t>( high_0 | (high_1 << 4) );
+        Low[i] = low_0;
+        Low[i + 1] = low_1;
+    }
+
+    // The last pixel of an odd-sized image has a byte to itself
+    if (n & 1) {
+        uint8_t low_0;
+        High[n / 2] = static_cast<uint8_t>( FilterValue(depth[n - 1], low_0) );
+        Low[n - 1] = low_0;
+    }
+}
+
+// Undo the transform for one pixel given its 4 high bits and 8 low bits
+static DEPTH_INLINE uint16_t UnfilterValue(unsigned high, uint8_t low)
+{
+    if (high == 0) {
+        return 0;
+    }
+    high--;
+    if (high & 1) {
+        low = 255 - low;
+    }
+    const uint16_t x = static_cast<uint16_t>(low | (high << 8));
+
+    // This value is expected to always be at least 1
+    if (x == 0) {
+        return 1;
+    }
+    return x;
+}
+
+void DepthDecoder::Unfilter(
+    int begin,
+    int end,
+    std::vector<uint16_t>& depth_out)
+{
+    depth_out.resize(end - begin);
+    uint16_t* depth = depth_out.data() - begin;
+    const uint8_t* low_data = Scratch->Low.data();
+    const uint8_t* high_data = High.data();
+
+    // Pixels are packed in pairs so handle an unpaired pixel on either end
+    int i = begin;
+    if (i & 1) {
+        depth[i] = UnfilterValue(high_data[i / 2] >> 4, low_data[i]);
+        ++i;
+    }
+    if (end & 1) {
+        --end;
+        depth[end] = UnfilterValue(high_data[end / 2] & 15, low_data[end]);
+    }
+
+    for (; i < end; i += 2) {
+        const uint8_t high = high_data[i / 2];
+        depth[i] = UnfilterValue(high & 15, low_data[i]);
+        depth[i + 1] = UnfilterValue(high >> 4, low_data[i + 1]);
+    }
+}
+
+void DepthDecoder::UnfilterPreview(
+    int width,
+    int height,
+    int scale,
+    bool has_low,
+    std::vector<uint16_t>& depth_out)
+{
+    const int preview_width = (width + scale - 1) / scale;
+    const int preview_height = (height + scale - 1) / scale;
+    depth_out.resize(preview_width * preview_height);
+    uint16_t* depth = depth_out.data();
+    const uint8_t* low_data = Scratch->Low.data();
+    const uint8_t* high_data = High.data();
 
-            depth[i + 1] = y;
+    // Without the Low bits each pixel is put in the middle of its High step
+    for (int y = 0; y < height; y += scale) {
+        for (int x = 0; x < width; x += scale) {
+            const int i = y * width + x;
+            const unsigned high = (high_data[i / 2] >> ((i & 1) * 4)) & 15;
+            *depth++ = UnfilterValue(high, has_low ? low_data[i] : 128);
         }
     }
 }